@@ -293,7 +293,7 @@ namespace cparse::builtin_functions {
         if (base->m_type == TokenType::MAP) {
             typeFuncs = static_cast<const TokenMap *>(base);
         } else {
-            typeFuncs = &ObjectTypeRegistry::typeMap(base->m_type);
+            typeFuncs = &ObjectTypeRegistry::constTypeMap(base->m_type);
         }
 
         // Check if this type has a custom stringify function:
@@ -321,36 +321,36 @@ namespace cparse::builtin_functions {
             TokenMap &scope = config.scope;
 
             if (def & Config::BuiltInDefinition::SystemFunctions) {
-                scope["print"] = CppFunction(&default_print, "print");
+                scope["print"] = CppFunction(&default_print, "print").setBindings(Function::BindArgs);
             }
 
             if (def & Config::BuiltInDefinition::MathFunctions) {
-                scope["sum"] = CppFunction(&default_sum, "sum");
-                scope["sqrt"] = CppFunction(&default_sqrt, {"num"}, "sqrt");
-                scope["sin"] = CppFunction(&default_sin, {"num"}, "sin");
-                scope["cos"] = CppFunction(&default_cos, {"num"}, "cos");
-                scope["tan"] = CppFunction(&default_tan, {"num"}, "tan");
-                scope["abs"] = CppFunction(&default_abs, {"num"}, "abs");
-                scope["pow"] = CppFunction(&default_pow, pow_args, "pow");
-                scope["min"] = CppFunction(&default_min, min_max_args, "min");
-                scope["max"] = CppFunction(&default_max, min_max_args, "max");
-                scope["float"] = CppFunction(&default_real, {"value"}, "float");
-                scope["real"] = CppFunction(&default_real, {"value"}, "real");
-                scope["double"] = CppFunction(&default_real, {"value"}, "double");
-                scope["int"] = CppFunction(&default_int, {"value"}, "int");
+                scope["sum"] = CppFunction(&default_sum, "sum").setBindings(Function::BindArgs).setPure();
+                scope["sqrt"] = CppFunction(&default_sqrt, {"num"}, "sqrt").setBindings(Function::BindNone).setPure();
+                scope["sin"] = CppFunction(&default_sin, {"num"}, "sin").setBindings(Function::BindNone).setPure();
+                scope["cos"] = CppFunction(&default_cos, {"num"}, "cos").setBindings(Function::BindNone).setPure();
+                scope["tan"] = CppFunction(&default_tan, {"num"}, "tan").setBindings(Function::BindNone).setPure();
+                scope["abs"] = CppFunction(&default_abs, {"num"}, "abs").setBindings(Function::BindNone).setPure();
+                scope["pow"] = CppFunction(&default_pow, pow_args, "pow").setBindings(Function::BindNone).setPure();
+                scope["min"] = CppFunction(&default_min, min_max_args, "min").setBindings(Function::BindNone).setPure();
+                scope["max"] = CppFunction(&default_max, min_max_args, "max").setBindings(Function::BindNone).setPure();
+                scope["float"] = CppFunction(&default_real, {"value"}, "float").setBindings(Function::BindNone).setPure();
+                scope["real"] = CppFunction(&default_real, {"value"}, "real").setBindings(Function::BindNone).setPure();
+                scope["double"] = CppFunction(&default_real, {"value"}, "double").setBindings(Function::BindNone).setPure();
+                scope["int"] = CppFunction(&default_int, {"value"}, "int").setBindings(Function::BindNone).setPure();
             }
 
             if (def & Config::BuiltInDefinition::SystemFunctions) {
-                scope["str"] = CppFunction(&default_str, {"value"}, "str");
+                scope["str"] = CppFunction(&default_str, {"value"}, "str").setBindings(Function::BindNone).setPure();
                 scope["eval"] = CppFunction(&default_eval, {"value"}, "eval");
-                scope["type"] = CppFunction(&default_type, {"value"}, "type");
-                scope["extend"] = CppFunction(&default_extend, {"value"}, "extend");
+                scope["type"] = CppFunction(&default_type, {"value"}, "type").setBindings(Function::BindNone).setPure();
+                scope["extend"] = CppFunction(&default_extend, {"value"}, "extend").setBindings(Function::BindNone);
             }
 
             if (def & Config::BuiltInDefinition::ObjectOperators) {
                 // Default constructors:
-                scope["list"] = CppFunction(&default_list, "list");
-                scope["map"] = CppFunction(&default_map, "map");
+                scope["list"] = CppFunction(&default_list, "list").setBindings(Function::BindArgs);
+                scope["map"] = CppFunction(&default_map, "map").setBindings(Function::BindKwargs);
             }
 
             // Set the custom str function to `PackToken_str()`
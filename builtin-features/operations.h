@@ -2,6 +2,10 @@
 #define CPARSE_BUILTIN_OPERATIONS_H
 
 #include <cmath>
+#include <functional>
+#include <type_traits>
+
+#include <QtNumeric>
 
 #include "cparse/cparse.h"
 #include "cparse/calculator.h"
@@ -127,10 +131,10 @@ namespace cparse::builtin_operations {
             return PackToken::Reject();
         }
 
-        TokenMap &attr_map = ObjectTypeRegistry::typeMap(p_left->m_type);
+        const TokenMap &attr_map = ObjectTypeRegistry::constTypeMap(p_left->m_type);
         QString key = p_right.asString();
 
-        PackToken *attr = attr_map.find(key);
+        const PackToken *attr = attr_map.find(key);
 
         if (attr) {
             // Note: If attr is a function, it will receive have
@@ -161,12 +165,69 @@ namespace cparse::builtin_operations {
         return PackToken::Error();
     }
 
+    // Exact arithmetic and comparisons on two INT operands. Returns false
+    // for the operators (and overflowing results) that are left to the
+    // real numbers path:
+    bool IntegerOperation(qint64 left, qint64 right, const QString &op, PackToken *result)
+    {
+        qint64 value;
+
+        if (op == "+") {
+            if (qAddOverflow(left, right, &value)) {
+                return false;
+            }
+
+            *result = value;
+            return true;
+        }
+
+        if (op == "-") {
+            if (qSubOverflow(left, right, &value)) {
+                return false;
+            }
+
+            *result = value;
+            return true;
+        }
+
+        if (op == "*") {
+            if (qMulOverflow(left, right, &value)) {
+                return false;
+            }
+
+            *result = value;
+            return true;
+        }
+
+        if (op == "<") {
+            *result = left < right;
+        } else if (op == ">") {
+            *result = left > right;
+        } else if (op == "<=") {
+            *result = left <= right;
+        } else if (op == ">=") {
+            *result = left >= right;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
     PackToken NumeralOperation(const PackToken &left, const PackToken &right, EvaluationData *data)
     {
         if (!left.canConvertToReal() || !right.canConvertToReal()) {
             return PackToken::Error();
         }
 
+        if (left->m_type == INT && right->m_type == INT) {
+            PackToken result;
+
+            if (IntegerOperation(left.asInt(), right.asInt(), data->op, &result)) {
+                return result;
+            }
+        }
+
         qreal left_d, right_d;
         qint64 left_i, right_i;
 
@@ -239,6 +300,206 @@ namespace cparse::builtin_operations {
         return PackToken::Error();
     }
 
+    // Kernels of NumeralOperation for operands of fixed types. The values
+    // are converted the way asReal() does, so the results are the same.
+    // Operators with an `integer` path compute on two INT operands exactly,
+    // like IntegerOperation():
+    namespace numeral_kernels {
+        struct Add
+        {
+            static constexpr const char *name = "add";
+            static constexpr bool integer = true;
+            static Token *apply(qreal left, qreal right) { return new TokenTyped<qreal>(left + right, REAL); }
+            static Token *apply(qint64 left, qint64 right)
+            {
+                qint64 result;
+                return qAddOverflow(left, right, &result) ? apply(qreal(left), qreal(right)) : new TokenTyped<qint64>(result, INT);
+            }
+        };
+
+        struct Sub
+        {
+            static constexpr const char *name = "sub";
+            static constexpr bool integer = true;
+            static Token *apply(qreal left, qreal right) { return new TokenTyped<qreal>(left - right, REAL); }
+            static Token *apply(qint64 left, qint64 right)
+            {
+                qint64 result;
+                return qSubOverflow(left, right, &result) ? apply(qreal(left), qreal(right)) : new TokenTyped<qint64>(result, INT);
+            }
+        };
+
+        struct Mul
+        {
+            static constexpr const char *name = "mul";
+            static constexpr bool integer = true;
+            static Token *apply(qreal left, qreal right) { return new TokenTyped<qreal>(left * right, REAL); }
+            static Token *apply(qint64 left, qint64 right)
+            {
+                qint64 result;
+                return qMulOverflow(left, right, &result) ? apply(qreal(left), qreal(right)) : new TokenTyped<qint64>(result, INT);
+            }
+        };
+
+        struct Div
+        {
+            static constexpr const char *name = "div";
+            static constexpr bool integer = false;
+            static Token *apply(qreal left, qreal right) { return new TokenTyped<qreal>(left / right, REAL); }
+        };
+
+        // Comparisons, returning a BOOL:
+        template <class Compare>
+        struct Comparison
+        {
+            static constexpr bool integer = true;
+
+            template <class T>
+            static Token *apply(T left, T right)
+            {
+                return new TokenTyped<uint8_t>(Compare()(left, right), BOOL);
+            }
+        };
+
+        struct Lt : Comparison<std::less<>>
+        {
+            static constexpr const char *name = "lt";
+        };
+
+        struct Gt : Comparison<std::greater<>>
+        {
+            static constexpr const char *name = "gt";
+        };
+
+        struct Le : Comparison<std::less_equal<>>
+        {
+            static constexpr const char *name = "le";
+        };
+
+        struct Ge : Comparison<std::greater_equal<>>
+        {
+            static constexpr const char *name = "ge";
+        };
+
+        template <class Op, class L, class R>
+        constexpr bool integerPath = Op::integer && std::is_same_v<L, qint64> && std::is_same_v<R, qint64>;
+
+        template <class Op, class L, class R>
+        Token *kernel(const Token *left, const Token *right)
+        {
+            const L l = static_cast<const TokenTyped<L> *>(left)->m_val;
+            const R r = static_cast<const TokenTyped<R> *>(right)->m_val;
+
+            if constexpr (integerPath<Op, L, R>) {
+                return Op::apply(l, r);
+            } else {
+                return Op::apply(qreal(l), qreal(r));
+            }
+        }
+
+        // The name and storage type of the numeral types with kernels:
+        template <class T>
+        struct Numeral;
+
+        template <>
+        struct Numeral<qreal>
+        {
+            static constexpr const char *name = "real";
+        };
+
+        template <>
+        struct Numeral<qint64>
+        {
+            static constexpr const char *name = "int";
+        };
+
+        template <>
+        struct Numeral<uint8_t>
+        {
+            static constexpr const char *name = "bool";
+        };
+
+        template <class Op, class L, class R>
+        OpKernel select()
+        {
+            constexpr bool comparison = std::is_same_v<Op, Lt> || std::is_same_v<Op, Gt> || std::is_same_v<Op, Le> || std::is_same_v<Op, Ge>;
+
+            // Integer results overflowing into a REAL fail the type guard
+            // of the next kernel, which then falls back to the operation:
+            const TokenType result = comparison ? BOOL : (integerPath<Op, L, R> ? INT : REAL);
+            return {&kernel<Op, L, R>, result, QString(Op::name) + "_" + Numeral<L>::name + "_" + Numeral<R>::name};
+        }
+
+        template <class Op, class L>
+        OpKernel select(TokenType right)
+        {
+            switch (right) {
+            case REAL:
+                return select<Op, L, qreal>();
+            case INT:
+                return select<Op, L, qint64>();
+            case BOOL:
+                return select<Op, L, uint8_t>();
+            default:
+                return {};
+            }
+        }
+
+        template <class Op>
+        OpKernel select(TokenType left, TokenType right)
+        {
+            switch (left) {
+            case REAL:
+                return select<Op, qreal>(right);
+            case INT:
+                return select<Op, qint64>(right);
+            case BOOL:
+                return select<Op, uint8_t>(right);
+            default:
+                return {};
+            }
+        }
+    }
+
+    OpKernel NumeralKernel(const QString &op, TokenType left, TokenType right)
+    {
+        using namespace numeral_kernels;
+
+        if (op == "+") {
+            return select<Add>(left, right);
+        }
+
+        if (op == "-") {
+            return select<Sub>(left, right);
+        }
+
+        if (op == "*") {
+            return select<Mul>(left, right);
+        }
+
+        if (op == "/") {
+            return select<Div>(left, right);
+        }
+
+        if (op == "<") {
+            return select<Lt>(left, right);
+        }
+
+        if (op == ">") {
+            return select<Gt>(left, right);
+        }
+
+        if (op == "<=") {
+            return select<Le>(left, right);
+        }
+
+        if (op == ">=") {
+            return select<Ge>(left, right);
+        }
+
+        return {};
+    }
+
     PackToken FormatOperation(const PackToken &p_left, const PackToken &p_right, EvaluationData *)
     {
         if (!p_left.canConvertToString()) {
@@ -496,28 +757,29 @@ namespace cparse::builtin_operations {
                 opp.addUnary("-", 3);
             }
 
-            // Link operations to respective operators:
+            // Link operations to respective operators. All of them
+            // but the assignment are pure:
             OpMap &opMap = config.opMap;
 
             if (def & BiType::ObjectOperators) {
                 opMap.add({ANY_TYPE, "=", ANY_TYPE}, &Assign);
-                opMap.add({ANY_TYPE, ",", ANY_TYPE}, &Comma);
-                opMap.add({ANY_TYPE, ":", ANY_TYPE}, &Colon);
+                opMap.add({ANY_TYPE, ",", ANY_TYPE}, &Comma, nullptr, Operation::Pure);
+                opMap.add({ANY_TYPE, ":", ANY_TYPE}, &Colon, nullptr, Operation::Pure);
             }
 
             if (def & BiType::LogicalOperators) {
-                opMap.add({ANY_TYPE, "==", ANY_TYPE}, &Equal);
-                opMap.add({ANY_TYPE, "!=", ANY_TYPE}, &Different);
+                opMap.add({ANY_TYPE, "==", ANY_TYPE}, &Equal, nullptr, Operation::Pure);
+                opMap.add({ANY_TYPE, "!=", ANY_TYPE}, &Different, nullptr, Operation::Pure);
             }
 
             if (def & BiType::ObjectOperators) {
-                opMap.add({MAP, "[]", STR}, &MapIndex);
-                opMap.add({ANY_TYPE, ".", STR}, &TypeSpecificFunction);
-                opMap.add({MAP, ".", STR}, &MapIndex);
+                opMap.add({MAP, "[]", STR}, &MapIndex, nullptr, Operation::Pure);
+                opMap.add({ANY_TYPE, ".", STR}, &TypeSpecificFunction, nullptr, Operation::Pure | Operation::TypeMember);
+                opMap.add({MAP, ".", STR}, &MapIndex, nullptr, Operation::Pure);
             }
 
             if (def & BiType::SystemFunctions) {
-                opMap.add({STR, "%", ANY_TYPE}, &FormatOperation);
+                opMap.add({STR, "%", ANY_TYPE}, &FormatOperation, nullptr, Operation::Pure);
             }
 
             auto ANY_OP = "";
@@ -525,19 +787,19 @@ namespace cparse::builtin_operations {
             // Note: The order is important:
 
             if (def & BiType::NumberOperators) {
-                opMap.add({NUM, ANY_OP, NUM}, &NumeralOperation);
-                opMap.add({UNARY, ANY_OP, NUM}, &UnaryNumeralOperation);
+                opMap.add({NUM, ANY_OP, NUM}, &NumeralOperation, &NumeralKernel, Operation::Pure);
+                opMap.add({UNARY, ANY_OP, NUM}, &UnaryNumeralOperation, nullptr, Operation::Pure);
             }
 
             if (def & BiType::NumberConstants || def & BiType::SystemFunctions || def & BiType::ObjectOperators) {
-                opMap.add({STR, ANY_OP, NUM}, &StringOnNumberOperation);
-                opMap.add({NUM, ANY_OP, STR}, &NumberOnStringOperation);
-                opMap.add({STR, ANY_OP, STR}, &StringOnStringOperation);
+                opMap.add({STR, ANY_OP, NUM}, &StringOnNumberOperation, nullptr, Operation::Pure);
+                opMap.add({NUM, ANY_OP, STR}, &NumberOnStringOperation, nullptr, Operation::Pure);
+                opMap.add({STR, ANY_OP, STR}, &StringOnStringOperation, nullptr, Operation::Pure);
             }
 
             if (def & BiType::SystemFunctions || def & BiType::ObjectOperators) {
-                opMap.add({LIST, ANY_OP, NUM}, &ListOnNumberOperation);
-                opMap.add({LIST, ANY_OP, LIST}, &ListOnListOperation);
+                opMap.add({LIST, ANY_OP, NUM}, &ListOnNumberOperation, nullptr, Operation::Pure);
+                opMap.add({LIST, ANY_OP, LIST}, &ListOnListOperation, nullptr, Operation::Pure);
             }
         }
     };
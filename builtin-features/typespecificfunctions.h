@@ -176,22 +176,22 @@ namespace cparse::builtin_typeSpecificFunctions {
             init = true;
 
             TokenMap &listScope = ObjectTypeRegistry::typeMap(LIST);
-            listScope["push"] = CppFunction(list_push, push_args, "push");
-            listScope["pop"] = CppFunction(list_pop, list_pop_args, "pop");
-            listScope["len"] = CppFunction(list_len, "len");
-            listScope["join"] = CppFunction(list_join, {"chars"}, "join");
+            listScope["push"] = CppFunction(list_push, push_args, "push").setBindings(Function::BindThis);
+            listScope["pop"] = CppFunction(list_pop, list_pop_args, "pop").setBindings(Function::BindThis);
+            listScope["len"] = CppFunction(list_len, "len").setBindings(Function::BindThis);
+            listScope["join"] = CppFunction(list_join, {"chars"}, "join").setBindings(Function::BindThis);
 
             TokenMap &strScope = ObjectTypeRegistry::typeMap(STR);
-            strScope["len"] = CppFunction(&string_len, "len");
-            strScope["lower"] = CppFunction(&string_lower, "lower");
-            strScope["upper"] = CppFunction(&string_upper, "upper");
-            strScope["strip"] = CppFunction(&string_strip, "strip");
-            strScope["split"] = CppFunction(&string_split, {"chars"}, "split");
+            strScope["len"] = CppFunction(&string_len, "len").setBindings(Function::BindThis);
+            strScope["lower"] = CppFunction(&string_lower, "lower").setBindings(Function::BindThis);
+            strScope["upper"] = CppFunction(&string_upper, "upper").setBindings(Function::BindThis);
+            strScope["strip"] = CppFunction(&string_strip, "strip").setBindings(Function::BindThis);
+            strScope["split"] = CppFunction(&string_split, {"chars"}, "split").setBindings(Function::BindThis);
 
             TokenMap &mapScope = ObjectTypeRegistry::typeMap(MAP);
-            mapScope["pop"] = CppFunction(map_pop, map_pop_args, "pop");
-            mapScope["len"] = CppFunction(map_len, "len");
-            mapScope["instanceof"] = CppFunction(&default_instanceof, {"value"}, "instanceof");
+            mapScope["pop"] = CppFunction(map_pop, map_pop_args, "pop").setBindings(Function::BindThis);
+            mapScope["len"] = CppFunction(map_len, "len").setBindings(Function::BindThis);
+            mapScope["instanceof"] = CppFunction(&default_instanceof, {"value"}, "instanceof").setBindings(Function::BindThis);
         }
     };
 
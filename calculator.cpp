@@ -1,5 +1,12 @@
 #include "calculator.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <set>
+
+#include <QStringList>
+
 #include "cparse.h"
 #include "rpnbuilder.h"
 #include "tokenhelpers.h"
@@ -24,6 +31,17 @@ namespace {
             return *this;
         }
     };
+
+    // Tells apart the subexpressions of calculators sharing a profiler:
+    std::atomic<quint64> sourceCount{0};
+
+    // Freeze the source config before copying it, so every
+    // calculator built from it shares the same frozen tables:
+    const Config &withFrozenTables(const Config &config)
+    {
+        config.freeze();
+        return config;
+    }
 }
 
 Calculator::Calculator(const Calculator &calc)
@@ -40,24 +58,46 @@ Calculator::Calculator(const Calculator &calc)
 
     m_config = calc.m_config;
     m_compiled = calc.m_compiled;
+    m_stackDepth = calc.m_stackDepth;
     m_compileTimeVars = calc.m_compileTimeVars;
+    m_backend = calc.m_backend;
+    m_variableTypes = calc.m_variableTypes;
+    m_source = calc.m_source;
+    m_spans = calc.m_spans;
+    m_subexpressions = calc.m_subexpressions;
+    m_tree = calc.m_tree;
+    m_program = calc.m_program;
+    m_folded = calc.m_folded;
+    m_unfolded = calc.m_unfolded;
 }
 
-Calculator::Calculator(Calculator &&calc) noexcept : m_compiled(calc.m_compiled)
+Calculator::Calculator(Calculator &&calc) noexcept
+    : m_stackDepth(calc.m_stackDepth), m_compiled(calc.m_compiled), m_backend(calc.m_backend)
 {
+    std::swap(calc.m_variableTypes, m_variableTypes);
+    std::swap(calc.m_tree, m_tree);
+    std::swap(calc.m_program, m_program);
     std::swap(calc.m_rpn, m_rpn);
     std::swap(calc.m_config, m_config);
     std::swap(calc.m_compileTimeVars, m_compileTimeVars);
+    std::swap(calc.m_source, m_source);
+    std::swap(calc.m_spans, m_spans);
+    std::swap(calc.m_subexpressions, m_subexpressions);
+    std::swap(calc.m_folded, m_folded);
+    std::swap(calc.m_unfolded, m_unfolded);
 }
 
-Calculator::Calculator(const Config &config) : m_config(config) { }
+Calculator::Calculator(const Config &config) : m_config(withFrozenTables(config)) { }
 
 Calculator::Calculator(const QString &expr, const TokenMap &vars, const QString &delim, int *rest, const Config &config)
-    : m_config(config)
+    : m_config(withFrozenTables(config))
 {
-    m_rpn = RpnBuilder::toRPN(expr, vars, delim, rest, config);
+    SourceSpans spans;
+    m_rpn = RpnBuilder::toRPN(expr, vars, delim, rest, config, &spans);
+    m_stackDepth = RpnBuilder::stackDepth(m_rpn);
     m_compiled = !m_rpn.empty();
     m_compileTimeVars = TokenMap::detachedCopy(vars);
+    setSource(expr, std::move(spans));
 }
 
 Calculator::~Calculator()
@@ -82,7 +122,17 @@ Calculator &Calculator::operator=(const Calculator &calc)
 
     m_config = calc.m_config;
     m_compiled = calc.m_compiled;
+    m_stackDepth = calc.m_stackDepth;
     m_compileTimeVars = calc.m_compileTimeVars;
+    m_backend = calc.m_backend;
+    m_variableTypes = calc.m_variableTypes;
+    m_source = calc.m_source;
+    m_spans = calc.m_spans;
+    m_subexpressions = calc.m_subexpressions;
+    m_tree = calc.m_tree;
+    m_program = calc.m_program;
+    m_folded = calc.m_folded;
+    m_unfolded = calc.m_unfolded;
 
     return *this;
 }
@@ -92,7 +142,17 @@ Calculator &Calculator::operator=(Calculator &&calc) noexcept
     std::swap(calc.m_rpn, m_rpn);
     std::swap(calc.m_compileTimeVars, m_compileTimeVars);
     std::swap(calc.m_compiled, m_compiled);
+    std::swap(calc.m_stackDepth, m_stackDepth);
     std::swap(calc.m_config, m_config);
+    std::swap(calc.m_backend, m_backend);
+    std::swap(calc.m_variableTypes, m_variableTypes);
+    std::swap(calc.m_tree, m_tree);
+    std::swap(calc.m_program, m_program);
+    std::swap(calc.m_source, m_source);
+    std::swap(calc.m_spans, m_spans);
+    std::swap(calc.m_subexpressions, m_subexpressions);
+    std::swap(calc.m_folded, m_folded);
+    std::swap(calc.m_unfolded, m_unfolded);
     return *this;
 }
 
@@ -118,13 +178,26 @@ PackToken Calculator::calculate(const QString &expr, const TokenMap &vars, const
     return PackToken(resolveReferenceToken(ret));
 }
 
-bool Calculator::compile(const QString &expr, const TokenMap &vars, const QString &delim, int *rest)
+bool Calculator::compile(const QString &expr, const TokenMap &vars, const QString &delim, int *rest, CompileStatistics *statistics)
 {
     // Make sure it is empty:
     RpnBuilder::clearRPN(&this->m_rpn);
-    m_rpn = RpnBuilder::toRPN(expr, vars, delim, rest, m_config);
+    SourceSpans spans;
+    m_rpn = RpnBuilder::toRPN(expr, vars, delim, rest, m_config, &spans, statistics);
+    m_stackDepth = RpnBuilder::stackDepth(m_rpn);
     m_compiled = !m_rpn.empty();
     m_compileTimeVars = TokenMap::detachedCopy(vars);
+    m_folded.clear();
+    m_unfolded.reset();
+    setSource(expr, std::move(spans));
+
+    const auto started = std::chrono::steady_clock::now();
+    buildBackend();
+
+    if (statistics) {
+        statistics->optimizing += std::chrono::steady_clock::now() - started;
+    }
+
     return this->compiled();
 }
 
@@ -134,12 +207,50 @@ PackToken Calculator::evaluate() const
 }
 
 PackToken Calculator::evaluate(const TokenMap &vars) const
+{
+    // Each thread keeps a context for the evaluations that do not bring
+    // their own. Nested evaluations find it in use and get a new one:
+    thread_local EvaluationContext context;
+    return this->evaluate(vars, context);
+}
+
+PackToken Calculator::evaluate(const TokenMap &vars, EvaluationContext &context) const
 {
     if (!m_compiled) {
         return PackToken::Error();
     }
 
-    Token *value = RpnBuilder::calculate(this->m_rpn, vars, m_config);
+    if (m_unfolded && rebindsFolded(vars)) {
+        return m_unfolded->evaluate(vars, context);
+    }
+
+    if (m_tree) {
+        Token *value = RpnBuilder::calculate(*m_tree, vars, m_config);
+
+        if (value == nullptr) {
+            return PackToken::Error("no value in result");
+        }
+
+        return PackToken(resolveReferenceToken(value));
+    }
+
+    if (m_program) {
+        Token *value = RpnBuilder::calculate(*m_program, vars, m_config, &context);
+
+        if (value == nullptr) {
+            return PackToken::Error("no value in result");
+        }
+
+        return PackToken(resolveReferenceToken(value));
+    }
+
+    if (context.inUse()) {
+        EvaluationContext nested;
+        return this->evaluate(vars, nested);
+    }
+
+    context.stack().reserve(m_stackDepth);
+    Token *value = RpnBuilder::calculate(this->m_rpn, vars, m_config, &context, m_subexpressions.empty() ? nullptr : &m_subexpressions);
 
     if (value == nullptr) {
         return PackToken::Error("no value in result");
@@ -148,12 +259,126 @@ PackToken Calculator::evaluate(const TokenMap &vars) const
     return PackToken(resolveReferenceToken(value));
 }
 
+PackToken Calculator::evaluate(const TokenMap &vars, const EvaluationLimits &limits) const
+{
+    EvaluationBudget budget(limits);
+    EvaluationBudgetGuard guard(&budget);
+    return this->evaluate(vars);
+}
+
 PackToken Calculator::evaluate(const QString &expr, const TokenMap &vars, const QString &delim, int *rest)
 {
     this->compile(expr, vars, delim, rest);
     return this->evaluate(vars);
 }
 
+AsyncEvaluation Calculator::evaluateAsync(const TokenMap &vars, AsyncVariableResolver resolver) const
+{
+    if (m_unfolded && rebindsFolded(vars)) {
+        return m_unfolded->evaluateAsync(vars, std::move(resolver));
+    }
+
+    return AsyncEvaluation(m_rpn, vars, m_config, std::move(resolver));
+}
+
+Dependencies Calculator::dependencies() const
+{
+    return RpnBuilder::dependencies(m_rpn, m_config);
+}
+
+Calculator Calculator::specialize(const TokenMap &knownVars) const
+{
+    // Specializing again keeps the names folded before:
+    std::vector<QString> folded = m_folded;
+    Calculator specialized = specialize(knownVars, &folded);
+
+    if (!folded.empty()) {
+        const Calculator &unfolded = m_unfolded ? *m_unfolded : *this;
+        specialized.m_folded = std::move(folded);
+        specialized.m_unfolded = std::make_shared<Calculator>(unfolded.specialize(knownVars, nullptr));
+    }
+
+    return specialized;
+}
+
+Calculator Calculator::specialize(const TokenMap &knownVars, std::vector<QString> *folded) const
+{
+    Calculator specialized(m_config);
+    specialized.m_backend = m_backend;
+    specialized.m_variableTypes = m_variableTypes;
+    specialized.m_compileTimeVars = TokenMap::detachedCopy(m_compileTimeVars);
+
+    for (const auto &[name, value] : knownVars.map()) {
+        specialized.m_compileTimeVars[name] = value;
+    }
+
+    if (m_compiled) {
+        specialized.m_rpn = RpnBuilder::specialize(m_rpn, knownVars, m_config, folded);
+        specialized.m_stackDepth = RpnBuilder::stackDepth(specialized.m_rpn);
+        specialized.m_compiled = !specialized.m_rpn.empty();
+        specialized.buildBackend();
+    }
+
+    return specialized;
+}
+
+// Whether `vars` binds a name of the config scope folded when specializing:
+bool Calculator::rebindsFolded(const TokenMap &vars) const
+{
+    for (const QString &name : m_folded) {
+        if (vars.find(name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t Calculator::stackDepth() const
+{
+    return m_stackDepth;
+}
+
+CompileStatistics Calculator::statistics() const
+{
+    return RpnBuilder::statistics(m_rpn, m_config);
+}
+
+quint64 Calculator::retainedBytes() const
+{
+    quint64 bytes = cparse::retainedBytes(&m_compileTimeVars);
+    bytes += quint64(m_source.size()) * sizeof(QChar) + m_spans.size() * sizeof(SourceSpan);
+
+    for (TokenQueue rpn = m_rpn; !rpn.empty(); rpn.pop()) {
+        bytes += cparse::retainedBytes(rpn.front());
+    }
+
+    for (const QString &name : m_subexpressions) {
+        bytes += sizeof(QString) + quint64(name.size()) * sizeof(QChar);
+    }
+
+    return bytes;
+}
+
+quint64 Calculator::backendBytes() const
+{
+    quint64 bytes = 0;
+
+    if (m_tree) {
+        bytes += RpnBuilder::retainedBytes(*m_tree);
+    }
+
+    if (m_program) {
+        bytes += RpnBuilder::retainedBytes(*m_program);
+    }
+
+    if (m_unfolded) {
+        bytes += sizeof(Calculator) + m_unfolded->retainedBytes() + m_unfolded->backendBytes();
+    }
+
+    return bytes;
+}
+
 const Config &Calculator::config() const
 {
     return m_config;
@@ -161,7 +386,133 @@ const Config &Calculator::config() const
 
 void Calculator::setConfig(const Config &config)
 {
-    m_config = config;
+    m_config = withFrozenTables(config);
+
+    // The tree and program are bound to the operations of the previous config:
+    buildBackend();
+}
+
+Calculator::Backend Calculator::backend() const
+{
+    return m_backend;
+}
+
+void Calculator::setBackend(Backend backend)
+{
+    m_backend = backend;
+    buildBackend();
+}
+
+const VariableTypes &Calculator::variableTypes() const
+{
+    return m_variableTypes;
+}
+
+void Calculator::setVariableTypes(const VariableTypes &types)
+{
+    m_variableTypes = types;
+    buildBackend();
+}
+
+void Calculator::buildBackend()
+{
+    m_tree.reset();
+    m_program.reset();
+
+    // The specialization without folded names follows the backend, config
+    // and types too:
+    if (m_unfolded) {
+        auto unfolded = std::make_shared<Calculator>(*m_unfolded);
+        unfolded->m_config = m_config;
+        unfolded->m_backend = m_backend;
+        unfolded->m_variableTypes = m_variableTypes;
+        unfolded->buildBackend();
+        m_unfolded = std::move(unfolded);
+    }
+
+    if (!m_compiled) {
+        return;
+    }
+
+    // Expressions the other backends cannot represent stay interpreted:
+    if (m_backend == ExecutionTreeBackend) {
+        m_tree = RpnBuilder::buildTree(m_rpn, m_config);
+    } else if (m_backend == RegisterBackend) {
+        m_program = RpnBuilder::buildProgram(m_rpn, m_config, m_variableTypes);
+    }
+}
+
+void Calculator::setSource(const QString &expr, SourceSpans &&spans)
+{
+    m_spans = std::move(spans);
+    m_subexpressions.clear();
+    int end = 0;
+
+    for (const SourceSpan &span : m_spans) {
+        end = std::max(end, span.end);
+    }
+
+    m_source = expr.left(end);
+    const QString id = "#" + QString::number(++sourceCount) + " ";
+    TokenQueue rpn = m_rpn;
+
+    for (size_t i = 0; !rpn.empty() && i < m_spans.size(); ++i, rpn.pop()) {
+        const TokenType type = rpn.front()->m_type;
+        const SourceSpan &span = m_spans[i];
+
+        if ((type == OP || type == VAR) && span.begin >= 0) {
+            m_subexpressions.push_back(id + QString::number(span.begin) + ":" + m_source.mid(span.begin, span.end - span.begin));
+        } else {
+            m_subexpressions.emplace_back();
+        }
+    }
+}
+
+const SourceSpans &Calculator::sourceSpans() const
+{
+    return m_spans;
+}
+
+const std::vector<QString> &Calculator::subexpressions() const
+{
+    return m_subexpressions;
+}
+
+QString Calculator::annotate(const Profiler &profiler) const
+{
+    const Profiler::Counters counters = profiler.snapshot(Profiler::Subexpression);
+    std::vector<size_t> counted;
+    std::set<QString> seen;
+
+    for (size_t i = 0; i < m_subexpressions.size(); ++i) {
+        const QString &name = m_subexpressions[i];
+
+        if (!name.isEmpty() && counters.count(name) && seen.insert(name).second) {
+            counted.push_back(i);
+        }
+    }
+
+    // Outer subexpressions above the ones they contain:
+    std::sort(counted.begin(), counted.end(), [this](size_t a, size_t b) {
+        const SourceSpan &left = m_spans[a];
+        const SourceSpan &right = m_spans[b];
+        return left.begin != right.begin ? left.begin < right.begin : left.end > right.end;
+    });
+
+    // Keep the columns of a multiline source:
+    QString source = m_source;
+    source.replace('\n', ' ').replace('\t', ' ');
+    QStringList lines{source};
+
+    for (size_t i : counted) {
+        const SourceSpan &span = m_spans[i];
+        const Profiler::Counter &counter = counters.at(m_subexpressions[i]);
+        QString line = QString(" ").repeated(span.begin) + QString("~").repeated(std::max(1, span.end - span.begin));
+        line = line.leftJustified(source.size()) + " | " + QString::number(counter.calls) + " calls, " + QString::number(qint64(counter.time.count())) + " ns";
+        lines.append(line);
+    }
+
+    return lines.join("\n");
 }
 
 void Calculator::setVariableResolver(std::function<PackToken(const QString &)> &&f)
@@ -169,6 +520,11 @@ void Calculator::setVariableResolver(std::function<PackToken(const QString &)> &
     m_config.variableResolver = std::move(f);
 }
 
+void Calculator::setBatchVariableResolver(std::function<TokenMap(const std::vector<QString> &)> &&f)
+{
+    m_config.batchVariableResolver = std::move(f);
+}
+
 /* * * * * For Debug Only * * * * */
 
 QString Calculator::str() const
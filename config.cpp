@@ -1,5 +1,10 @@
 #include "config.h"
 
+#include <algorithm>
+#include <atomic>
+
+#include "frozenconfig.h"
+
 #include "builtin-features/functions.h"
 #include "builtin-features/operations.h"
 #include "builtin-features/reservedwords.h"
@@ -18,6 +23,56 @@ Config::Config(TokenMap s, ParserMap p, OpPrecedenceMap opp, OpMap opMap)
 {
 }
 
+quint64 cparse::nextConfigRevision()
+{
+    static std::atomic<quint64> revision{0};
+    return ++revision;
+}
+
+quint64 Config::revision() const
+{
+    // Revisions are globally increasing, so the newest table wins:
+    return std::max({parserMap.revision(), opPrecedence.revision(), opMap.revision()});
+}
+
+FrozenConfigPtr Config::freeze() const
+{
+    FrozenConfigPtr frozen = std::atomic_load(&m_frozen);
+
+    if (!frozen || !frozen->isSnapshotOf(*this)) {
+        frozen = std::make_shared<const FrozenConfig>(*this);
+        std::atomic_store(&m_frozen, frozen);
+    }
+
+    return frozen;
+}
+
+Config Config::overlay() const
+{
+    Config layer;
+    layer.m_base = freeze();
+    // TokenMap copies share their data, so the child sees later changes:
+    TokenMap baseScope = scope;
+    layer.scope = baseScope.getChild();
+    layer.variableResolver = variableResolver;
+    layer.batchVariableResolver = batchVariableResolver;
+    layer.resolverCache = resolverCache;
+    layer.limits = limits;
+    layer.profiler = profiler;
+
+    // The bracket precedences every OpPrecedenceMap starts with are already
+    // part of the base, and must not shadow a precedence the base redefined:
+    layer.opPrecedence.m_prMap.clear();
+    layer.opPrecedence.m_rtol.clear();
+
+    return layer;
+}
+
+const FrozenConfigPtr &Config::base() const
+{
+    return m_base;
+}
+
 void Config::registerBuiltInDefinitions(BuiltInDefinition def)
 {
     Config &c = *this;
@@ -30,11 +85,13 @@ void Config::registerBuiltInDefinitions(BuiltInDefinition def)
 void ParserMap::add(const QString &word, WordParserFunc *parser)
 {
     wmap[word] = parser;
+    m_revision = nextConfigRevision();
 }
 
 void ParserMap::add(QChar c, WordParserFunc *parser)
 {
     cmap[c] = parser;
+    m_revision = nextConfigRevision();
 }
 
 WordParserFunc *ParserMap::find(const QString &text) const
@@ -55,10 +112,42 @@ WordParserFunc *ParserMap::find(QChar c) const
     return nullptr;
 }
 
+quint64 ParserMap::revision() const
+{
+    return m_revision;
+}
+
+namespace {
+    TokenTypeMap &typeRegistry()
+    {
+        static TokenTypeMap registry;
+        return registry;
+    }
+
+    std::atomic<quint64> typeRegistryRevision{0};
+}
+
 TokenMap &ObjectTypeRegistry::typeMap(TokenType type)
 {
-    static TokenTypeMap registry;
-    return registry[type];
+    ++typeRegistryRevision;
+    return typeRegistry()[type];
+}
+
+const TokenMap &ObjectTypeRegistry::constTypeMap(TokenType type)
+{
+    static const TokenMap none;
+    const TokenTypeMap &registry = typeRegistry();
+
+    if (auto it = registry.find(type); it != registry.end()) {
+        return it->second;
+    }
+
+    return none;
+}
+
+quint64 ObjectTypeRegistry::revision()
+{
+    return typeRegistryRevision;
 }
 
 Config::BuiltInDefinition cparse::operator|(Config::BuiltInDefinition l, Config::BuiltInDefinition r)
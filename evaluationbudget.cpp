@@ -0,0 +1,125 @@
+#include "evaluationbudget.h"
+
+#include "containers.h"
+
+using namespace cparse;
+
+namespace {
+    thread_local EvaluationBudget *currentBudget = nullptr;
+
+    // The bytes a value returned by an operator holds, not counting
+    // references to values that already exist:
+    quint64 bytesOf(const Token *value)
+    {
+        switch (value->m_type) {
+        case STR:
+            return quint64(static_cast<const TokenTyped<QString> *>(value)->m_val.size()) * sizeof(QChar);
+        case LIST:
+        case TUPLE:
+        case STUPLE:
+            return quint64(static_cast<const TokenList *>(value)->list().size()) * sizeof(PackToken);
+        case MAP:
+            return quint64(static_cast<const TokenMap *>(value)->map().size()) * (sizeof(QString) + sizeof(PackToken));
+        default:
+            return 0;
+        }
+    }
+}
+
+bool EvaluationLimits::unlimited() const
+{
+    return !maxSteps && !timeout.count() && !maxBytes && !maxCallDepth;
+}
+
+/* * * * * class EvaluationBudget * * * * */
+
+EvaluationBudget::EvaluationBudget(const EvaluationLimits &limits)
+    : m_limits(limits), m_deadline(Clock::now() + limits.timeout)
+{
+}
+
+EvaluationBudget *EvaluationBudget::current()
+{
+    return currentBudget;
+}
+
+bool EvaluationBudget::allocate(const Token *value)
+{
+    if (m_limits.maxBytes) {
+        m_bytes += bytesOf(value);
+
+        if (m_bytes > m_limits.maxBytes) {
+            return exceed("evaluation exceeded its memory limit");
+        }
+    }
+
+    return m_cause.isNull();
+}
+
+bool EvaluationBudget::enterCall()
+{
+    ++m_callDepth;
+
+    if (m_limits.maxCallDepth && m_callDepth > m_limits.maxCallDepth) {
+        return exceed("evaluation exceeded its call depth limit");
+    }
+
+    // Functions may take long, so the deadline is checked on every call:
+    if (m_limits.timeout.count() && Clock::now() >= m_deadline) {
+        return exceed("evaluation exceeded its deadline");
+    }
+
+    return m_cause.isNull();
+}
+
+void EvaluationBudget::leaveCall()
+{
+    --m_callDepth;
+}
+
+bool EvaluationBudget::exceeded() const
+{
+    return !m_cause.isNull();
+}
+
+const QString &EvaluationBudget::cause() const
+{
+    return m_cause;
+}
+
+quint64 EvaluationBudget::steps() const
+{
+    return m_steps;
+}
+
+quint64 EvaluationBudget::bytes() const
+{
+    return m_bytes;
+}
+
+bool EvaluationBudget::exceed(const QString &cause)
+{
+    // The first limit exceeded is the cause:
+    if (m_cause.isNull()) {
+        m_cause = cause;
+    }
+
+    return false;
+}
+
+/* * * * * class EvaluationBudgetGuard * * * * */
+
+EvaluationBudgetGuard::EvaluationBudgetGuard(EvaluationBudget *budget)
+{
+    if (budget && !currentBudget) {
+        currentBudget = budget;
+        m_installed = true;
+    }
+}
+
+EvaluationBudgetGuard::~EvaluationBudgetGuard()
+{
+    if (m_installed) {
+        currentBudget = nullptr;
+    }
+}
@@ -0,0 +1,69 @@
+#include "evaluationcontext.h"
+
+#include "tokenhelpers.h"
+
+using namespace cparse;
+
+/* * * * * class EvaluationStack * * * * */
+
+EvaluationStack::~EvaluationStack()
+{
+    clear();
+}
+
+void EvaluationStack::reserve(size_t depth)
+{
+    m_tokens.reserve(depth);
+}
+
+size_t EvaluationStack::capacity() const
+{
+    return m_tokens.capacity();
+}
+
+void EvaluationStack::push(Token *token)
+{
+    Q_ASSERT_X(m_tokens.size() < m_tokens.capacity(), "EvaluationStack::push", "stack depth exceeds the compiled depth");
+    m_tokens.push_back(token);
+}
+
+Token *EvaluationStack::top() const
+{
+    return m_tokens.back();
+}
+
+void EvaluationStack::pop()
+{
+    m_tokens.pop_back();
+}
+
+size_t EvaluationStack::size() const
+{
+    return m_tokens.size();
+}
+
+bool EvaluationStack::empty() const
+{
+    return m_tokens.empty();
+}
+
+void EvaluationStack::clear()
+{
+    for (Token *token : m_tokens) {
+        delete resolveReferenceToken(token);
+    }
+
+    m_tokens.clear();
+}
+
+/* * * * * class EvaluationContext * * * * */
+
+EvaluationStack &EvaluationContext::stack()
+{
+    return m_stack;
+}
+
+bool EvaluationContext::inUse() const
+{
+    return m_inUse;
+}
@@ -0,0 +1,208 @@
+#include "evaluationscheduler.h"
+
+using namespace cparse;
+
+struct EvaluationScheduler::Batch
+{
+    Batch(const std::vector<Task> &tasks, const TokenMap &inputs)
+        : tasks(tasks), inputs(inputs), results(tasks.size()), dependents(tasks.size()),
+          pending(new std::atomic<size_t>[tasks.size()]), remaining(tasks.size())
+    {
+        for (size_t index = 0; index < tasks.size(); ++index) {
+            pending[index] = tasks[index].dependencies.size();
+
+            for (size_t dependency : tasks[index].dependencies) {
+                dependents[dependency].push_back(index);
+            }
+        }
+    }
+
+    const std::vector<Task> &tasks;
+    const TokenMap &inputs;
+    // Each written once, before the tasks reading it are queued:
+    std::vector<PackToken> results;
+    std::vector<std::vector<size_t>> dependents;
+    // The dependencies of each task that are not evaluated yet:
+    std::unique_ptr<std::atomic<size_t>[]> pending;
+    std::atomic<size_t> remaining;
+};
+
+EvaluationScheduler::EvaluationScheduler(unsigned threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The last queue belongs to the thread calling run():
+    for (unsigned i = 0; i < threads; ++i) {
+        m_queues.push_back(std::make_unique<Queue>());
+    }
+
+    for (unsigned i = 0; i + 1 < threads; ++i) {
+        m_threads.emplace_back(&EvaluationScheduler::work, this, i);
+    }
+}
+
+EvaluationScheduler::~EvaluationScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_wake.notify_all();
+
+    for (std::thread &thread : m_threads) {
+        thread.join();
+    }
+}
+
+unsigned EvaluationScheduler::threadCount() const
+{
+    return unsigned(m_queues.size());
+}
+
+// Wait on m_wake until `ready` holds, counted as sleeping meanwhile:
+template<typename Predicate>
+void EvaluationScheduler::wait(std::unique_lock<std::mutex> *lock, Predicate ready)
+{
+    ++m_sleepers;
+    m_wake.wait(*lock, ready);
+    --m_sleepers;
+}
+
+std::vector<PackToken> EvaluationScheduler::run(const std::vector<Task> &tasks, const TokenMap &inputs)
+{
+    std::lock_guard<std::mutex> runLock(m_runMutex);
+
+    if (tasks.empty()) {
+        return {};
+    }
+
+    Batch batch(tasks, inputs);
+
+    // Spread the tasks that are ready from the start over the queues. They
+    // are found first, as the others become ready as soon as one is pushed:
+    std::vector<size_t> ready;
+
+    for (size_t index = 0; index < tasks.size(); ++index) {
+        if (tasks[index].dependencies.empty()) {
+            ready.push_back(index);
+        }
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i) {
+        push(i % m_queues.size(), &batch, ready[i]);
+    }
+
+    // The calling thread evaluates too, until the whole batch is done:
+    const size_t self = m_queues.size() - 1;
+
+    while (batch.remaining > 0) {
+        if (!runOne(self)) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            wait(&lock, [&] { return batch.remaining == 0 || m_ready > 0; });
+        }
+    }
+
+    return std::move(batch.results);
+}
+
+void EvaluationScheduler::work(size_t self)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        wait(&lock, [&] { return m_stopping || m_ready > 0; });
+
+        if (m_stopping) {
+            return;
+        }
+
+        lock.unlock();
+
+        while (runOne(self)) {
+        }
+
+        lock.lock();
+    }
+}
+
+// Evaluate a task from the queue of `self`, or stolen from another
+// queue. Returns false if there was none:
+bool EvaluationScheduler::runOne(size_t self)
+{
+    std::pair<Batch *, size_t> task{nullptr, 0};
+
+    for (size_t i = 0; i < m_queues.size() && !task.first; ++i) {
+        Queue &queue = *m_queues[(self + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (queue.tasks.empty()) {
+            continue;
+        }
+
+        // The owner takes the most recent task, whose inputs are likely
+        // still in its cache, and thieves the oldest one:
+        if (i == 0) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+    }
+
+    if (!task.first) {
+        return false;
+    }
+
+    --m_ready;
+
+    Batch &batch = *task.first;
+    const Task &current = batch.tasks[task.second];
+
+    // Each evaluation gets its own scope, as expressions may assign variables:
+    TokenMap scope = TokenMap(batch.inputs).getChild();
+
+    for (size_t dependency : current.dependencies) {
+        scope[batch.tasks[dependency].name] = batch.results[dependency];
+    }
+
+    batch.results[task.second] = current.calculator->evaluate(scope);
+
+    for (size_t dependent : batch.dependents[task.second]) {
+        if (batch.pending[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            push(self, &batch, dependent);
+        }
+    }
+
+    if (batch.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wake.notify_all();
+    }
+
+    return true;
+}
+
+void EvaluationScheduler::push(size_t self, Batch *batch, size_t index)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_queues[self]->mutex);
+        m_queues[self]->tasks.emplace_back(batch, index);
+    }
+
+    ++m_ready;
+
+    // A thread counts itself as sleeping before checking m_ready, so either
+    // it sees the task, or it is seen here. Taking the lock then makes sure
+    // it is waiting already, and gets the notification:
+    if (m_sleepers > 0) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+
+        m_wake.notify_one();
+    }
+}
+
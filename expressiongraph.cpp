@@ -0,0 +1,221 @@
+#include "expressiongraph.h"
+
+#include "cparse.h"
+
+using namespace cparse;
+
+ExpressionGraph::ExpressionGraph(const Config &config) : m_config(config) { }
+
+bool ExpressionGraph::setFormula(const QString &name, const QString &expr)
+{
+    Calculator calculator(m_config);
+
+    if (!calculator.compile(expr)) {
+        qWarning(cparseLog) << "Formula" << name << "does not compile:" << expr;
+        return false;
+    }
+
+    std::set<QString> dependencies = calculator.dependencies().variables;
+
+    for (const QString &dependency : dependencies) {
+        if (reaches(dependency, name)) {
+            qWarning(cparseLog) << "Formula" << name << "depends on itself through" << dependency;
+            return false;
+        }
+    }
+
+    if (auto it = m_formulas.find(name); it != m_formulas.end()) {
+        for (const QString &dependency : it->second.dependencies) {
+            m_dependents[dependency].erase(name);
+        }
+    }
+
+    for (const QString &dependency : dependencies) {
+        m_dependents[dependency].insert(name);
+    }
+
+    m_formulas.insert_or_assign(name, Formula{std::move(calculator), std::move(dependencies)});
+    m_dirty.insert(name);
+    markDependentsDirty(name);
+    return true;
+}
+
+void ExpressionGraph::removeFormula(const QString &name)
+{
+    auto it = m_formulas.find(name);
+
+    if (it == m_formulas.end()) {
+        return;
+    }
+
+    for (const QString &dependency : it->second.dependencies) {
+        m_dependents[dependency].erase(name);
+    }
+
+    m_formulas.erase(it);
+    m_dirty.erase(name);
+    m_values.erase(name);
+    markDependentsDirty(name);
+}
+
+bool ExpressionGraph::hasFormula(const QString &name) const
+{
+    return m_formulas.count(name);
+}
+
+void ExpressionGraph::setInput(const QString &name, const PackToken &value)
+{
+    removeFormula(name);
+    m_values[name] = value;
+    markDependentsDirty(name);
+}
+
+std::set<QString> ExpressionGraph::dependencies(const QString &name) const
+{
+    auto it = m_formulas.find(name);
+    return it != m_formulas.end() ? it->second.dependencies : std::set<QString>();
+}
+
+std::set<QString> ExpressionGraph::dependents(const QString &name) const
+{
+    auto it = m_dependents.find(name);
+    return it != m_dependents.end() ? it->second : std::set<QString>();
+}
+
+std::vector<QString> ExpressionGraph::recompute()
+{
+    std::vector<QString> order = dirtyFormulas();
+    update(order);
+    return order;
+}
+
+std::vector<QString> ExpressionGraph::recompute(EvaluationScheduler &scheduler)
+{
+    std::vector<QString> order = dirtyFormulas();
+
+    // The formulas read the clean values from the scope, and the dirty
+    // ones from the results of the batch:
+    std::map<QString, size_t> indices;
+    std::vector<EvaluationScheduler::Task> tasks;
+
+    for (const QString &name : order) {
+        EvaluationScheduler::Task task{name, &m_formulas.at(name).calculator, {}};
+
+        for (const QString &dependency : m_formulas.at(name).dependencies) {
+            if (auto it = indices.find(dependency); it != indices.end()) {
+                task.dependencies.push_back(it->second);
+            }
+        }
+
+        indices[name] = tasks.size();
+        tasks.push_back(std::move(task));
+    }
+
+    std::vector<PackToken> results = scheduler.run(tasks, m_values);
+
+    for (size_t index = 0; index < order.size(); ++index) {
+        m_values[order[index]] = std::move(results[index]);
+        m_dirty.erase(order[index]);
+    }
+
+    return order;
+}
+
+PackToken ExpressionGraph::value(const QString &name)
+{
+    // Only what the value depends on, the other dirty formulas can wait:
+    std::set<QString> visited;
+    std::vector<QString> order;
+    sort(name, &visited, &order);
+    update(order);
+
+    const PackToken *value = m_values.find(name);
+    return value ? *value : PackToken::None();
+}
+
+const TokenMap &ExpressionGraph::values() const
+{
+    return m_values;
+}
+
+// Whether `from` is `to`, or a formula reading it directly or not:
+bool ExpressionGraph::reaches(const QString &from, const QString &to) const
+{
+    std::vector<QString> pending = {from};
+    std::set<QString> visited;
+
+    while (!pending.empty()) {
+        const QString name = pending.back();
+        pending.pop_back();
+
+        if (name == to) {
+            return true;
+        }
+
+        auto it = m_formulas.find(name);
+
+        if (it != m_formulas.end() && visited.insert(name).second) {
+            pending.insert(pending.end(), it->second.dependencies.begin(), it->second.dependencies.end());
+        }
+    }
+
+    return false;
+}
+
+void ExpressionGraph::markDependentsDirty(const QString &name)
+{
+    std::vector<QString> pending = {name};
+
+    while (!pending.empty()) {
+        auto it = m_dependents.find(pending.back());
+        pending.pop_back();
+
+        if (it == m_dependents.end()) {
+            continue;
+        }
+
+        // The formulas downstream of a dirty one are already dirty:
+        for (const QString &dependent : it->second) {
+            if (m_dirty.insert(dependent).second) {
+                pending.push_back(dependent);
+            }
+        }
+    }
+}
+
+std::vector<QString> ExpressionGraph::dirtyFormulas() const
+{
+    std::set<QString> visited;
+    std::vector<QString> order;
+
+    for (const QString &name : m_dirty) {
+        sort(name, &visited, &order);
+    }
+
+    return order;
+}
+
+// Append the dirty formulas `name` depends on to `order`, each after those it reads:
+void ExpressionGraph::sort(const QString &name, std::set<QString> *visited, std::vector<QString> *order) const
+{
+    if (!m_dirty.count(name) || !visited->insert(name).second) {
+        return;
+    }
+
+    for (const QString &dependency : m_formulas.at(name).dependencies) {
+        sort(dependency, visited, order);
+    }
+
+    order->push_back(name);
+}
+
+void ExpressionGraph::update(const std::vector<QString> &order)
+{
+    for (const QString &name : order) {
+        // Each formula gets its own scope, as calls bind their parameters and
+        // expressions may assign variables:
+        TokenMap scope = TokenMap(m_values).getChild();
+        m_values[name] = m_formulas.at(name).calculator.evaluate(scope);
+        m_dirty.erase(name);
+    }
+}
@@ -0,0 +1,168 @@
+#include "frozenconfig.h"
+
+using namespace cparse;
+
+FrozenConfig::FrozenConfig(const Config &config)
+    : m_revision(config.revision()),
+      m_parserRevision(config.parserMap.revision()),
+      m_precedenceRevision(config.opPrecedence.revision()),
+      m_opRevision(config.opMap.revision()),
+      m_base(config.m_base),
+      m_opMap(config.opMap)
+{
+    const OpPrecedenceMap &opp = config.opPrecedence;
+
+    for (const auto &[op, precedence] : opp.m_prMap) {
+        OpEntry &entry = m_ops[op];
+        entry.precedence = precedence;
+        entry.hasPrecedence = true;
+    }
+
+    for (const QString &op : opp.m_rtol) {
+        m_ops[op].rightToLeft = true;
+    }
+
+    // Operators without a precedence still get an entry, so the evaluation
+    // can resolve their operations with a single lookup:
+    for (auto &[op, operations] : m_opMap) {
+        if (m_base) {
+            const OpEntry *baseEntry = op.isEmpty() ? nullptr : m_base->findOp(op);
+            const std::vector<Operation> *baseOperations =
+                op.isEmpty() ? m_base->anyOperations() : (baseEntry ? baseEntry->operations : nullptr);
+
+            if (baseOperations) {
+                operations.insert(operations.end(), baseOperations->begin(), baseOperations->end());
+            }
+        }
+
+        if (op.isEmpty()) {
+            m_anyOperations = &operations;
+            continue;
+        }
+
+        m_ops[op].operations = &operations;
+    }
+
+    if (m_base) {
+        // Complete the operators this layer touched with what the base knows:
+        for (auto &[op, entry] : m_ops) {
+            const OpEntry *baseEntry = m_base->findOp(op);
+
+            if (!baseEntry) {
+                continue;
+            }
+
+            if (!entry.hasPrecedence) {
+                entry.precedence = baseEntry->precedence;
+                entry.hasPrecedence = baseEntry->hasPrecedence;
+                entry.rightToLeft = entry.rightToLeft || baseEntry->rightToLeft;
+            }
+
+            if (!entry.operations) {
+                entry.operations = baseEntry->operations;
+            }
+        }
+
+        if (!m_anyOperations) {
+            m_anyOperations = m_base->anyOperations();
+        }
+    }
+
+    for (const auto &[word, parser] : config.parserMap.wmap) {
+        m_words[word] = parser;
+    }
+
+    for (const auto &[c, parser] : config.parserMap.cmap) {
+        if (c.unicode() < 256) {
+            if (!m_latin1Chars) {
+                m_latin1Chars = std::make_unique<std::array<WordParserFunc *, 256>>();
+            }
+
+            (*m_latin1Chars)[c.unicode()] = parser;
+        } else {
+            m_otherChars[c.unicode()] = parser;
+        }
+    }
+}
+
+quint64 FrozenConfig::revision() const
+{
+    return m_revision;
+}
+
+bool FrozenConfig::isSnapshotOf(const Config &config) const
+{
+    return m_parserRevision == config.parserMap.revision()
+           && m_precedenceRevision == config.opPrecedence.revision()
+           && m_opRevision == config.opMap.revision()
+           && m_base == config.m_base;
+}
+
+const FrozenConfig::OpEntry *FrozenConfig::findOp(const QString &op) const
+{
+    if (auto it = m_ops.find(op); it != m_ops.end()) {
+        return &it->second;
+    }
+
+    return m_base ? m_base->findOp(op) : nullptr;
+}
+
+bool FrozenConfig::opExists(const QString &op) const
+{
+    const OpEntry *entry = findOp(op);
+    return entry && entry->hasPrecedence;
+}
+
+int FrozenConfig::prec(const QString &op) const
+{
+    const OpEntry *entry = findOp(op);
+    Q_ASSERT_X(entry && entry->hasPrecedence, "FrozenConfig::prec", "operator has no precedence");
+    return entry ? entry->precedence : 0;
+}
+
+bool FrozenConfig::assoc(const QString &op) const
+{
+    const OpEntry *entry = findOp(op);
+    return entry && entry->rightToLeft;
+}
+
+WordParserFunc *FrozenConfig::findParser(const QString &text) const
+{
+    if (auto it = m_words.find(text); it != m_words.end()) {
+        return it->second;
+    }
+
+    return m_base ? m_base->findParser(text) : nullptr;
+}
+
+WordParserFunc *FrozenConfig::findParser(QChar c) const
+{
+    WordParserFunc *parser = nullptr;
+
+    if (c.unicode() < 256) {
+        parser = m_latin1Chars ? (*m_latin1Chars)[c.unicode()] : nullptr;
+    } else if (auto it = m_otherChars.find(c.unicode()); it != m_otherChars.end()) {
+        parser = it->second;
+    }
+
+    if (!parser && m_base) {
+        return m_base->findParser(c);
+    }
+
+    return parser;
+}
+
+const std::vector<Operation> *FrozenConfig::anyOperations() const
+{
+    return m_anyOperations;
+}
+
+const OpMap &FrozenConfig::opMap() const
+{
+    return m_opMap;
+}
+
+const FrozenConfigPtr &FrozenConfig::base() const
+{
+    return m_base;
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <optional>
 #include <string>
 #include <utility>
 
@@ -8,57 +10,98 @@
 using namespace cparse;
 
 /* * * * * class Function * * * * */
+Function::BindingPlan::BindingPlan(const FunctionArgs &args, int bindings)
+    : params(args.begin(), args.end()), bindings(bindings)
+{
+}
+
+int Function::BindingPlan::slotOf(const QString &name) const
+{
+    // Functions have few parameters, a linear scan beats hashing:
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (params[i] == name) {
+            return static_cast<int>(i);
+        }
+    }
+
+    return -1;
+}
+
+const Function::BindingPlan &Function::bindingPlan() const
+{
+    std::shared_ptr<const BindingPlan> plan = std::atomic_load(&m_plan);
+
+    if (!plan) {
+        // The plan another thread built first wins, so the returned
+        // one is never replaced:
+        auto built = std::make_shared<const BindingPlan>(args());
+
+        if (std::atomic_compare_exchange_strong(&m_plan, &plan, built)) {
+            plan = built;
+        }
+    }
+
+    return *plan;
+}
+
 PackToken Function::call(const PackToken &_this, const Function *func, TokenList *args, const TokenMap &scope)
 {
+    const BindingPlan &plan = func->bindingPlan();
+    const TokenList::ListType &list = args->list();
+
     // Build the local namespace:
-    TokenMap kwargs;
     TokenMap local(scope);
 
-    FunctionArgs arg_names = func->args();
+    /* * * * * Parse positional arguments: * * * * */
 
-    auto args_it = args->list().begin();
-    FunctionArgs::const_iterator names_it = arg_names.begin();
+    size_t positional = 0;
 
-    /* * * * * Parse positional arguments: * * * * */
+    while (positional < list.size() && list[positional]->m_type != STUPLE) {
+        ++positional;
+    }
 
-    while (args_it != args->list().end() && names_it != arg_names.end()) {
-        // If the positional argument list is over:
-        if ((*args_it)->m_type == STUPLE) {
-            break;
-        }
+    const size_t bound = std::min(positional, plan.params.size());
 
-        // Else add it to the local namespace:
-        local[*names_it] = *args_it;
+    for (size_t i = 0; i < bound; ++i) {
+        local[plan.params[i]] = list[i];
+    }
 
-        ++args_it;
-        ++names_it;
+    // Parameters not given positionally default to None,
+    // unless a keyword argument sets them below:
+    for (size_t i = bound; i < plan.params.size(); ++i) {
+        local[plan.params[i]] = PackToken::None();
     }
 
     /* * * * * Parse extra positional arguments: * * * * */
 
-    TokenList arglist;
+    if (plan.bindings & BindArgs) {
+        TokenList arglist;
 
-    for (; args_it != args->list().end(); ++args_it) {
-        // If there is a keyword argument:
-        if ((*args_it)->m_type == STUPLE) {
-            break;
+        for (size_t i = bound; i < positional; ++i) {
+            arglist.list().push_back(list[i]);
         }
 
-        // Else add it to arglist:
-        arglist.list().push_back(*args_it);
+        local["args"] = arglist;
     }
 
     /* * * * * Parse keyword arguments: * * * * */
 
-    for (; args_it != args->list().end(); ++args_it) {
-        PackToken &arg = *args_it;
+    // Only built for the functions that read it:
+    std::optional<TokenMap> kwargs;
+
+    if (plan.bindings & BindKwargs) {
+        kwargs.emplace();
+    }
+
+    for (size_t i = positional; i < list.size(); ++i) {
+        const PackToken &arg = list[i];
 
         if (arg->m_type != STUPLE) {
             qWarning(cparseLog) << "Positional argument follows keyword argument";
             return PackToken::Error();
         }
 
-        auto *st = static_cast<STuple *>(arg.token());
+        const auto *st = static_cast<const STuple *>(arg.token());
 
         if (st->list().size() != 2) {
             qWarning(cparseLog) << "Keyword tuples must have exactly 2 items";
@@ -70,99 +113,110 @@ PackToken Function::call(const PackToken &_this, const Function *func, TokenList
             return PackToken::Error();
         }
 
-        // Save it:
+        // Missing parameters are taken from the keyword arguments,
+        // the others are left in kwargs:
         QString key = st->list()[0].asString();
-        PackToken &value = st->list()[1];
-        kwargs[key] = value;
-    }
-
-    /* * * * * Set missing positional arguments: * * * * */
+        const int slot = plan.slotOf(key);
 
-    for (; names_it != arg_names.end(); ++names_it) {
-        // If not set by a keyword argument:
-        auto kw_it = kwargs.map().find(*names_it);
-
-        if (kw_it == kwargs.map().end()) {
-            local[*names_it] = PackToken::None();
-        } else {
-            local[*names_it] = kw_it->second;
-            kwargs.map().erase(kw_it);
+        if (slot >= static_cast<int>(bound)) {
+            local[key] = st->list()[1];
+        } else if (kwargs) {
+            (*kwargs)[key] = st->list()[1];
         }
     }
 
     /* * * * * Set built-in variables: * * * * */
 
-    local["this"] = _this;
-    local["args"] = arglist;
-    local["kwargs"] = kwargs;
+    if (plan.bindings & BindThis) {
+        local["this"] = _this;
+    }
+
+    if (kwargs) {
+        local["kwargs"] = *kwargs;
+    }
 
     return func->exec(local);
 }
 
 /* * * * * class CppFunction * * * * */
-CppFunction::CppFunction()
+std::shared_ptr<const CppFunction::Definition> CppFunction::define(PackToken (*func)(const TokenMap &),
+                                                                   std::function<PackToken(const TokenMap &)> stdFunc,
+                                                                   FunctionArgs args,
+                                                                   QString name)
+{
+    auto def = std::make_shared<Definition>();
+    def->func = func;
+    def->isStdFunc = static_cast<bool>(stdFunc);
+    def->stdFunc = std::move(stdFunc);
+    def->args = std::move(args);
+    def->name = std::move(name);
+    def->plan = BindingPlan(def->args);
+    return def;
+}
+
+FunctionArgs CppFunction::argList(unsigned int nargs, const char **args)
 {
-    this->m_name = "";
-    this->m_isStdFunc = false;
-    this->m_func = nullptr;
+    FunctionArgs list;
+
+    // Add all strings to args list:
+    for (uint32_t i = 0; i < nargs; ++i) {
+        list.push_back(args[i]);
+    }
+
+    return list;
 }
 
+CppFunction &CppFunction::setBindings(int bindings)
+{
+    auto def = std::make_shared<Definition>(*m_def);
+    def->plan.bindings = bindings;
+    m_def = std::move(def);
+    return *this;
+}
+
+CppFunction &CppFunction::setPure(bool pure)
+{
+    auto def = std::make_shared<Definition>(*m_def);
+    def->pure = pure;
+    m_def = std::move(def);
+    return *this;
+}
+
+CppFunction::CppFunction() : m_def(define(nullptr, nullptr, {}, "")) { }
+
 CppFunction::CppFunction(PackToken (*func)(const TokenMap &), const FunctionArgs &args, QString name)
-    : m_func(func), m_args(args)
+    : m_def(define(func, nullptr, args, std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = false;
 }
 
 CppFunction::CppFunction(PackToken (*func)(const TokenMap &), unsigned int nargs, const char **args, QString name)
-    : m_func(func)
+    : m_def(define(func, nullptr, argList(nargs, args), std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = false;
-
-    // Add all strings to args list:
-    for (uint32_t i = 0; i < nargs; ++i) {
-        this->m_args.push_back(args[i]);
-    }
 }
 
 // Build a function with no named args:
-CppFunction::CppFunction(PackToken (*func)(const TokenMap &), QString name) : m_func(func)
+CppFunction::CppFunction(PackToken (*func)(const TokenMap &), QString name)
+    : m_def(define(func, nullptr, {}, std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = false;
 }
 
 CppFunction::CppFunction(std::function<PackToken(const TokenMap &)> func, const FunctionArgs &args, QString name)
-    : m_stdFunc(std::move(func)), m_args(args)
+    : m_def(define(nullptr, std::move(func), args, std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = true;
 }
 
 CppFunction::CppFunction(const FunctionArgs &args, std::function<PackToken(const TokenMap &)> func, QString name)
-    : m_stdFunc(std::move(func)), m_args(args)
+    : m_def(define(nullptr, std::move(func), args, std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = true;
 }
 
 CppFunction::CppFunction(std::function<PackToken(const TokenMap &)> func, unsigned int nargs, const char **args, QString name)
-    : m_stdFunc(std::move(func))
+    : m_def(define(nullptr, std::move(func), argList(nargs, args), std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = true;
-
-    // Add all strings to args list:
-    for (uint32_t i = 0; i < nargs; ++i) {
-        this->m_args.push_back(args[i]);
-    }
 }
 
 // Build a function with no named args:
 CppFunction::CppFunction(std::function<PackToken(const TokenMap &)> func, QString name)
-    : m_stdFunc(std::move(func))
+    : m_def(define(nullptr, std::move(func), {}, std::move(name)))
 {
-    this->m_name = std::move(name);
-    this->m_isStdFunc = true;
 }
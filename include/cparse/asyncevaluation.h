@@ -0,0 +1,76 @@
+#ifndef CPARSE_ASYNCEVALUATION_H
+#define CPARSE_ASYNCEVALUATION_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <QString>
+
+#include "config.h"
+#include "containers.h"
+#include "packtoken.h"
+
+namespace cparse {
+    // A variable value an asynchronous resolver provides later, e.g. when
+    // the reply of a service arrives. It can be set from any thread.
+    class PendingValue
+    {
+    public:
+        bool ready() const;
+        PackToken value() const;
+
+        // Set the value, once. Reject() leaves the variable unresolved,
+        // and an error fails the evaluation waiting for it:
+        void set(const PackToken &value);
+
+    private:
+        mutable std::mutex m_mutex;
+        bool m_ready = false;
+        PackToken m_value;
+    };
+
+    using PendingValuePtr = std::shared_ptr<PendingValue>;
+
+    // Returns the value of a variable missing from the scopes, possibly
+    // not ready yet, or nullptr to resolve it like evaluate() does:
+    using AsyncVariableResolver = std::function<PendingValuePtr(const QString &name)>;
+
+    // An evaluation that suspends instead of blocking when a variable it
+    // reads is not resolved yet, see Calculator::evaluateAsync().
+    //
+    // It only runs in resume(), on the calling thread, so a single thread
+    // can interleave many evaluations, resuming each when its value is
+    // ready. It keeps its own copy of the compiled expression, so the
+    // calculator it comes from may be compiled again or destroyed meanwhile.
+    //
+    // The resolver is asked once per name, and only about the names the
+    // batch variable resolver and the resolver cache of the config do not
+    // answer. The values it gives are kept in that cache.
+    class AsyncEvaluation
+    {
+    public:
+        AsyncEvaluation(const TokenQueue &rpn, const TokenMap &scope, const Config &config, AsyncVariableResolver resolver);
+        AsyncEvaluation(AsyncEvaluation &&) noexcept;
+        AsyncEvaluation &operator=(AsyncEvaluation &&) noexcept;
+        ~AsyncEvaluation();
+
+        // Run until the evaluation finishes or waits for a value that is
+        // not ready. Returns finished():
+        bool resume();
+        bool finished() const;
+
+        // The value it is waiting for, or nullptr if it is not suspended:
+        PendingValuePtr pending() const;
+
+        // The result once finished:
+        PackToken result() const;
+
+    private:
+        struct State;
+
+        std::unique_ptr<State> m_state;
+    };
+}
+
+#endif // CPARSE_ASYNCEVALUATION_H
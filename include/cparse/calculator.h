@@ -6,11 +6,25 @@
 #include "packtoken.h"
 #include "containers.h"
 #include "config.h"
+#include "asyncevaluation.h"
+#include "profiler.h"
+#include "evaluationcontext.h"
+#include "rpnbuilder.h"
 
 namespace cparse {
     class Calculator
     {
     public:
+        // How evaluate() runs the compiled expression:
+        enum Backend {
+            // Interpret the RPN queue (the default):
+            RpnBackend,
+            // Walk a tree of nodes bound to their operations at compile time:
+            ExecutionTreeBackend,
+            // Run register machine instructions, see RpnBuilder::buildProgram():
+            RegisterBackend
+        };
+
         Calculator(const Config &config = Config::defaultConfig());
 
         Calculator(const Calculator &calc);
@@ -28,22 +42,95 @@ namespace cparse {
         Calculator &operator=(Calculator &&) noexcept;
 
         bool compiled() const;
-        bool compile(const QString &expr, const TokenMap &vars = {}, const QString &delim = QString(), int *rest = nullptr);
-
+        // If `statistics` is given, it receives how long each stage of
+        // compiling took, building the backend included, and the size of
+        // the compiled expression:
+        bool compile(const QString &expr,
+                     const TokenMap &vars = {},
+                     const QString &delim = QString(),
+                     int *rest = nullptr,
+                     CompileStatistics *statistics = nullptr);
+
+        // Evaluating is reentrant: a compiled calculator can be evaluated
+        // from several threads at once, each with its own scope.
         PackToken evaluate() const;
         PackToken evaluate(const TokenMap &vars) const;
+        // Evaluate reusing the scratch state kept in `context`:
+        PackToken evaluate(const TokenMap &vars, EvaluationContext &context) const;
+        // Evaluate within `limits` instead of those of the config:
+        PackToken evaluate(const TokenMap &vars, const EvaluationLimits &limits) const;
         PackToken evaluate(const QString &expr, const TokenMap &vars = {}, const QString &delim = QString(), int *rest = nullptr);
 
+        // Start an evaluation that suspends while `resolver` has not provided
+        // the value of a variable missing from the scopes, see AsyncEvaluation.
+        // It interprets the RPN queue, whatever the backend:
+        AsyncEvaluation evaluateAsync(const TokenMap &vars, AsyncVariableResolver resolver) const;
+
         static PackToken calculate(const QString &expr,
                                    const TokenMap &vars = {},
                                    const QString &delim = QString(),
                                    int *rest = nullptr,
                                    const Config &config = Config::defaultConfig());
 
+        // The variables, config functions and members the compiled
+        // expression uses, see RpnBuilder::dependencies():
+        Dependencies dependencies() const;
+
+        // Returns a calculator for the compiled expression with the variables
+        // of `knownVars` fixed to their values, and everything depending only
+        // on them computed once, see RpnBuilder::specialize(). The other
+        // variables are read when evaluating, as before. Names of the config
+        // scope, like `sqrt`, are folded too, unless the evaluation scope
+        // rebinds them:
+        Calculator specialize(const TokenMap &knownVars) const;
+
+        // The operand stack size evaluating the compiled expression needs:
+        size_t stackDepth() const;
+
+        // The size of the compiled expression and the names it uses, see
+        // RpnBuilder::statistics():
+        CompileStatistics statistics() const;
+
+        // The memory the calculator holds for the compiled expression: its
+        // tokens, compile time variables and source spans. The execution
+        // tree or register program, shared by copies, is not counted:
+        quint64 retainedBytes() const;
+        // The memory of the execution tree or register program, see
+        // RpnBuilder::retainedBytes(), and of the specialization evaluated
+        // instead when the scope rebinds a folded name. Copies share it:
+        quint64 backendBytes() const;
+
+        // All backends give the same results. The execution tree or register
+        // program is built when compiling, or right away if the expression
+        // is compiled:
+        Backend backend() const;
+        void setBackend(Backend backend);
+
+        // Declare the types of variables, so the register backend can select
+        // the operations of the compiled expression ahead of time. Values
+        // that turn out to have another type are still handled:
+        const VariableTypes &variableTypes() const;
+        void setVariableTypes(const VariableTypes &types);
+
         const Config &config() const;
         void setConfig(const Config &config);
 
         void setVariableResolver(std::function<PackToken(const QString &)> &&);
+        void setBatchVariableResolver(std::function<TokenMap(const std::vector<QString> &)> &&);
+
+        // The source span of each token of the compiled RPN, see
+        // RpnBuilder::toRPN(). Specialized calculators have none:
+        const SourceSpans &sourceSpans() const;
+        // The names the operators and variables are counted under as
+        // Profiler::Subexpression when the config has a profiler, e.g.
+        // "#3 4:b * c" for the subexpression at offset 4 of the third source
+        // compiled, so calculators sharing a profiler are counted apart.
+        // Copies keep the names. Empty for the other tokens. Only the RPN
+        // backend counts them:
+        const std::vector<QString> &subexpressions() const;
+        // A copy of the source, followed by a line underlining each
+        // subexpression `profiler` counted, with its calls and time:
+        QString annotate(const Profiler &profiler) const;
 
         ////
 
@@ -51,10 +138,30 @@ namespace cparse {
         static QString str(TokenQueue rpn);
 
     private:
+        Calculator specialize(const TokenMap &knownVars, std::vector<QString> *folded) const;
+        bool rebindsFolded(const TokenMap &vars) const;
+        void buildBackend();
+        void setSource(const QString &expr, SourceSpans &&spans);
+
         Config m_config;
         TokenMap m_compileTimeVars;
         TokenQueue m_rpn;
+        size_t m_stackDepth = 0;
         bool m_compiled = false;
+        Backend m_backend = RpnBackend;
+        VariableTypes m_variableTypes;
+        // The part of the source compiled, and where each token is in it:
+        QString m_source;
+        SourceSpans m_spans;
+        std::vector<QString> m_subexpressions;
+        // Immutable once built, so copies share them:
+        ExecutionTreePtr m_tree;
+        RegisterProgramPtr m_program;
+        // For a specialized expression, the names of the config scope it
+        // folded, and the specialization without them, evaluated when the
+        // evaluation scope rebinds one of those names:
+        std::vector<QString> m_folded;
+        std::shared_ptr<const Calculator> m_unfolded;
     };
 
     QDebug &operator<<(QDebug &os, const cparse::Calculator &t);
@@ -2,15 +2,22 @@
 #define CPARSE_CONFIG_H
 
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
 #include <QString>
 
+#include "evaluationbudget.h"
 #include "operation.h"
 
 namespace cparse {
     class RpnBuilder;
+    class FrozenConfig;
+    class VariableResolverCache;
+    class Profiler;
+
+    using FrozenConfigPtr = std::shared_ptr<const FrozenConfig>;
 
     // WordParserFunc is the function type called when
     // a reserved word or character is found at parsing time
@@ -31,9 +38,14 @@ namespace cparse {
         WordParserFunc *find(const QString &text) const;
         WordParserFunc *find(QChar c) const;
 
+        quint64 revision() const;
+
     private:
+        friend class FrozenConfig;
+
         WordParserFuncMap wmap;
         CharParserFuncMap cmap;
+        quint64 m_revision = nextConfigRevision();
     };
 
     using TokenTypeMap = std::map<TokenType, TokenMap>;
@@ -58,17 +70,62 @@ namespace cparse {
 
         static Config &defaultConfig();
 
+        // Build (or reuse) an immutable snapshot of the parser and operator
+        // tables. The snapshot is cached and shared with copies of this
+        // config until one of its tables is changed through add() or
+        // replaced by another.
+        FrozenConfigPtr freeze() const;
+
+        // Changes whenever a parser, precedence or operation is added:
+        quint64 revision() const;
+
+        // Create a lightweight config layered over a frozen snapshot of
+        // this one. The overlay only stores its own additions: parsers,
+        // operators and operations fall through to the shared base tables
+        // and its scope is a child of this config's scope, so variables and
+        // functions defined here stay visible to every overlay.
+        Config overlay() const;
+
+        // The frozen config this one is layered over, if any:
+        const FrozenConfigPtr &base() const;
+
         TokenMap scope;
         ParserMap parserMap;
         OpPrecedenceMap opPrecedence;
         OpMap opMap;
         std::function<PackToken(const QString &)> variableResolver;
+        // Resolves the variables of an expression missing from the scopes in
+        // one call, the first time one of them is looked up. It returns the
+        // values of the names it knows, and variableResolver still gets the
+        // names only known at run time:
+        std::function<TokenMap(const std::vector<QString> &)> batchVariableResolver;
+        // Memoizes the answers of variableResolver, if set:
+        std::shared_ptr<VariableResolverCache> resolverCache;
+        // The limits of each evaluation, see EvaluationBudget:
+        EvaluationLimits limits;
+        // Counts what the evaluations do, if set:
+        std::shared_ptr<Profiler> profiler;
+
+    private:
+        friend class FrozenConfig;
+
+        FrozenConfigPtr m_base;
+        mutable FrozenConfigPtr m_frozen;
     };
 
+    // The functions and attributes of the types other than maps, e.g.
+    // the len() of 'abc'.len():
     class ObjectTypeRegistry
     {
     public:
+        // For adding members. Calling it changes the revision(), so the map
+        // should only be kept while adding them:
         static TokenMap &typeMap(TokenType type);
+        // For looking members up:
+        static const TokenMap &constTypeMap(TokenType type);
+
+        // Changes whenever typeMap() is called:
+        static quint64 revision();
 
     private:
         ObjectTypeRegistry() = default;
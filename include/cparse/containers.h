@@ -159,7 +159,7 @@ namespace cparse {
     public:
         using ListType = std::vector<PackToken>;
 
-        TokenList() : m_ref(std::make_shared<std::vector<PackToken>>()) { this->m_type = LIST; }
+        TokenList() : TokenList(LIST) { }
         ~TokenList() override { }
 
         // Attribute getter for the `TokenList_t` content:
@@ -193,6 +193,10 @@ namespace cparse {
         // Implement the Token abstract class
         Token *clone() const override { return new TokenList(*this); }
 
+    protected:
+        // For the tuples, which are lists of their own type:
+        explicit TokenList(TokenType type) : IterableToken(type), m_ref(std::make_shared<std::vector<PackToken>>()) { }
+
     private:
         std::shared_ptr<std::vector<PackToken>> m_ref;
     };
@@ -200,17 +204,15 @@ namespace cparse {
     class Tuple : public TokenList
     {
     public:
-        Tuple() { this->m_type = TUPLE; }
-        Tuple(const Token *first)
+        Tuple() : TokenList(TUPLE) { }
+        Tuple(const Token *first) : TokenList(TUPLE)
         {
-            this->m_type = TUPLE;
             list().push_back(PackToken(first->clone()));
         }
         Tuple(const PackToken &first) : Tuple(first.token()) { }
 
-        Tuple(const Token *first, const Token *second)
+        Tuple(const Token *first, const Token *second) : TokenList(TUPLE)
         {
-            this->m_type = TUPLE;
             list().push_back(PackToken(first->clone()));
             list().push_back(PackToken(second->clone()));
         }
@@ -218,6 +220,9 @@ namespace cparse {
 
         // Implement the Token abstract class
         Token *clone() const override { return new Tuple(*this); }
+
+    protected:
+        explicit Tuple(TokenType type) : TokenList(type) { }
     };
 
     // This Special Tuple is to be used only as syntactic sugar, and
@@ -232,17 +237,15 @@ namespace cparse {
     class STuple : public Tuple
     {
     public:
-        STuple() { this->m_type = STUPLE; }
-        STuple(const Token *first)
+        STuple() : Tuple(STUPLE) { }
+        STuple(const Token *first) : Tuple(STUPLE)
         {
-            this->m_type = STUPLE;
             list().push_back(PackToken(first->clone()));
         }
         STuple(const PackToken &first) : STuple(first.token()) { }
 
-        STuple(const Token *first, const Token *second)
+        STuple(const Token *first, const Token *second) : Tuple(STUPLE)
         {
-            this->m_type = STUPLE;
             list().push_back(PackToken(first->clone()));
             list().push_back(PackToken(second->clone()));
         }
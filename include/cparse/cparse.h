@@ -3,6 +3,10 @@
 
 #include "calculator.h"
 #include "containers.h"
+#include "expressiongraph.h"
+#include "profiler.h"
+#include "resolvercache.h"
+#include "tokenallocation.h"
 
 #include <QLoggingCategory>
 
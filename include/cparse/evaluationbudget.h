@@ -0,0 +1,99 @@
+#ifndef CPARSE_EVALUATIONBUDGET_H
+#define CPARSE_EVALUATIONBUDGET_H
+
+#include <chrono>
+
+#include <QString>
+
+#include "token.h"
+
+namespace cparse {
+    // Limits for evaluating untrusted expressions, set on Config::limits
+    // or given to Calculator::evaluate(). Zero means no limit.
+    struct EvaluationLimits
+    {
+        // The operators and method calls applied:
+        quint64 maxSteps = 0;
+        // The wall-clock time from the start of the evaluation:
+        std::chrono::milliseconds timeout = std::chrono::milliseconds::zero();
+        // The size of the strings, lists and maps the operators return:
+        quint64 maxBytes = 0;
+        // The depth of nested function calls, e.g. through eval():
+        int maxCallDepth = 0;
+
+        bool unlimited() const;
+    };
+
+    // What an evaluation used of its limits. An evaluation exceeding one
+    // stops and returns an error with cause(). Evaluations nested in it on
+    // the same thread, e.g. by eval(), use the same budget.
+    class EvaluationBudget
+    {
+    public:
+        explicit EvaluationBudget(const EvaluationLimits &limits);
+
+        // The budget of the evaluation running on this thread, if any:
+        static EvaluationBudget *current();
+
+        // Each returns false once a limit is exceeded:
+        bool step();
+        bool allocate(const Token *value);
+        bool enterCall();
+        void leaveCall();
+
+        bool exceeded() const;
+        // Why the evaluation was stopped:
+        const QString &cause() const;
+
+        quint64 steps() const;
+        quint64 bytes() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        bool exceed(const QString &cause);
+
+        const EvaluationLimits m_limits;
+        const Clock::time_point m_deadline;
+
+        quint64 m_steps = 0;
+        quint64 m_bytes = 0;
+        int m_callDepth = 0;
+        QString m_cause;
+    };
+
+    // Makes `budget` the budget of the evaluations on this thread while it
+    // exists, unless an outer evaluation has one already:
+    class EvaluationBudgetGuard
+    {
+    public:
+        explicit EvaluationBudgetGuard(EvaluationBudget *budget);
+        ~EvaluationBudgetGuard();
+
+        EvaluationBudgetGuard(const EvaluationBudgetGuard &) = delete;
+        EvaluationBudgetGuard &operator=(const EvaluationBudgetGuard &) = delete;
+
+    private:
+        bool m_installed = false;
+    };
+
+    /* * * * * Inline methods, called for each operator * * * * */
+
+    inline bool EvaluationBudget::step()
+    {
+        ++m_steps;
+
+        if (m_limits.maxSteps && m_steps > m_limits.maxSteps) {
+            return exceed("evaluation exceeded its step limit");
+        }
+
+        // Reading the clock costs more than an operator, so only every 256 steps:
+        if (m_limits.timeout.count() && (m_steps & 0xff) == 0 && Clock::now() >= m_deadline) {
+            return exceed("evaluation exceeded its deadline");
+        }
+
+        return m_cause.isNull();
+    }
+}
+
+#endif // CPARSE_EVALUATIONBUDGET_H
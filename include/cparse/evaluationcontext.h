@@ -0,0 +1,67 @@
+#ifndef CPARSE_EVALUATIONCONTEXT_H
+#define CPARSE_EVALUATIONCONTEXT_H
+
+#include <vector>
+
+#include "token.h"
+
+namespace cparse {
+    // The operand stack used by RpnBuilder::calculate(). It owns the tokens
+    // pushed on it and is sized from the stack depth computed when the
+    // expression is compiled, so evaluating never grows it.
+    class EvaluationStack
+    {
+    public:
+        EvaluationStack() = default;
+        ~EvaluationStack();
+
+        EvaluationStack(const EvaluationStack &) = delete;
+        EvaluationStack &operator=(const EvaluationStack &) = delete;
+
+        // Make room for `depth` tokens. Only allocates when growing:
+        void reserve(size_t depth);
+        size_t capacity() const;
+
+        void push(Token *token);
+        Token *top() const;
+        void pop();
+
+        size_t size() const;
+        bool empty() const;
+
+        // Delete the tokens left on the stack:
+        void clear();
+
+    private:
+        std::vector<Token *> m_tokens;
+    };
+
+    // Scratch state of an evaluation, kept by the caller and reused across
+    // evaluations so they do not have to allocate it again.
+    //
+    // A context can only be used by one evaluation at a time: nested or
+    // concurrent evaluations need their own context.
+    class EvaluationContext
+    {
+    public:
+        EvaluationContext() = default;
+
+        EvaluationContext(const EvaluationContext &) = delete;
+        EvaluationContext &operator=(const EvaluationContext &) = delete;
+
+        EvaluationStack &stack();
+
+        // True while an evaluation is using this context:
+        bool inUse() const;
+
+    private:
+        friend class RpnBuilder;
+
+        EvaluationStack m_stack;
+        // The registers of RpnBuilder's register machine, left empty between evaluations:
+        std::vector<Token *> m_registers;
+        bool m_inUse = false;
+    };
+}
+
+#endif // CPARSE_EVALUATIONCONTEXT_H
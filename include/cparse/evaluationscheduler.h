@@ -0,0 +1,84 @@
+#ifndef CPARSE_EVALUATIONSCHEDULER_H
+#define CPARSE_EVALUATIONSCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QString>
+
+#include "calculator.h"
+#include "containers.h"
+#include "packtoken.h"
+
+namespace cparse {
+    // Evaluates batches of compiled expressions on a pool of threads. The
+    // expressions of a batch can read the results of others, and those that
+    // do not depend on each other run concurrently.
+    //
+    // Each thread has its own queue: the expressions an evaluation makes
+    // ready are queued on the thread that ran it, and threads with an empty
+    // queue steal from the others, so there is no central queue to contend on.
+    class EvaluationScheduler
+    {
+    public:
+        struct Task
+        {
+            // The variable the result is bound to for the tasks reading it:
+            QString name;
+            const Calculator *calculator = nullptr;
+            // The indices of the tasks of the batch it reads:
+            std::vector<size_t> dependencies;
+        };
+
+        // `threads` is the number of threads evaluating, including the one
+        // calling run(), or 0 for one per core:
+        explicit EvaluationScheduler(unsigned threads = 0);
+        ~EvaluationScheduler();
+
+        EvaluationScheduler(const EvaluationScheduler &) = delete;
+        EvaluationScheduler &operator=(const EvaluationScheduler &) = delete;
+
+        unsigned threadCount() const;
+
+        // Evaluate `tasks` with `inputs` and the results of their dependencies
+        // as scope, and return the results by task index. The dependencies
+        // must not form a cycle, and `inputs` must not change meanwhile.
+        // Batches run one at a time:
+        std::vector<PackToken> run(const std::vector<Task> &tasks, const TokenMap &inputs);
+
+    private:
+        struct Batch;
+
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<std::pair<Batch *, size_t>> tasks;
+        };
+
+        void work(size_t self);
+        bool runOne(size_t self);
+        void push(size_t self, Batch *batch, size_t index);
+        template<typename Predicate>
+        void wait(std::unique_lock<std::mutex> *lock, Predicate ready);
+
+        std::vector<std::unique_ptr<Queue>> m_queues;
+        std::vector<std::thread> m_threads;
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        // The number of queued tasks, and of threads waiting for one. Queuing
+        // a task only takes m_mutex when a thread is waiting:
+        std::atomic<size_t> m_ready{0};
+        std::atomic<size_t> m_sleepers{0};
+        bool m_stopping = false;
+
+        std::mutex m_runMutex;
+    };
+}
+
+#endif // CPARSE_EVALUATIONSCHEDULER_H
@@ -0,0 +1,79 @@
+#ifndef CPARSE_EXPRESSIONGRAPH_H
+#define CPARSE_EXPRESSIONGRAPH_H
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <QString>
+
+#include "calculator.h"
+#include "evaluationscheduler.h"
+#include "containers.h"
+#include "packtoken.h"
+
+namespace cparse {
+    // A set of named formulas referring to each other and to inputs, e.g.
+    // `margin = revenue - cost` and `score = margin / revenue * weight`.
+    //
+    // The dependencies of each formula are found when it is compiled (see
+    // Calculator::dependencies()). Changing an input or a formula only
+    // marks the formulas downstream of it dirty, and recompute() evaluates
+    // those, each after the formulas it reads.
+    //
+    // The graph is not thread safe.
+    class ExpressionGraph
+    {
+    public:
+        explicit ExpressionGraph(const Config &config = Config::defaultConfig());
+
+        // Compile `expr` as the formula of `name`, replacing its previous
+        // formula or input value. Returns false, leaving the graph unchanged,
+        // if it does not compile or if `name` would depend on itself:
+        bool setFormula(const QString &name, const QString &expr);
+        void removeFormula(const QString &name);
+        bool hasFormula(const QString &name) const;
+
+        void setInput(const QString &name, const PackToken &value);
+
+        // The names read by the formula of `name`, and the formulas reading `name`:
+        std::set<QString> dependencies(const QString &name) const;
+        std::set<QString> dependents(const QString &name) const;
+
+        // Evaluate the dirty formulas in dependency order, and return their names:
+        std::vector<QString> recompute();
+        // The same, evaluating the formulas that do not depend on each other
+        // concurrently:
+        std::vector<QString> recompute(EvaluationScheduler &scheduler);
+
+        // The value of an input or formula, recomputed if it is dirty:
+        PackToken value(const QString &name);
+
+        // The inputs and the formula values, as of the last recompute():
+        const TokenMap &values() const;
+
+    private:
+        struct Formula
+        {
+            Calculator calculator;
+            std::set<QString> dependencies;
+        };
+
+        bool reaches(const QString &from, const QString &to) const;
+        void markDependentsDirty(const QString &name);
+        // The dirty formulas, in the order they can be evaluated:
+        std::vector<QString> dirtyFormulas() const;
+        void sort(const QString &name, std::set<QString> *visited, std::vector<QString> *order) const;
+        void update(const std::vector<QString> &order);
+
+        Config m_config;
+        std::map<QString, Formula> m_formulas;
+        // The formulas reading each name:
+        std::map<QString, std::set<QString>> m_dependents;
+        // Closed downstream: the formulas reading a dirty formula are dirty too.
+        std::set<QString> m_dirty;
+        TokenMap m_values;
+    };
+}
+
+#endif // CPARSE_EXPRESSIONGRAPH_H
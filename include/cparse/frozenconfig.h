@@ -0,0 +1,88 @@
+#ifndef CPARSE_FROZENCONFIG_H
+#define CPARSE_FROZENCONFIG_H
+
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <QString>
+
+#include "config.h"
+#include "operation.h"
+
+namespace cparse {
+    // FrozenConfig is an immutable snapshot of the parser and operator
+    // tables of a Config. The Config stays the mutable builder, while the
+    // frozen form replaces its std::map lookups with flat tables:
+    //
+    // - Every operator (including the "L" and "R" unary variants) is interned
+    //   into a single hash table entry holding its precedence, associativity
+    //   and its bucket of operations.
+    // - Character parsers in the latin1 range are direct-indexed.
+    // - Word parsers are hashed.
+    //
+    // A frozen config can be shared by any number of calculators and threads.
+    //
+    // The snapshot of an overlay config (see Config::overlay()) only holds
+    // the overlay's own tables and falls through to its base snapshot for
+    // everything else. Operators touched by the overlay get a merged entry,
+    // with the overlay's operations tried before the base ones.
+    class FrozenConfig
+    {
+    public:
+        struct OpEntry
+        {
+            int precedence = 0;
+            bool rightToLeft = false;
+            bool hasPrecedence = false;
+            const std::vector<Operation> *operations = nullptr;
+        };
+
+        explicit FrozenConfig(const Config &config);
+
+        FrozenConfig(const FrozenConfig &) = delete;
+        FrozenConfig &operator=(const FrozenConfig &) = delete;
+
+        // The Config::revision() this snapshot was built from:
+        quint64 revision() const;
+        // Whether `config` still has the tables this snapshot was built
+        // from. Unlike comparing revision(), this also notices a table
+        // replaced by an older one:
+        bool isSnapshotOf(const Config &config) const;
+
+        const OpEntry *findOp(const QString &op) const;
+
+        bool opExists(const QString &op) const;
+        int prec(const QString &op) const;
+        bool assoc(const QString &op) const;
+
+        WordParserFunc *findParser(const QString &text) const;
+        WordParserFunc *findParser(QChar c) const;
+
+        // The operations registered for any operator, i.e. with an empty
+        // operator string, which are tried after the operator's own bucket:
+        const std::vector<Operation> *anyOperations() const;
+
+        const OpMap &opMap() const;
+
+        const FrozenConfigPtr &base() const;
+
+    private:
+        quint64 m_revision;
+        quint64 m_parserRevision;
+        quint64 m_precedenceRevision;
+        quint64 m_opRevision;
+        FrozenConfigPtr m_base;
+        OpMap m_opMap;
+
+        std::unordered_map<QString, OpEntry> m_ops;
+        std::unordered_map<QString, WordParserFunc *> m_words;
+        // Only allocated when there are character parsers, so overlays stay small:
+        std::unique_ptr<std::array<WordParserFunc *, 256>> m_latin1Chars;
+        std::unordered_map<char16_t, WordParserFunc *> m_otherChars;
+        const std::vector<Operation> *m_anyOperations = nullptr;
+    };
+}
+
+#endif // CPARSE_FROZENCONFIG_H
@@ -3,6 +3,8 @@
 
 #include <list>
 #include <functional>
+#include <memory>
+#include <vector>
 
 #include <QString>
 
@@ -16,13 +18,48 @@ namespace cparse {
     class Function : public Token
     {
     public:
+        // The built-in variables a function reads from its local scope.
+        // Those it does not declare are not built by Function::call():
+        enum Binding {
+            BindNone = 0,
+            BindThis = 1 << 0,
+            BindArgs = 1 << 1, // extra positional arguments
+            BindKwargs = 1 << 2, // keyword arguments that match no parameter
+            BindAll = BindThis | BindArgs | BindKwargs
+        };
+
+        // How the arguments of a call are bound to the local scope,
+        // computed once per function definition:
+        struct BindingPlan
+        {
+            BindingPlan(const FunctionArgs &args = {}, int bindings = BindAll);
+
+            // Index of the parameter named `name`, or -1:
+            int slotOf(const QString &name) const;
+
+            // Parameter names in positional order:
+            std::vector<QString> params;
+            int bindings;
+        };
+
         Function() : Token(FUNC) { }
 
         static PackToken call(const PackToken &_this, const Function *func, TokenList *args, const TokenMap &scope);
 
         virtual const QString name() const = 0;
-        virtual const FunctionArgs args() const = 0;
+        virtual const FunctionArgs &args() const = 0;
         virtual PackToken exec(const TokenMap &scope) const = 0;
+
+        // Built from args() on the first call, binding all the built-in
+        // variables. Functions keeping their own plan override it:
+        virtual const BindingPlan &bindingPlan() const;
+
+        // Whether the result only depends on the arguments and calling
+        // the function has no side effects, see Operation::Pure:
+        virtual bool isPure() const { return false; }
+
+    private:
+        mutable std::shared_ptr<const BindingPlan> m_plan;
     };
 
     class CppFunction : public Function
@@ -37,21 +74,46 @@ namespace cparse {
         CppFunction(std::function<PackToken(const TokenMap &)> func, unsigned int nargs, const char **args, QString name = QString());
         CppFunction(std::function<PackToken(const TokenMap &)> func, QString name = QString());
 
-        const QString name() const override { return m_name; }
-        const FunctionArgs args() const override { return m_args; }
+        const QString name() const override { return m_def->name; }
+        const FunctionArgs &args() const override { return m_def->args; }
+        const BindingPlan &bindingPlan() const override { return m_def->plan; }
         PackToken exec(const TokenMap &scope) const override
         {
-            return m_isStdFunc ? m_stdFunc(scope) : m_func(scope);
+            return m_def->isStdFunc ? m_def->stdFunc(scope) : m_def->func(scope);
         }
 
-        Token *clone() const override { return new CppFunction(static_cast<const CppFunction &>(*this)); }
+        // Declare which of the built-in variables (see Function::Binding)
+        // the function reads. Meant to be used when registering it:
+        CppFunction &setBindings(int bindings);
+
+        // Declare the function pure (see Function::isPure()):
+        CppFunction &setPure(bool pure = true);
+        bool isPure() const override { return m_def->pure; }
+
+        // Copies share the same immutable definition, so referencing
+        // a function from an expression does not copy its arguments,
+        // name or std::function:
+        Token *clone() const override { return new CppFunction(*this); }
 
     private:
-        PackToken (*m_func)(const TokenMap &){};
-        std::function<PackToken(const TokenMap &)> m_stdFunc;
-        FunctionArgs m_args;
-        QString m_name;
-        bool m_isStdFunc;
+        struct Definition
+        {
+            PackToken (*func)(const TokenMap &){};
+            std::function<PackToken(const TokenMap &)> stdFunc;
+            FunctionArgs args;
+            QString name;
+            bool isStdFunc = false;
+            bool pure = false;
+            BindingPlan plan;
+        };
+
+        static std::shared_ptr<const Definition> define(PackToken (*func)(const TokenMap &),
+                                                        std::function<PackToken(const TokenMap &)> stdFunc,
+                                                        FunctionArgs args,
+                                                        QString name);
+        static FunctionArgs argList(unsigned int nargs, const char **args);
+
+        std::shared_ptr<const Definition> m_def;
     };
 
 } // namespace cparse
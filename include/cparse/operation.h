@@ -11,6 +11,9 @@ namespace cparse {
 
     using OpId = quint64;
 
+    // Returns an unique, increasing stamp used to version the config tables:
+    quint64 nextConfigRevision();
+
     struct OpSignature
     {
         TokenType left;
@@ -20,10 +23,12 @@ namespace cparse {
     };
 
     class OpMap;
+    class FrozenConfig;
+    class Profiler;
     struct EvaluationData
     {
-        TokenQueue rpn;
         TokenMap scope;
+        const FrozenConfig &config;
         const OpMap &opMap;
         const std::function<PackToken(const QString &)> &variableResolver;
 
@@ -33,18 +38,50 @@ namespace cparse {
         QString op;
         OpId opID{};
 
-        EvaluationData(TokenQueue rpn,
-                       const TokenMap &scope,
-                       const OpMap &opMap,
+        // Set if the evaluation is profiled, see Config::profiler:
+        Profiler *profiler = nullptr;
+
+        EvaluationData(const TokenMap &scope,
+                       const FrozenConfig &config,
                        const std::function<PackToken(const QString &)> &func);
     };
 
+    // A native implementation of an operation for operands of fixed types,
+    // called instead of the operation when the operand types are known at
+    // compile time (see RpnBuilder::buildProgram()):
+    struct OpKernel
+    {
+        using Func = Token *(*)(const Token *left, const Token *right);
+
+        Func func = nullptr;
+        // The type of the tokens func returns:
+        TokenType result = NONE;
+        // For debugging, e.g. "add_real_int":
+        QString name;
+    };
+
     class Operation
     {
     public:
         using OpFunc = PackToken (*)(const PackToken &, const PackToken &, EvaluationData *);
 
-        Operation(const OpSignature &sig, OpFunc func);
+        // Returns the kernel implementing `op` for operands of the given
+        // types, or an empty kernel if there is none:
+        using Specializer = OpKernel (*)(const QString &op, TokenType left, TokenType right);
+
+        enum Flags {
+            NoFlags = 0,
+            // The result only depends on the operands and the operation
+            // has no side effects, so equal subexpressions using it can
+            // be computed once (see RpnBuilder::buildProgram()):
+            Pure = 1 << 0,
+            // The operation gives the member of the left operand's type
+            // named by the right operand, from the ObjectTypeRegistry, so
+            // method calls through it can be bound once per type:
+            TypeMember = 1 << 1
+        };
+
+        Operation(const OpSignature &sig, OpFunc func, Specializer specializer = nullptr, int flags = NoFlags);
 
         static inline uint32_t mask(TokenType type);
         static OpId buildMask(TokenType left, TokenType right);
@@ -53,16 +90,47 @@ namespace cparse {
 
         PackToken exec(const PackToken &left, const PackToken &right, EvaluationData *data) const;
 
+        OpKernel specialize(const QString &op, TokenType left, TokenType right) const;
+
+        bool isPure() const;
+        bool isTypeMember() const;
+
+        // The operator and operand types it was added for, e.g.
+        // "+(STR, STR)", or "op(NUM, NUM)" if it is for any operator:
+        const QString &name() const;
+
     private:
         OpId m_mask;
         OpFunc m_exec;
+        Specializer m_specializer;
+        int m_flags;
+        QString m_name;
     };
 
-    class OpMap : public std::map<QString, std::vector<Operation>>
+    // The operations of each operator, the empty one standing for any
+    // operator. They are only changed through add() and remove(), so that
+    // frozen configs built from this map notice the change.
+    class OpMap : private std::map<QString, std::vector<Operation>>
     {
     public:
-        void add(const OpSignature &sig, Operation::OpFunc func);
+        using Map = std::map<QString, std::vector<Operation>>;
+
+        void add(const OpSignature &sig, Operation::OpFunc func, Operation::Specializer specializer = nullptr, int flags = Operation::NoFlags);
+        // Remove the operations of `op`, returns false if it had none:
+        bool remove(const QString &op);
+
+        // The operations of `op`, or nullptr:
+        const std::vector<Operation> *find(const QString &op) const;
+        const Map &map() const;
+
         QString str() const;
+
+        quint64 revision() const;
+
+    private:
+        friend class FrozenConfig;
+
+        quint64 m_revision = nextConfigRevision();
     };
 
     class OpPrecedenceMap
@@ -80,7 +148,14 @@ namespace cparse {
         bool assoc(const QString &op) const;
         bool exists(const QString &op) const;
 
+        quint64 revision() const;
+
     private:
+        friend class Config;
+        friend class FrozenConfig;
+
+        quint64 m_revision = nextConfigRevision();
+
         // Set of operators that should be evaluated from right to left:
         std::set<QString> m_rtol;
         // Map of operators precedence:
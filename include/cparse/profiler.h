@@ -0,0 +1,108 @@
+#ifndef CPARSE_PROFILER_H
+#define CPARSE_PROFILER_H
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <QString>
+
+namespace cparse {
+    // Counts the invocations of operators, operations, functions and
+    // variable lookups of the evaluations using a config it is set on (see
+    // Config::profiler), and the time spent in them. Times are inclusive:
+    // the time of a "()" operator includes the function it calls.
+    //
+    // Each thread records into its own counters, which snapshot() merges,
+    // so evaluations on several threads do not contend on the profiler.
+    class Profiler
+    {
+    public:
+        enum Kind {
+            // By operator, e.g. "+":
+            Operator,
+            // By operation of OpMap, see Operation::name():
+            Operation,
+            // By function name:
+            Function,
+            // By the way the variables were found: "local", "config",
+            // "resolver", "batch resolver" or "unresolved":
+            Variable,
+            // By subexpression of a calculator's source, named by
+            // Calculator::subexpressions():
+            Subexpression
+        };
+
+        struct Counter
+        {
+            quint64 calls = 0;
+            std::chrono::nanoseconds time = std::chrono::nanoseconds::zero();
+        };
+
+        using Counters = std::map<QString, Counter>;
+
+        Profiler();
+        ~Profiler();
+
+        Profiler(const Profiler &) = delete;
+        Profiler &operator=(const Profiler &) = delete;
+
+        // The counters of all threads so far:
+        Counters snapshot(Kind kind) const;
+        void reset();
+
+        void record(Kind kind, const QString &name, std::chrono::nanoseconds time = std::chrono::nanoseconds::zero());
+
+        // Records the time until it is destroyed, if `profiler` is not null.
+        // `name` must outlive it:
+        class Timer
+        {
+        public:
+            Timer(Profiler *profiler, Kind kind, const QString &name)
+                : m_profiler(profiler), m_kind(kind), m_name(&name)
+            {
+                if (profiler) {
+                    m_start = Clock::now();
+                }
+            }
+
+            ~Timer()
+            {
+                if (m_profiler) {
+                    m_profiler->record(m_kind, *m_name, Clock::now() - m_start);
+                }
+            }
+
+            Timer(const Timer &) = delete;
+            Timer &operator=(const Timer &) = delete;
+
+        private:
+            using Clock = std::chrono::steady_clock;
+
+            Profiler *m_profiler;
+            Kind m_kind;
+            const QString *m_name;
+            Clock::time_point m_start;
+        };
+
+    private:
+        struct Shard
+        {
+            std::mutex mutex;
+            Counters counters[Subexpression + 1];
+        };
+
+        Shard &shard();
+
+        // Identifies the profiler in the per-thread caches of shards, even
+        // if another one is later created at the same address:
+        const quint64 m_id;
+
+        mutable std::mutex m_mutex;
+        std::vector<std::unique_ptr<Shard>> m_shards;
+    };
+}
+
+#endif // CPARSE_PROFILER_H
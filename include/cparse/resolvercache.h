@@ -0,0 +1,80 @@
+#ifndef CPARSE_RESOLVERCACHE_H
+#define CPARSE_RESOLVERCACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+#include <QString>
+
+#include "packtoken.h"
+
+namespace cparse {
+    // Memoizes the answers of Config::variableResolver, so a name used
+    // several times is only resolved once (see Config::resolverCache).
+    //
+    // With the PerEvaluation scope, each evaluation asks the resolver once
+    // per name. With AcrossEvaluations, the answers are also shared by the
+    // evaluations that follow, until they are older than the time to live
+    // (if any) or invalidate() is called. Errors are never kept across
+    // evaluations, so a failed lookup is retried by the next one. Each
+    // evaluation gets its own copy of the lists and maps kept, so one
+    // changing them does not affect the others.
+    //
+    // A cache can be shared by concurrent evaluations.
+    class VariableResolverCache
+    {
+    public:
+        enum Scope {
+            PerEvaluation,
+            AcrossEvaluations
+        };
+
+        explicit VariableResolverCache(Scope scope = PerEvaluation,
+                                       std::chrono::milliseconds timeToLive = std::chrono::milliseconds::zero());
+
+        Scope scope() const;
+        // Zero if the answers do not expire:
+        std::chrono::milliseconds timeToLive() const;
+
+        // Forget the answers kept across evaluations, e.g. when the data
+        // behind the resolver changed. Increments the generation:
+        void invalidate();
+        quint64 generation() const;
+
+        // The lookups answered from the cache, and those the resolver was called for:
+        quint64 hits() const;
+        quint64 misses() const;
+        void resetStatistics();
+
+        // Used by the evaluations. find() counts a hit if it returns the
+        // answer kept for `key` across evaluations, and a miss otherwise.
+        // insert() drops answers looked up before the last invalidate(),
+        // i.e. in an earlier `generation`:
+        bool find(const QString &key, PackToken *value);
+        void insert(const QString &key, const PackToken &value, quint64 generation);
+        void countHit();
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Entry
+        {
+            PackToken value;
+            Clock::time_point expiry;
+        };
+
+        const Scope m_scope;
+        const std::chrono::milliseconds m_timeToLive;
+
+        mutable std::mutex m_mutex;
+        std::map<QString, Entry> m_entries;
+        std::atomic<quint64> m_generation{0};
+
+        std::atomic<quint64> m_hits{0};
+        std::atomic<quint64> m_misses{0};
+    };
+}
+
+#endif // CPARSE_RESOLVERCACHE_H
@@ -1,6 +1,7 @@
 #ifndef CPARSE_SHUNTING_YARD_H_
 #define CPARSE_SHUNTING_YARD_H_
 
+#include <chrono>
 #include <iostream>
 
 #include <map>
@@ -19,19 +20,149 @@
 #include "token.h"
 #include "tokentype.h"
 #include "config.h"
+#include "frozenconfig.h"
+#include "evaluationcontext.h"
 #include "packtoken.h"
 #include "containers.h"
 #include "functions.h"
 
 namespace cparse {
+    class ExecutionTree;
+    using ExecutionTreePtr = std::shared_ptr<const ExecutionTree>;
+    class RegisterProgram;
+    using RegisterProgramPtr = std::shared_ptr<const RegisterProgram>;
+
+    // The types variables are declared to have when compiling, e.g. {{"price", REAL}, {"qty", INT}}:
+    using VariableTypes = std::map<QString, TokenType>;
+
+    // The names an expression refers to, see RpnBuilder::dependencies():
+    struct Dependencies
+    {
+        // Variables read from the evaluation scope, including those
+        // bound at compile time:
+        std::set<QString> variables;
+        // Functions of the config scope:
+        std::set<QString> functions;
+        // The member paths read or assigned, each as long as its chain of
+        // '.', e.g. "order.customer.rate":
+        std::set<QString> members;
+        // Variables and member paths assigned with "=":
+        std::set<QString> assigned;
+    };
+
+    // What compiling an expression took and produced, see
+    // Calculator::compile() and RpnBuilder::statistics():
+    struct CompileStatistics
+    {
+        // Reading the numbers, names, strings and operators of the source,
+        // including the custom parsers:
+        std::chrono::nanoseconds lexing = std::chrono::nanoseconds::zero();
+        // Ordering the operators into RPN (the Shunting-yard stage):
+        std::chrono::nanoseconds parsing = std::chrono::nanoseconds::zero();
+        // Fusing method calls and building the execution tree or register
+        // program:
+        std::chrono::nanoseconds optimizing = std::chrono::nanoseconds::zero();
+
+        size_t rpnLength = 0;
+        size_t stackDepth = 0;
+        size_t literals = 0;
+        // Distinct ones, see RpnBuilder::dependencies():
+        size_t variables = 0;
+        size_t functions = 0;
+        // The memory the tokens of the RPN queue hold:
+        quint64 bytes = 0;
+    };
+
+    // The characters [begin, end) of the source an RPN token was compiled
+    // from. The span of an operator covers the whole subexpression it
+    // computes, its operands and brackets included:
+    struct SourceSpan
+    {
+        int begin = 0;
+        int end = 0;
+    };
+
+    // The spans of the tokens of an RPN queue, in the same order:
+    using SourceSpans = std::vector<SourceSpan>;
+
     // This struct was created to expose internal toRPN() variables
     // to custom parsers, in special to the rWordParser_t functions.
     class RpnBuilder
     {
     public:
-        static TokenQueue toRPN(const QString &expr, const TokenMap &vars, const QString &delim, int *rest, const Config &config);
-
-        static Token *calculate(const TokenQueue &RPN, const TokenMap &scope, const Config &config = Config::defaultConfig());
+        // If `spans` is given, it receives the source span of each token of
+        // the returned queue. If `statistics` is, it receives the time each
+        // stage took and the statistics() of the returned queue:
+        static TokenQueue toRPN(const QString &expr,
+                                const TokenMap &vars,
+                                const QString &delim,
+                                int *rest,
+                                const Config &config,
+                                SourceSpans *spans = nullptr,
+                                CompileStatistics *statistics = nullptr);
+
+        // If the config has a profiler and `subexpressions` is given, the
+        // operators and variables are also counted as Profiler::Subexpression
+        // under their name in it, indexed like the tokens of `RPN`. Empty
+        // names are not counted:
+        static Token *calculate(const TokenQueue &RPN,
+                                const TokenMap &scope,
+                                const Config &config = Config::defaultConfig(),
+                                EvaluationContext *context = nullptr,
+                                const std::vector<QString> *subexpressions = nullptr);
+
+        // The variables, config functions and members `rpn` uses, found without
+        // evaluating it. Members are only followed from variables:
+        static Dependencies dependencies(const TokenQueue &rpn, const Config &config);
+
+        // The size of `rpn` and the names it uses. The times are left zero:
+        static CompileStatistics statistics(const TokenQueue &rpn, const Config &config);
+
+        // Returns a copy of `rpn` with the variables of `knownVars` replaced
+        // by their values, whatever the evaluation scope holds for them, and
+        // its pure subexpressions depending only on them and constants
+        // evaluated. Variables assigned to keep their name. If `folded` is
+        // given, the names of the config scope are folded as constants too,
+        // and those folded are added to it, as the evaluation scope may
+        // rebind them. The returned queue is owned by the caller:
+        static TokenQueue specialize(const TokenQueue &rpn, const TokenMap &knownVars, const Config &config, std::vector<QString> *folded = nullptr);
+
+        // Compile `rpn` into a tree of nodes, each bound to the operations,
+        // literal or variable it evaluates, as an alternative to interpreting
+        // the queue. Returns nullptr if `rpn` is not a single expression:
+        static ExecutionTreePtr buildTree(const TokenQueue &rpn, const Config &config);
+
+        // Evaluate a tree built with the same config:
+        static Token *calculate(const ExecutionTree &tree, const TokenMap &scope, const Config &config = Config::defaultConfig());
+
+        // Compile `rpn` into instructions for a register machine, with
+        // frequent instruction sequences fused into superinstructions.
+        // Types are propagated from the declared variable types, and the
+        // operators whose operand types are known get their operation (or
+        // its kernel) selected at compile time. They fall back to run time
+        // dispatch if a value does not have its declared type. Repeated
+        // pure subexpressions are computed once into temporary registers.
+        // Returns nullptr if `rpn` is not a single expression:
+        static RegisterProgramPtr buildProgram(const TokenQueue &rpn, const Config &config, const VariableTypes &variableTypes = {});
+
+        // Run a program built with the same config:
+        static Token *calculate(const RegisterProgram &program,
+                                const TokenMap &scope,
+                                const Config &config = Config::defaultConfig(),
+                                EvaluationContext *context = nullptr);
+
+        // The memory a tree or program holds: its nodes or instructions,
+        // the tokens and call sites they own, and for a program its
+        // registers and the copy without shared subexpressions. The frozen
+        // config is shared with the other expressions, and not counted:
+        static quint64 retainedBytes(const ExecutionTree &tree);
+        static quint64 retainedBytes(const RegisterProgram &program);
+
+        // List the instructions of a program, for debugging:
+        static QString str(const RegisterProgram &program);
+
+        // The maximum number of operands on the stack while evaluating `rpn`:
+        static size_t stackDepth(TokenQueue rpn);
 
         static void clearRPN(TokenQueue *rpn);
 
@@ -48,7 +179,7 @@ namespace cparse {
         void setLastTokenType(TokenType type);
 
     private:
-        RpnBuilder(const OpPrecedenceMap &opp) : m_opp(opp) { }
+        RpnBuilder(const FrozenConfig &config) : m_config(config) { }
 
         void processOpStack();
 
@@ -70,16 +201,34 @@ namespace cparse {
         void handleLeftUnary(const QString &op);
         void handleRightUnary(const QString &op);
 
+        // Add a token to the RPN, recording where it comes from:
+        void push(Token *token);
+        // The subexpression span of each token, once the RPN is complete:
+        SourceSpans spans() const;
+
         TokenQueue m_rpn;
         std::stack<QString> m_opStack;
         uint8_t m_lastTokenWasOp = true;
         bool m_lastTokenWasUnary = false;
-        const OpPrecedenceMap &m_opp;
+        const FrozenConfig &m_config;
 
         // Used to make sure the expression won't
         // end inside a bracket evaluation just because
         // found a delimiter like '\n' or ')'
         uint32_t m_bracketLevel = 0;
+
+        // The offset toRPN() is parsing from, and the spans of the tokens
+        // pushed so far. Operands get theirs once parsed (end == -1 until
+        // then), operators get theirs from their operands in spans():
+        int m_position = 0;
+        // The time spent handling operators, operands and brackets, if
+        // toRPN() is measuring it:
+        std::chrono::nanoseconds *m_parsing = nullptr;
+        SourceSpans m_spans;
+        // Where each open bracket is, and the RPN index of the last token
+        // of each closed one, which its brackets are added to:
+        std::stack<int> m_bracketStarts;
+        std::vector<std::pair<size_t, SourceSpan>> m_brackets;
     };
 
 } // namespace cparse
@@ -5,15 +5,32 @@
 
 #include <QString>
 
+#include <atomic>
+#include <cstddef>
 #include <queue>
 
 namespace cparse {
+    class TokenAllocationHook;
+    class TokenMemoryMeter;
+
     class Token
     {
     public:
-        Token() { }
-        Token(TokenType type) : m_type(type) { }
-        virtual ~Token() { }
+        Token() { accountConstruction(); }
+        Token(TokenType type) : m_type(type) { accountConstruction(); }
+        Token(const Token &other) : m_type(other.m_type) { accountConstruction(); }
+        Token &operator=(const Token &) = default;
+        virtual ~Token()
+        {
+            if (accounting.load(std::memory_order_relaxed)) {
+                accountRelease();
+            }
+        }
+
+        // Tokens are small and short lived, so they are recycled through
+        // per-thread free lists instead of going back to the heap:
+        static void *operator new(std::size_t size);
+        static void operator delete(void *ptr, std::size_t size);
 
         virtual Token *clone() const = 0;
 
@@ -25,6 +42,32 @@ namespace cparse {
         virtual QString asString() const;
 
         TokenType m_type = TokenType::ANY_TYPE;
+
+    private:
+        friend class TokenMemoryMeter;
+        friend TokenAllocationHook *setTokenAllocationHook(TokenAllocationHook *hook);
+
+        // Non-zero while allocations are counted, see tokenallocation.h:
+        static std::atomic<int> accounting;
+
+        // Allocations are reported once the type of the token is known, by
+        // the constructor of this class. Derived classes must pass their
+        // type to it for them to be reported with that type:
+        void accountConstruction() const
+        {
+            if (accounting.load(std::memory_order_relaxed)) {
+                reportConstruction();
+            }
+        }
+
+        static void startAccounting();
+        static void stopAccounting();
+        static void accountAllocation(void *ptr, std::size_t size);
+        static void accountDeallocation(void *ptr, std::size_t size);
+        void reportConstruction() const;
+        void accountRelease() const;
+        static void reportAllocation(TokenType type, std::size_t size);
+        static void reportRelease(TokenType type, std::size_t size);
     };
 
     template <class T>
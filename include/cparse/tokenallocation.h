@@ -0,0 +1,109 @@
+#ifndef CPARSE_TOKENALLOCATION_H
+#define CPARSE_TOKENALLOCATION_H
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+
+#include "token.h"
+
+namespace cparse {
+    // Receives the allocations and releases of tokens on all threads, once
+    // installed with setTokenAllocationHook(). It is called on the thread
+    // allocating, so it must be thread-safe. Tokens are reported by the
+    // size of their object, not counting the strings or containers they
+    // own, and with their type once they are constructed.
+    class TokenAllocationHook
+    {
+    public:
+        virtual ~TokenAllocationHook() = default;
+
+        virtual void allocated(TokenType type, std::size_t bytes) = 0;
+        virtual void released(TokenType type, std::size_t bytes) = 0;
+    };
+
+    // Installs `hook`, or uninstalls the current one if null, and returns
+    // the previous one. Threads already reporting to the previous hook may
+    // still do so for a moment, so it must outlive them. Nothing is counted
+    // while no hook or meter is installed.
+    TokenAllocationHook *setTokenAllocationHook(TokenAllocationHook *hook);
+
+    // A hook counting the tokens allocated by type, and the bytes they hold:
+    class TokenAllocationCounter : public TokenAllocationHook
+    {
+    public:
+        struct Usage
+        {
+            quint64 allocations = 0;
+            quint64 bytes = 0;
+        };
+
+        using UsageByType = std::map<TokenType, Usage>;
+
+        TokenAllocationCounter();
+
+        void allocated(TokenType type, std::size_t bytes) override;
+        void released(TokenType type, std::size_t bytes) override;
+
+        // The tokens allocated so far, by type:
+        UsageByType allocations() const;
+        // The bytes allocated minus those released, and the highest it got.
+        // Tokens allocated before the counter was installed lower it when
+        // released:
+        qint64 liveBytes() const;
+        qint64 peakBytes() const;
+
+        void reset();
+
+    private:
+        // Indexed by type, references included:
+        std::atomic<quint64> m_allocations[ANY_TYPE + 1];
+        std::atomic<quint64> m_bytes[ANY_TYPE + 1];
+        std::atomic<qint64> m_live{0};
+        std::atomic<qint64> m_peak{0};
+    };
+
+    // Counts the tokens allocated and released on the thread creating it,
+    // while it exists, e.g. around one evaluation:
+    //
+    //     TokenMemoryMeter meter;
+    //     calc.evaluate(vars);
+    //     meter.peakBytes(); // The most the evaluation held at once
+    //
+    // Meters may be nested, and work with or without a hook installed.
+    class TokenMemoryMeter
+    {
+    public:
+        TokenMemoryMeter();
+        ~TokenMemoryMeter();
+
+        TokenMemoryMeter(const TokenMemoryMeter &) = delete;
+        TokenMemoryMeter &operator=(const TokenMemoryMeter &) = delete;
+
+        quint64 allocations() const;
+        quint64 allocatedBytes() const;
+        // The bytes allocated minus those released, which is negative if
+        // more tokens that existed before were released, and its highest:
+        qint64 liveBytes() const;
+        qint64 peakBytes() const;
+
+    private:
+        friend class Token;
+
+        void allocated(std::size_t bytes);
+        void released(std::size_t bytes);
+
+        TokenMemoryMeter *const m_outer;
+        quint64 m_allocations = 0;
+        quint64 m_bytes = 0;
+        qint64 m_live = 0;
+        qint64 m_peak = 0;
+    };
+
+    // The memory `token` holds: its object, and the strings and elements it
+    // owns. Containers shared by several tokens are counted once. References
+    // count their key, not the value the scopes hold for them:
+    quint64 retainedBytes(const Token *token);
+}
+
+#endif // CPARSE_TOKENALLOCATION_H
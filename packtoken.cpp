@@ -17,6 +17,83 @@ using cparse::Tuple;
 namespace {
     using namespace cparse;
 
+    // Token sizes are rounded up to 16 bytes, tokens over 256 bytes
+    // are not recycled:
+    constexpr std::size_t tokenSizeStep = 16;
+    constexpr std::size_t tokenSizeClasses = 16;
+    constexpr std::size_t maxFreeTokens = 1024;
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    // Trivially destructible, so tokens deleted while the thread
+    // exits can still check whether the lists were released:
+    struct TokenFreeLists
+    {
+        FreeBlock *heads[tokenSizeClasses];
+        std::size_t counts[tokenSizeClasses];
+        bool released;
+    };
+
+    thread_local TokenFreeLists freeLists{};
+
+    // Returns the cached blocks to the heap when the thread exits:
+    struct TokenFreeListsOwner
+    {
+        bool armed = false;
+
+        ~TokenFreeListsOwner()
+        {
+            for (FreeBlock *&head : freeLists.heads) {
+                while (head) {
+                    FreeBlock *next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+
+            freeLists.released = true;
+        }
+    };
+
+    thread_local TokenFreeListsOwner freeListsOwner;
+
+    void *allocateToken(std::size_t size)
+    {
+        const std::size_t index = (size - 1) / tokenSizeStep;
+
+        if (index >= tokenSizeClasses || freeLists.released) {
+            return ::operator new(size);
+        }
+
+        if (FreeBlock *block = freeLists.heads[index]) {
+            freeLists.heads[index] = block->next;
+            --freeLists.counts[index];
+            return block;
+        }
+
+        // Make sure the lists are released with the thread:
+        freeListsOwner.armed = true;
+        return ::operator new((index + 1) * tokenSizeStep);
+    }
+
+    void releaseToken(void *ptr, std::size_t size)
+    {
+        const std::size_t index = (size - 1) / tokenSizeStep;
+
+        if (index >= tokenSizeClasses || freeLists.released || freeLists.counts[index] >= maxFreeTokens) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        auto *block = static_cast<FreeBlock *>(ptr);
+        block->next = freeLists.heads[index];
+        freeLists.heads[index] = block;
+        ++freeLists.counts[index];
+    }
+
     PackToken &noneToken()
     {
         static PackToken none = PackToken(TokenNone());
@@ -92,6 +169,11 @@ PackToken &PackToken::operator=(const PackToken &t)
 
 bool PackToken::operator==(const PackToken &token) const
 {
+    // Integers are compared exactly, as doubles cannot hold all of them:
+    if (token.m_base->m_type == INT && m_base->m_type == INT) {
+        return token.asInt() == asInt();
+    }
+
     if (NUM & token.m_base->m_type & m_base->m_type) {
         return token.asReal() == asReal();
     }
@@ -271,6 +353,26 @@ bool PackToken::canConvertTo(TokenType type) const
     return m_base->canConvertTo(type);
 }
 
+void *cparse::Token::operator new(std::size_t size)
+{
+    void *ptr = allocateToken(size);
+
+    if (accounting.load(std::memory_order_relaxed)) {
+        accountAllocation(ptr, size);
+    }
+
+    return ptr;
+}
+
+void cparse::Token::operator delete(void *ptr, std::size_t size)
+{
+    if (accounting.load(std::memory_order_relaxed)) {
+        accountDeallocation(ptr, size);
+    }
+
+    releaseToken(ptr, size);
+}
+
 bool cparse::Token::canConvertTo(TokenType type) const
 {
     if (m_type == type) {
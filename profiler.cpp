@@ -0,0 +1,76 @@
+#include "profiler.h"
+
+#include <atomic>
+
+using namespace cparse;
+
+namespace {
+    quint64 nextProfilerId()
+    {
+        static std::atomic<quint64> id{0};
+        return ++id;
+    }
+}
+
+Profiler::Profiler() : m_id(nextProfilerId()) { }
+
+Profiler::~Profiler() = default;
+
+Profiler::Counters Profiler::snapshot(Kind kind) const
+{
+    Counters merged;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (const auto &shard : m_shards) {
+        std::lock_guard<std::mutex> shardLock(shard->mutex);
+
+        for (const auto &[name, counter] : shard->counters[kind]) {
+            Counter &total = merged[name];
+            total.calls += counter.calls;
+            total.time += counter.time;
+        }
+    }
+
+    return merged;
+}
+
+void Profiler::reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (const auto &shard : m_shards) {
+        std::lock_guard<std::mutex> shardLock(shard->mutex);
+
+        for (Counters &counters : shard->counters) {
+            counters.clear();
+        }
+    }
+}
+
+void Profiler::record(Kind kind, const QString &name, std::chrono::nanoseconds time)
+{
+    Shard &own = shard();
+
+    // Only contended while a snapshot is taken:
+    std::lock_guard<std::mutex> lock(own.mutex);
+    Counter &counter = own.counters[kind][name];
+    ++counter.calls;
+    counter.time += time;
+}
+
+Profiler::Shard &Profiler::shard()
+{
+    // The shard of each profiler this thread recorded into:
+    thread_local std::vector<std::pair<quint64, Shard *>> shards;
+
+    for (const auto &[id, shard] : shards) {
+        if (id == m_id) {
+            return *shard;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_shards.push_back(std::make_unique<Shard>());
+    shards.emplace_back(m_id, m_shards.back().get());
+    return *m_shards.back();
+}
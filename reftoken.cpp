@@ -39,7 +39,7 @@ Token *RefToken::resolve(const TokenMap *localScope, const TokenMap *configScope
     }
 
     if (pack == nullptr && m_origin->m_type != NONE && m_key.canConvertToString()) {
-        const auto &typeMap = ObjectTypeRegistry::typeMap(m_origin->m_type);
+        const auto &typeMap = ObjectTypeRegistry::constTypeMap(m_origin->m_type);
         pack = typeMap.find(m_key.asString());
     }
 
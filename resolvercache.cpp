@@ -0,0 +1,157 @@
+#include "resolvercache.h"
+
+#include "containers.h"
+
+using namespace cparse;
+
+namespace {
+    // A copy of `value` sharing no container with it, so an evaluation
+    // changing the lists or maps it got from the cache does not change
+    // them for the others. `copies` maps the containers already copied to
+    // their copy, which keeps those shared or nested in themselves so:
+    PackToken detached(const PackToken &value, std::map<const void *, PackToken> *copies)
+    {
+        const Token *token = value.token();
+
+        switch (token->m_type) {
+        case MAP: {
+            const TokenMap *map = static_cast<const TokenMap *>(token);
+
+            if (auto it = copies->find(&map->map()); it != copies->end()) {
+                return it->second;
+            }
+
+            TokenMap copy = TokenMap::detachedCopy(*map);
+            copies->emplace(&map->map(), copy);
+
+            for (auto &[key, element] : copy.map()) {
+                element = detached(element, copies);
+            }
+
+            return copy;
+        }
+        case LIST:
+        case TUPLE:
+        case STUPLE: {
+            const TokenList *list = static_cast<const TokenList *>(token);
+
+            if (auto it = copies->find(&list->list()); it != copies->end()) {
+                return it->second;
+            }
+
+            TokenList *copy = token->m_type == LIST ? new TokenList : token->m_type == TUPLE ? new Tuple : new STuple;
+            PackToken packed(copy);
+            copies->emplace(&list->list(), packed);
+
+            for (const PackToken &element : list->list()) {
+                copy->push(detached(element, copies));
+            }
+
+            return packed;
+        }
+        default:
+            return value;
+        }
+    }
+
+    PackToken detached(const PackToken &value)
+    {
+        std::map<const void *, PackToken> copies;
+        return detached(value, &copies);
+    }
+}
+
+VariableResolverCache::VariableResolverCache(Scope scope, std::chrono::milliseconds timeToLive)
+    : m_scope(scope), m_timeToLive(timeToLive)
+{
+}
+
+VariableResolverCache::Scope VariableResolverCache::scope() const
+{
+    return m_scope;
+}
+
+std::chrono::milliseconds VariableResolverCache::timeToLive() const
+{
+    return m_timeToLive;
+}
+
+void VariableResolverCache::invalidate()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    ++m_generation;
+}
+
+quint64 VariableResolverCache::generation() const
+{
+    return m_generation;
+}
+
+quint64 VariableResolverCache::hits() const
+{
+    return m_hits;
+}
+
+quint64 VariableResolverCache::misses() const
+{
+    return m_misses;
+}
+
+void VariableResolverCache::resetStatistics()
+{
+    m_hits = 0;
+    m_misses = 0;
+}
+
+bool VariableResolverCache::find(const QString &key, PackToken *value)
+{
+    if (m_scope == AcrossEvaluations) {
+        PackToken cached;
+        bool found = false;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_entries.find(key);
+
+            if (it != m_entries.end()) {
+                if (m_timeToLive == m_timeToLive.zero() || Clock::now() < it->second.expiry) {
+                    // Shares the containers of the entry, which are never
+                    // changed, so they are copied after unlocking:
+                    cached = it->second.value;
+                    found = true;
+                } else {
+                    m_entries.erase(it);
+                }
+            }
+        }
+
+        if (found) {
+            *value = detached(cached);
+            ++m_hits;
+            return true;
+        }
+    }
+
+    ++m_misses;
+    return false;
+}
+
+void VariableResolverCache::insert(const QString &key, const PackToken &value, quint64 generation)
+{
+    if (m_scope != AcrossEvaluations || value->m_type == ERROR) {
+        return;
+    }
+
+    Entry entry{detached(value), Clock::now() + m_timeToLive};
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (generation == m_generation) {
+        m_entries.insert_or_assign(key, std::move(entry));
+    }
+}
+
+void VariableResolverCache::countHit()
+{
+    ++m_hits;
+}
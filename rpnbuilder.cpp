@@ -1,5 +1,6 @@
 #include "rpnbuilder.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
@@ -11,63 +12,1691 @@
 #include <stack>
 #include <utility> // For std::pair
 #include <cstring> // For strchr()
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+
+#include <QStringList>
 
 #include "cparse.h"
 #include "calculator.h"
+#include "asyncevaluation.h"
+#include "profiler.h"
+#include "resolvercache.h"
+#include "tokenallocation.h"
 #include "tokenhelpers.h"
 #include "reftoken.h"
 
-using namespace cparse;
+using namespace cparse;
+
+Q_LOGGING_CATEGORY(cparseLog, "cparse")
+
+namespace {
+    using namespace cparse;
+
+    [[maybe_unused]] void log_undefined_operation(const QString &op, const PackToken &left, const PackToken &right)
+    {
+        qWarning(cparseLog) << "Unexpected rpn operation with operator '" << op
+                            << "' and operands: " << left.str() << " and " << right.str();
+    }
+
+    bool match_op_id(OpId id, OpId mask)
+    {
+        quint64 result = id & mask;
+        auto *val = reinterpret_cast<uint32_t *>(&result);
+        return (val[0] && val[1]);
+    }
+
+    Token *exec_operation(const PackToken &left, const PackToken &right, EvaluationData *data, const FrozenConfig::OpEntry *entry)
+    {
+        // Try the operator's own operations first, then the ones
+        // registered for any operator:
+        for (const auto *operations : {entry ? entry->operations : nullptr, data->config.anyOperations()}) {
+            if (!operations) {
+                continue;
+            }
+
+            for (const Operation &operation : *operations) {
+                if (match_op_id(data->opID, operation.getMask())) {
+                    auto *execToken = operation.exec(left, right, data).release();
+
+                    if (execToken->m_type == TokenType::REJECT) {
+                        delete execToken;
+                        continue;
+                    }
+
+                    return execToken;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    // The tokens of a compiled expression, which the evaluation walks
+    // without copying the queue:
+    const std::deque<Token *> &tokensOf(const TokenQueue &rpn)
+    {
+        struct Access : TokenQueue
+        {
+            static const container_type &container(const TokenQueue &queue) { return queue.*&Access::c; }
+        };
+
+        return Access::container(rpn);
+    }
+
+    // Adds the time until it is destroyed to `*total`, if given:
+    class StageTimer
+    {
+    public:
+        explicit StageTimer(std::chrono::nanoseconds *total) : m_total(total)
+        {
+            if (total) {
+                m_start = Clock::now();
+            }
+        }
+
+        ~StageTimer()
+        {
+            if (m_total) {
+                *m_total += Clock::now() - m_start;
+            }
+        }
+
+        StageTimer(const StageTimer &) = delete;
+        StageTimer &operator=(const StageTimer &) = delete;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        std::chrono::nanoseconds *m_total;
+        Clock::time_point m_start;
+    };
+
+    // A `receiver.method(args)` call site, see fuseMethodCalls(). The method
+    // each receiver type resolves to is cached on the site, which is shared
+    // by all copies of the compiled expression.
+    class MethodCallToken : public TokenTyped<QString>
+    {
+    public:
+        static const QString &op()
+        {
+            static const QString fusedOp = ".()";
+            return fusedOp;
+        }
+
+        explicit MethodCallToken(const QString &name)
+            : TokenTyped<QString>(op(), OP), m_name(name), m_site(std::make_shared<Site>())
+        {
+        }
+
+        Token *clone() const override { return new MethodCallToken(*this); }
+
+        const QString &name() const { return m_name; }
+
+        // The method to call on `receiver`, or nullptr if the call has to
+        // go through the '.' operation. Methods are only bound when the
+        // '.' operation for the receiver type takes them from the
+        // ObjectTypeRegistry, and until the registry changes. The caller
+        // holds on to the method while calling it, since another thread
+        // may replace the cache meanwhile:
+        std::shared_ptr<const Token> method(const Token *receiver, const FrozenConfig &config) const
+        {
+            // Map attributes depend on the map, not on its type:
+            if (receiver->m_type == MAP || !takesTypeMember(receiver->m_type, config)) {
+                return nullptr;
+            }
+
+            const quint64 revision = ObjectTypeRegistry::revision();
+            std::shared_ptr<const Entries> entries = std::atomic_load(&m_site->entries);
+
+            for (const Entry &entry : *entries) {
+                if (entry.type == receiver->m_type && entry.revision == revision) {
+                    return entry.method;
+                }
+            }
+
+            std::shared_ptr<const Token> method;
+            const PackToken *member = ObjectTypeRegistry::constTypeMap(receiver->m_type).find(m_name);
+
+            if (member && (*member)->m_type == FUNC) {
+                method.reset((*member)->clone());
+            }
+
+            // Add it to the entries of the current registry, unless another
+            // thread updated them meanwhile, in which case start over from
+            // its version:
+            std::shared_ptr<const Entries> updated;
+
+            do {
+                auto next = std::make_shared<Entries>();
+
+                for (const Entry &entry : *entries) {
+                    if (entry.revision == revision && entry.type != receiver->m_type) {
+                        next->push_back(entry);
+                    }
+                }
+
+                next->push_back({receiver->m_type, revision, method});
+                updated = std::move(next);
+            } while (!std::atomic_compare_exchange_weak(&m_site->entries, &entries, updated));
+
+            return method;
+        }
+
+        // The memory the token holds besides its object, with the cache of
+        // its call site:
+        quint64 retainedBytes() const
+        {
+            const std::shared_ptr<const Entries> entries = std::atomic_load(&m_site->entries);
+            return quint64(m_val.size() + m_name.size()) * sizeof(QChar) + sizeof(Site) + entries->capacity() * sizeof(Entry);
+        }
+
+    private:
+        // Whether the first '.' operation for `type` is the one taking
+        // members from the ObjectTypeRegistry, rather than a custom one:
+        static bool takesTypeMember(TokenType type, const FrozenConfig &config)
+        {
+            const FrozenConfig::OpEntry *dot = config.findOp(".");
+
+            if (!dot || !dot->operations) {
+                return false;
+            }
+
+            const OpId id = Operation::buildMask(type, STR);
+
+            for (const Operation &operation : *dot->operations) {
+                if (match_op_id(id, operation.getMask())) {
+                    return operation.isTypeMember();
+                }
+            }
+
+            return false;
+        }
+
+        struct Entry
+        {
+            TokenType type;
+            quint64 revision;
+            std::shared_ptr<const Token> method;
+        };
+
+        using Entries = std::vector<Entry>;
+
+        struct Site
+        {
+            std::shared_ptr<const Entries> entries = std::make_shared<const Entries>();
+        };
+
+        QString m_name;
+        std::shared_ptr<Site> m_site;
+    };
+
+    // Rewrite `receiver name . args ()` into `receiver args .()`, so calling
+    // a type-specific function takes a single instruction. Receivers whose
+    // type has no such function (e.g. a map, or a variable a resolver gives
+    // a meaning, like `env.HOME`) fall back to '.' and '()' when evaluated.
+    // The spans of the tokens removed are dropped from `spans`, if given.
+    void fuseMethodCalls(TokenQueue *rpn, SourceSpans *spans = nullptr)
+    {
+        std::vector<Token *> tokens;
+        tokens.reserve(rpn->size());
+
+        while (!rpn->empty()) {
+            tokens.push_back(rpn->front());
+            rpn->pop();
+        }
+
+        // The tokens producing the operands of each operator:
+        std::vector<std::pair<size_t, size_t>> operands(tokens.size());
+        std::vector<size_t> stack;
+
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (tokens[i]->m_type != OP) {
+                stack.push_back(i);
+                continue;
+            }
+
+            if (stack.size() < 2) {
+                break;
+            }
+
+            const size_t right = stack.back();
+            stack.pop_back();
+            const size_t left = stack.back();
+            stack.pop_back();
+            stack.push_back(i);
+            operands[i] = {left, right};
+
+            if (static_cast<TokenTyped<QString> *>(tokens[i])->m_val != "()" || tokens[left]->m_type != OP || static_cast<TokenTyped<QString> *>(tokens[left])->m_val != ".") {
+                continue;
+            }
+
+            const auto [receiver, name] = operands[left];
+
+            if (name + 1 != left || tokens[name]->m_type != STR) {
+                continue;
+            }
+
+            auto *fused = new MethodCallToken(static_cast<TokenTyped<QString> *>(tokens[name])->m_val);
+
+            delete tokens[name];
+            delete tokens[left];
+            delete tokens[i];
+            tokens[name] = nullptr;
+            tokens[left] = nullptr;
+            tokens[i] = fused;
+        }
+
+        SourceSpans fusedSpans;
+
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (tokens[i]) {
+                rpn->push(tokens[i]);
+
+                if (spans) {
+                    fusedSpans.push_back((*spans)[i]);
+                }
+            }
+        }
+
+        if (spans) {
+            *spans = std::move(fusedSpans);
+        }
+    }
+
+    // A variable followed by a '.' operation is not resolved yet: it is
+    // either the name of a map, which needs no resolving, or an external
+    // name like env.ENV_VAR, whose right hand side must not be resolved in
+    // the wrong context.
+    bool isMemberName(const std::deque<Token *> &program, size_t pc)
+    {
+        if (pc + 1 < program.size() && program[pc + 1]->m_type == TokenType::OP) {
+            return static_cast<const TokenTyped<QString> *>(program[pc + 1])->m_val == ".";
+        }
+
+        return false;
+    }
+
+    // The variables `program` looks up by name, each once:
+    std::vector<QString> variablesOf(const std::deque<Token *> &program)
+    {
+        std::vector<QString> variables;
+        std::set<QString> seen;
+
+        for (size_t pc = 0; pc < program.size(); ++pc) {
+            if (program[pc]->m_type == VAR && !isMemberName(program, pc)) {
+                const QString &name = static_cast<const TokenTyped<QString> *>(program[pc])->m_val;
+
+                if (seen.insert(name).second) {
+                    variables.push_back(name);
+                }
+            }
+        }
+
+        return variables;
+    }
+
+    struct QuickeningSite;
+
+    // An operator, with what applying it needs resolved beforehand:
+    struct Instruction
+    {
+        QString op;
+        const FrozenConfig::OpEntry *entry;
+        // Whether this is the "()" operator, i.e. a function call:
+        bool call;
+
+        // The operation (and its kernel, if it has one) selected at compile
+        // time for operands of the types `left` and `right`:
+        const Operation *operation = nullptr;
+        OpKernel kernel;
+        TokenType left = NONE;
+        TokenType right = NONE;
+
+        // Set on the operators whose operand types are only known at run time:
+        std::shared_ptr<QuickeningSite> quickening;
+    };
+
+    // Select the operation applying `instruction` to operands of known types,
+    // the way exec_operation() would at run time. Returns the type of its
+    // result, if its kernel tells it:
+    TokenType specializeInstruction(Instruction *instruction, const FrozenConfig &config, TokenType left, TokenType right)
+    {
+        const OpId mask = Operation::buildMask(left, right);
+
+        for (const auto *operations : {instruction->entry ? instruction->entry->operations : nullptr, config.anyOperations()}) {
+            if (!operations) {
+                continue;
+            }
+
+            for (const Operation &operation : *operations) {
+                if (match_op_id(mask, operation.getMask())) {
+                    instruction->operation = &operation;
+                    instruction->kernel = operation.specialize(instruction->op, left, right);
+                    instruction->left = left;
+                    instruction->right = right;
+                    return instruction->kernel.func ? instruction->kernel.result : ANY_TYPE;
+                }
+            }
+        }
+
+        return ANY_TYPE;
+    }
+
+    // The operand types seen by an operator of a register program, which
+    // quickens it: once an operator saw the same types `warmUp` times in a
+    // row, a copy of it specialized for them (see specializeInstruction())
+    // takes its place. The specialized copy guards on the operand types, and
+    // the first operands of other types deoptimize it. Operators that
+    // deoptimize too often are left to run time dispatch.
+    //
+    // Sites are shared by the copies of a program, so their state is atomic.
+    // Specialized copies live as long as the site, as evaluations running
+    // concurrently may still use one after it was deoptimized.
+    struct QuickeningSite
+    {
+        static constexpr int warmUp = 16;
+        static constexpr int maxSpecializations = 4;
+
+        // The specialized operator, or nullptr:
+        const Instruction *specialized() const { return m_specialized.load(std::memory_order_acquire); }
+
+        // Record the operand types of an evaluation of `instruction`:
+        void record(const Instruction &instruction, const FrozenConfig &config, TokenType left, TokenType right)
+        {
+            const Instruction *current = specialized();
+
+            if (current) {
+                if (left != current->left || right != current->right) {
+                    m_specialized.store(nullptr, std::memory_order_release);
+                    m_hits.store(0, std::memory_order_relaxed);
+                }
+
+                return;
+            }
+
+            const quint32 types = quint32(left) << 8 | quint32(right);
+
+            if (m_observed.exchange(types, std::memory_order_relaxed) != types) {
+                m_hits.store(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (m_hits.fetch_add(1, std::memory_order_relaxed) + 1 < warmUp) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (specialized() || m_specializations.size() >= size_t(maxSpecializations)) {
+                return;
+            }
+
+            auto quickened = std::make_unique<Instruction>(instruction);
+            quickened->operation = nullptr;
+            quickened->kernel = OpKernel();
+            quickened->quickening.reset();
+
+            specializeInstruction(quickened.get(), config, left, right);
+
+            if (!quickened->operation) {
+                return;
+            }
+
+            m_specialized.store(quickened.get(), std::memory_order_release);
+            m_specializations.push_back(std::move(quickened));
+        }
+
+        // Whether the operator stopped quickening:
+        bool megamorphic() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return !specialized() && m_specializations.size() >= size_t(maxSpecializations);
+        }
+
+        // The memory the site holds, with the operators it specialized:
+        quint64 retainedBytes() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return sizeof(QuickeningSite) + m_specializations.capacity() * sizeof(std::unique_ptr<Instruction>)
+                 + m_specializations.size() * sizeof(Instruction);
+        }
+
+    private:
+        std::atomic<const Instruction *> m_specialized{nullptr};
+        std::atomic<quint32> m_observed{0};
+        std::atomic<int> m_hits{0};
+
+        mutable std::mutex m_mutex;
+        std::vector<std::unique_ptr<Instruction>> m_specializations;
+    };
+
+    // The memory `instruction` holds besides its own object:
+    quint64 instructionBytes(const Instruction &instruction)
+    {
+        quint64 bytes = quint64(instruction.op.size()) * sizeof(QChar);
+
+        if (instruction.quickening) {
+            bytes += instruction.quickening->retainedBytes();
+        }
+
+        return bytes;
+    }
+
+    quint64 namesBytes(const std::vector<QString> &names)
+    {
+        quint64 bytes = names.capacity() * sizeof(QString);
+
+        for (const QString &name : names) {
+            bytes += quint64(name.size()) * sizeof(QChar);
+        }
+
+        return bytes;
+    }
+
+    // The state of a single evaluation, shared by the RPN interpreter and
+    // the execution tree. Its methods take ownership of the tokens they are
+    // given and return the token to push, or nullptr if the evaluation has
+    // to stop with exitValue as its result.
+    class Evaluation
+    {
+    public:
+        // `variables` are the names the expression looks up, which the batch
+        // variable resolver is asked about together:
+        Evaluation(const TokenMap &scope, const Config &config, const FrozenConfig &frozen, const std::vector<QString> *variables = nullptr)
+            : data(scope, frozen, config.variableResolver), m_config(config), m_variables(variables)
+        {
+            data.profiler = config.profiler.get();
+        }
+
+        Instruction instruction(const QString &op) const { return {op, data.config.findOp(op), op == "()"}; }
+
+        // Look a variable up, giving the variable resolver a try at the
+        // names that are neither in the scope nor in the config scope:
+        Token *variable(const TokenTyped<QString> *var)
+        {
+            const QString &key = var->m_val;
+
+            if (const PackToken *value = data.scope.find(key)) {
+                if (data.profiler) {
+                    data.profiler->record(Profiler::Variable, "local");
+                }
+
+                return new RefToken(PackToken(key), (*value)->clone());
+            }
+
+            return resolveVariable(var->clone(), key);
+        }
+
+        bool inScopes(const QString &key) const { return data.scope.find(key) || m_config.scope.find(key); }
+
+        // Whether the functions named `names` are pure where the evaluation
+        // looks them up. Those in neither scope keep their compile time value:
+        bool callsPure(const std::vector<QString> &names) const
+        {
+            for (const QString &name : names) {
+                const PackToken *value = data.scope.find(name);
+
+                if (!value) {
+                    value = m_config.scope.find(name);
+                }
+
+                if (value && ((*value)->m_type != FUNC || !static_cast<const Function *>(value->token())->isPure())) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        Token *resolveVariable(Token *base, const QString &key)
+        {
+            if (inScopes(key)) {
+                if (data.profiler) {
+                    data.profiler->record(Profiler::Variable, data.scope.find(key) ? "local" : "config");
+                }
+
+                return base;
+            }
+
+            PackToken resolverValue;
+
+            // Names that are only known at run time, e.g. returned by an
+            // operation, are resolved one by one:
+            if (!resolveBatched(key, &resolverValue)) {
+                if (!m_config.variableResolver) {
+                    if (data.profiler) {
+                        data.profiler->record(Profiler::Variable, "unresolved");
+                    }
+
+                    return base;
+                }
+
+                static const QString path = "resolver";
+                Profiler::Timer timer(data.profiler, Profiler::Variable, path);
+                resolverValue = callResolver(key);
+            }
+
+            return bindResolved(base, key, resolverValue);
+        }
+
+        // Call the variable resolver, through the resolver cache if the
+        // config has one:
+        PackToken callResolver(const QString &key)
+        {
+            VariableResolverCache *cache = m_config.resolverCache.get();
+
+            if (!cache) {
+                return m_config.variableResolver(key);
+            }
+
+            PackToken value;
+
+            if (!findCached(key, &value)) {
+                const quint64 generation = cache->generation();
+                value = m_config.variableResolver(key);
+                remember(key, value, generation);
+            }
+
+            return value;
+        }
+
+        // The value the resolver cache has for `key`, if the config has one:
+        bool findCached(const QString &key, PackToken *value)
+        {
+            VariableResolverCache *cache = m_config.resolverCache.get();
+
+            if (!cache) {
+                return false;
+            }
+
+            if (auto it = m_resolved.find(key); it != m_resolved.end()) {
+                cache->countHit();
+                *value = it->second;
+                return true;
+            }
+
+            if (!cache->find(key, value)) {
+                return false;
+            }
+
+            m_resolved.emplace(key, *value);
+            return true;
+        }
+
+        // Keep the value a resolver gave for `key` in the resolver cache,
+        // if the config has one. `generation` is that of the cache when
+        // the resolver was asked:
+        void remember(const QString &key, const PackToken &value, quint64 generation)
+        {
+            if (VariableResolverCache *cache = m_config.resolverCache.get()) {
+                cache->insert(key, value, generation);
+                m_resolved.emplace(key, value);
+            }
+        }
+
+        // Bind the value a resolver gave for `key`, in place of the variable `base`:
+        Token *bindResolved(Token *base, const QString &key, const PackToken &resolverValue)
+        {
+            if (resolverValue->m_type == TokenType::ERROR) {
+                exitValue = new TokenError("failed to resolve variable: " + key);
+                delete base;
+                return nullptr;
+            }
+
+            if (resolverValue->m_type == TokenType::REJECT) {
+                return base;
+            }
+
+            Token *value = new RefToken(PackToken(key), resolverValue->clone());
+            delete base;
+            return value;
+        }
+
+        // Ask the batch variable resolver about all the variables of the
+        // expression missing from the scopes, the first time one of them is
+        // looked up. Returns false if `key` is not one of them:
+        bool resolveBatched(const QString &key, PackToken *value)
+        {
+            if (!m_config.batchVariableResolver || !m_variables
+                || std::find(m_variables->begin(), m_variables->end(), key) == m_variables->end()) {
+                return false;
+            }
+
+            static const QString path = "batch resolver";
+            Profiler::Timer timer(data.profiler, Profiler::Variable, path);
+
+            if (!m_batch) {
+                std::vector<QString> missing;
+
+                for (const QString &name : *m_variables) {
+                    if (!inScopes(name)) {
+                        missing.push_back(name);
+                    }
+                }
+
+                m_batch = std::make_unique<TokenMap>(m_config.batchVariableResolver(missing));
+            }
+
+            // Left out of the answer means unknown to the resolver:
+            const PackToken *resolved = m_batch->find(key);
+            *value = resolved ? *resolved : PackToken::Reject();
+            return true;
+        }
+
+        Token *apply(const Instruction &instruction, Token *l_token, Token *r_token)
+        {
+            Profiler::Timer timer(data.profiler, Profiler::Operator, instruction.op);
+
+            if (budget) {
+                return applyWithin(*budget, instruction, l_token, r_token);
+            }
+
+            return dispatch(instruction, l_token, r_token);
+        }
+
+        Token *dispatch(const Instruction &instruction, Token *l_token, Token *r_token)
+        {
+            if (instruction.kernel.func) {
+                return applyKernel(instruction, l_token, r_token);
+            }
+
+            if (instruction.quickening) {
+                return applyQuickened(instruction, l_token, r_token);
+            }
+
+            return applyOperation(instruction, l_token, r_token);
+        }
+
+        // Apply an operator, counting it and the size of its result against `budget`:
+        Token *applyWithin(EvaluationBudget &budget, const Instruction &instruction, Token *l_token, Token *r_token)
+        {
+            if (!budget.step()) {
+                delete resolveReferenceToken(l_token);
+                delete resolveReferenceToken(r_token);
+                return stop(budget);
+            }
+
+            Token *result = dispatch(instruction, l_token, r_token);
+
+            if (result && !budget.allocate(result)) {
+                delete resolveReferenceToken(result);
+                return stop(budget);
+            }
+
+            return result;
+        }
+
+        Token *stop(const EvaluationBudget &budget)
+        {
+            exitValue = new TokenError(budget.cause());
+            return nullptr;
+        }
+
+        // Call a function, counting it against the call depth limit:
+        PackToken call(const PackToken &_this, const Function *func, TokenList *args)
+        {
+            if (budget && !budget->enterCall()) {
+                budget->leaveCall();
+                return PackToken::Error(budget->cause());
+            }
+
+            PackToken ret;
+
+            if (data.profiler) {
+                const QString name = func->name();
+                Profiler::Timer timer(data.profiler, Profiler::Function, name);
+                ret = Function::call(_this, func, args, data.scope);
+            } else {
+                ret = Function::call(_this, func, args, data.scope);
+            }
+
+            if (budget) {
+                budget->leaveCall();
+            }
+
+            return ret;
+        }
+
+        // Run the kernel selected for `instruction` if the operands have the
+        // types it was selected for. Returns nullptr, leaving the operands
+        // alone, otherwise:
+        Token *tryKernel(const Instruction &instruction, Token *l_token, Token *r_token)
+        {
+            Token *left = (l_token->m_type & REF) ? static_cast<RefToken *>(l_token)->resolve(&data.scope, &m_config.scope) : l_token;
+            Token *right = (r_token->m_type & REF) ? static_cast<RefToken *>(r_token)->resolve(&data.scope, &m_config.scope) : r_token;
+            Token *result = nullptr;
+
+            if (left->m_type == instruction.left && right->m_type == instruction.right) {
+                result = instruction.kernel.func(left, right);
+                delete l_token;
+                delete r_token;
+            }
+
+            if (left != l_token) {
+                delete left;
+            }
+
+            if (right != r_token) {
+                delete right;
+            }
+
+            return result;
+        }
+
+        Token *applyKernel(const Instruction &instruction, Token *l_token, Token *r_token)
+        {
+            if (Token *result = tryKernel(instruction, l_token, r_token)) {
+                return result;
+            }
+
+            return applyOperation(instruction, l_token, r_token);
+        }
+
+        // Apply the specialized copy of the instruction, if its site has one:
+        Token *applyQuickened(const Instruction &instruction, Token *l_token, Token *r_token)
+        {
+            QuickeningSite *site = instruction.quickening.get();
+            const Instruction *specialized = site->specialized();
+
+            if (specialized && specialized->kernel.func) {
+                if (Token *result = tryKernel(*specialized, l_token, r_token)) {
+                    return result;
+                }
+            }
+
+            return applyOperation(specialized ? *specialized : instruction, l_token, r_token, site);
+        }
+
+        // Apply the operator through its operation, recording the operand
+        // types in `site` if the operator is being quickened:
+        Token *applyOperation(const Instruction &instruction, Token *l_token, Token *r_token, QuickeningSite *site = nullptr)
+        {
+            data.op = instruction.op;
+
+            /* * * * * Resolve operands Values and References: * * * * */
+
+            if (r_token->m_type & REF) {
+                data.right.reset(static_cast<RefToken *>(r_token));
+                r_token = data.right->resolve(&data.scope, &m_config.scope);
+            } else if (r_token->m_type == VAR) {
+                auto key = PackToken(static_cast<TokenTyped<QString> *>(r_token)->m_val);
+                data.right = std::make_unique<RefToken>(key);
+            } else {
+                data.right = std::make_unique<RefToken>();
+            }
+
+            if (l_token->m_type & REF) {
+                data.left.reset(static_cast<RefToken *>(l_token));
+                l_token = data.left->resolve(&data.scope, &m_config.scope);
+            } else if (l_token->m_type == VAR) {
+                auto key = PackToken(static_cast<TokenTyped<QString> *>(l_token)->m_val);
+                data.left = std::make_unique<RefToken>(key);
+            } else {
+                data.left = std::make_unique<RefToken>();
+            }
+
+            if (l_token->m_type == FUNC && instruction.call) {
+                // * * * * * Resolve Function Calls: * * * * * //
+
+                auto *l_func = static_cast<Function *>(l_token);
+
+                // Collect the parameter tuple:
+                Tuple right;
+
+                if (r_token->m_type == TUPLE) {
+                    right = *static_cast<Tuple *>(r_token);
+                } else {
+                    right = Tuple(r_token);
+                }
+
+                delete r_token;
+
+                PackToken _this;
+
+                if (data.left->m_origin->m_type != NONE) {
+                    _this = data.left->m_origin;
+                } else {
+                    _this = data.scope;
+                }
+
+                // Execute the function:
+                PackToken ret = call(_this, l_func, &right);
+                delete l_func;
+
+                if (ret->m_type == TokenType::ERROR) {
+                    exitValue = ret->clone();
+                    return nullptr;
+                }
+
+                return ret->clone();
+            }
+
+            // * * * * * Resolve All Other Operations: * * * * * //
+
+            if (site) {
+                site->record(instruction, data.config, l_token->m_type, r_token->m_type);
+            }
+
+            data.opID = Operation::buildMask(l_token->m_type, r_token->m_type);
+            PackToken l_pack(l_token);
+            PackToken r_pack(r_token);
+
+            // Resolve the operation, unless it was selected at compile time for these types:
+            Token *result = nullptr;
+
+            if (instruction.operation && l_token->m_type == instruction.left && r_token->m_type == instruction.right) {
+                result = instruction.operation->exec(l_pack, r_pack, &data).release();
+
+                if (result->m_type == TokenType::REJECT) {
+                    delete result;
+                    result = nullptr;
+                }
+            }
+
+            if (!result) {
+                result = exec_operation(l_pack, r_pack, &data, instruction.entry);
+            }
+
+            if (!result) {
+                log_undefined_operation(data.op, l_pack, r_pack);
+                exitValue = new TokenError("failed to execute op: " + data.op);
+                return nullptr;
+            }
+
+            if (result->m_type == TokenType::ERROR) {
+                exitValue = result;
+                return nullptr;
+            }
+
+            if (result->m_type == TokenType::VAR) {
+                // op returned variable which we can now try to resolve;
+                const auto varName = static_cast<TokenTyped<QString> *>(result)->m_val;
+                return resolveVariable(result, varName);
+            }
+
+            return result;
+        }
+
+        // Call a method fused by fuseMethodCalls() on `receiver`:
+        Token *callMethod(const MethodCallToken &site, Token *receiver, Token *argsToken)
+        {
+            Profiler::Timer timer(data.profiler, Profiler::Operator, MethodCallToken::op());
+
+            if (budget && !budget->step()) {
+                delete resolveReferenceToken(receiver);
+                delete resolveReferenceToken(argsToken);
+                return stop(*budget);
+            }
+
+            Token *value = receiver;
 
-Q_LOGGING_CATEGORY(cparseLog, "cparse")
+            if (receiver->m_type & REF) {
+                value = static_cast<RefToken *>(receiver)->resolve(&data.scope, &m_config.scope);
+            }
+
+            const std::shared_ptr<const Token> method = site.method(value, data.config);
+
+            if (!method) {
+                if (value != receiver) {
+                    delete value;
+                }
+
+                // Fall back to the '.' operation followed by the call:
+                Token *member = apply(instruction("."), receiver, new TokenTyped<QString>(site.name(), STR));
+
+                if (!member) {
+                    delete resolveReferenceToken(argsToken);
+                    return nullptr;
+                }
+
+                return apply(instruction("()"), member, argsToken);
+            }
+
+            if (value != receiver) {
+                delete receiver;
+            }
+
+            PackToken _this(value);
+
+            // Collect the parameter tuple:
+            Token *args = resolveReferenceToken(argsToken, &data.scope, &m_config.scope);
+            Tuple right = args->m_type == TUPLE ? *static_cast<Tuple *>(args) : Tuple(args);
+            delete args;
+
+            // Held until the call returns, as the site may drop it meanwhile:
+            PackToken ret = call(_this, static_cast<const Function *>(method.get()), &right);
+
+            if (ret->m_type == TokenType::ERROR) {
+                exitValue = ret->clone();
+                return nullptr;
+            }
+
+            return ret->clone();
+        }
+
+        EvaluationData data;
+
+        // The value the evaluation returns when it stops:
+        Token *exitValue = nullptr;
+
+        // The limits of the evaluation, if it has any:
+        EvaluationBudget *budget = EvaluationBudget::current();
+
+    private:
+        const Config &m_config;
+        const std::vector<QString> *m_variables;
+        // The answer of the batch variable resolver, once it was asked:
+        std::unique_ptr<TokenMap> m_batch;
+        // The answers of the variable resolver, if the config has a resolver cache:
+        std::map<QString, PackToken> m_resolved;
+    };
+
+    // The budget of an evaluation limited by Config::limits, made current
+    // for the evaluations it contains. Evaluations nested in one that has a
+    // budget already use that one:
+    struct ConfigBudget
+    {
+        explicit ConfigBudget(const Config &config)
+        {
+            if (!config.limits.unlimited() && !EvaluationBudget::current()) {
+                budget.emplace(config.limits);
+                guard.emplace(&*budget);
+            }
+        }
+
+        std::optional<EvaluationBudget> budget;
+        std::optional<EvaluationBudgetGuard> guard;
+    };
+
+    // Pop the operands of the operator `token` from `stack` and apply it.
+    // Returns nullptr if the evaluation has to stop with exitValue:
+    Token *applyOperator(Evaluation &evaluation, EvaluationStack &stack, const Token *token)
+    {
+        if (stack.size() < 2) {
+            qWarning(cparseLog) << "Invalid equation.";
+            return nullptr;
+        }
+
+        Token *r_token = stack.top();
+        stack.pop();
+        Token *l_token = stack.top();
+        stack.pop();
+
+        const QString &op = static_cast<const TokenTyped<QString> *>(token)->m_val;
+
+        if (op == MethodCallToken::op()) {
+            return evaluation.callMethod(*static_cast<const MethodCallToken *>(token), l_token, r_token);
+        }
+
+        return evaluation.apply(evaluation.instruction(op), l_token, r_token);
+    }
+
+    /* * * * * Execution tree nodes, see RpnBuilder::buildTree() * * * * */
+
+    class TreeNode
+    {
+    public:
+        virtual ~TreeNode() = default;
+
+        // Returns nullptr if the evaluation has to stop:
+        virtual Token *eval(Evaluation &evaluation) const = 0;
+
+        // The memory the node and those below it hold:
+        virtual quint64 retainedBytes() const = 0;
+    };
+
+    // A literal, or a name the operation it is given to resolves:
+    class ValueNode : public TreeNode
+    {
+    public:
+        explicit ValueNode(const Token *value) : m_value(value->clone()) { }
+
+        Token *eval(Evaluation &) const override { return m_value->clone(); }
+
+        quint64 retainedBytes() const override { return sizeof(ValueNode) + cparse::retainedBytes(m_value.get()); }
+
+    private:
+        std::unique_ptr<Token> m_value;
+    };
+
+    class VariableNode : public TreeNode
+    {
+    public:
+        explicit VariableNode(const Token *var) : m_var(static_cast<TokenTyped<QString> *>(var->clone())) { }
+
+        Token *eval(Evaluation &evaluation) const override { return evaluation.variable(m_var.get()); }
+
+        quint64 retainedBytes() const override { return sizeof(VariableNode) + cparse::retainedBytes(m_var.get()); }
+
+    private:
+        std::unique_ptr<TokenTyped<QString>> m_var;
+    };
+
+    class OperatorNode : public TreeNode
+    {
+    public:
+        OperatorNode(std::unique_ptr<TreeNode> left, std::unique_ptr<TreeNode> right, Instruction instruction)
+            : m_left(std::move(left)), m_right(std::move(right)), m_instruction(std::move(instruction))
+        {
+        }
+
+        Token *eval(Evaluation &evaluation) const override
+        {
+            Token *left = m_left->eval(evaluation);
+
+            if (!left) {
+                return nullptr;
+            }
+
+            Token *right = m_right->eval(evaluation);
+
+            if (!right) {
+                delete resolveReferenceToken(left);
+                return nullptr;
+            }
+
+            return evaluation.apply(m_instruction, left, right);
+        }
+
+        quint64 retainedBytes() const override
+        {
+            return sizeof(OperatorNode) + m_left->retainedBytes() + m_right->retainedBytes() + instructionBytes(m_instruction);
+        }
+
+    private:
+        std::unique_ptr<TreeNode> m_left;
+        std::unique_ptr<TreeNode> m_right;
+        Instruction m_instruction;
+    };
+
+    class MethodCallNode : public TreeNode
+    {
+    public:
+        MethodCallNode(std::unique_ptr<TreeNode> receiver, std::unique_ptr<TreeNode> args, const MethodCallToken &site)
+            : m_receiver(std::move(receiver)), m_args(std::move(args)), m_site(site)
+        {
+        }
+
+        Token *eval(Evaluation &evaluation) const override
+        {
+            Token *receiver = m_receiver->eval(evaluation);
+
+            if (!receiver) {
+                return nullptr;
+            }
+
+            Token *args = m_args->eval(evaluation);
+
+            if (!args) {
+                delete resolveReferenceToken(receiver);
+                return nullptr;
+            }
+
+            return evaluation.callMethod(m_site, receiver, args);
+        }
+
+        quint64 retainedBytes() const override
+        {
+            return sizeof(MethodCallNode) + m_receiver->retainedBytes() + m_args->retainedBytes() + m_site.retainedBytes();
+        }
+
+    private:
+        std::unique_ptr<TreeNode> m_receiver;
+        std::unique_ptr<TreeNode> m_args;
+        // Shares the method cache of the compiled call site:
+        MethodCallToken m_site;
+    };
+}
+
+// The root node of the tree, the frozen config its
+// operators were resolved from and the variables it reads:
+class cparse::ExecutionTree
+{
+public:
+    ExecutionTree(std::unique_ptr<TreeNode> root, FrozenConfigPtr config, std::vector<QString> variables)
+        : root(std::move(root)), config(std::move(config)), variables(std::move(variables))
+    {
+    }
+
+    const std::unique_ptr<TreeNode> root;
+    const FrozenConfigPtr config;
+    const std::vector<QString> variables;
+};
 
 namespace {
-    using namespace cparse;
+    /* * * * * Register machine, see RpnBuilder::buildProgram() * * * * */
+
+    // Registers are numbered after the RPN stack slot they replace, so an
+    // instruction writes its result to r[dst] and operators read their
+    // register operands from r[dst] and r[dst + 1].
+    enum class OpCode : uint8_t {
+        LoadConst, // r[dst] = a
+        LoadVar, // r[dst] = variable a
+        Apply, // r[dst] = r[dst] op r[dst + 1]
+        CallMethod, // r[dst] = r[dst].method(r[dst + 1])
+
+        // Superinstructions, see superinstructions below:
+        ApplyVarConst, // r[dst] = variable a op b, e.g. `x < 3` or `map.member`
+        ApplyConstVar, // r[dst] = a op variable b
+        ApplyVarVar, // r[dst] = variable a op variable b
+        ApplyConstConst, // r[dst] = a op b
+        ApplyRegConst, // r[dst] = r[dst] op b
+        ApplyRegVar, // r[dst] = r[dst] op variable b
+
+        Copy, // r[dst] = copy of r[src], see CommonSubexpressions
+    };
 
-    [[maybe_unused]] void log_undefined_operation(const QString &op, const PackToken &left, const PackToken &right)
+    const char *opCodeName(OpCode code)
     {
-        qWarning(cparseLog) << "Unexpected rpn operation with operator '" << op
-                            << "' and operands: " << left.str() << " and " << right.str();
+        switch (code) {
+        case OpCode::LoadConst:
+            return "LoadConst";
+        case OpCode::LoadVar:
+            return "LoadVar";
+        case OpCode::Apply:
+            return "Apply";
+        case OpCode::CallMethod:
+            return "CallMethod";
+        case OpCode::ApplyVarConst:
+            return "ApplyVarConst";
+        case OpCode::ApplyConstVar:
+            return "ApplyConstVar";
+        case OpCode::ApplyVarVar:
+            return "ApplyVarVar";
+        case OpCode::ApplyConstConst:
+            return "ApplyConstConst";
+        case OpCode::ApplyRegConst:
+            return "ApplyRegConst";
+        case OpCode::ApplyRegVar:
+            return "ApplyRegVar";
+        case OpCode::Copy:
+            return "Copy";
+        }
+
+        return "";
     }
 
-    bool match_op_id(OpId id, OpId mask)
+    struct MachineInstruction
     {
-        quint64 result = id & mask;
-        auto *val = reinterpret_cast<uint32_t *>(&result);
-        return (val[0] && val[1]);
+        OpCode code;
+        uint32_t dst;
+        // The inline operands, owned by the program:
+        const Token *a = nullptr;
+        const Token *b = nullptr;
+        Instruction instruction{};
+        const MethodCallToken *site = nullptr;
+        uint32_t src = 0;
+    };
+
+    // Sequences of instructions replaced by a single one. The loads are
+    // folded into the operands of the operator that consumes them, so
+    // their values never go through a register. Only adjacent loads are
+    // fused, which keeps the evaluation order of the RPN.
+    struct Superinstruction
+    {
+        std::vector<OpCode> pattern;
+        OpCode fused;
+    };
+
+    const std::vector<Superinstruction> &superinstructions()
+    {
+        static const std::vector<Superinstruction> table = {
+            {{OpCode::LoadVar, OpCode::LoadConst, OpCode::Apply}, OpCode::ApplyVarConst},
+            {{OpCode::LoadConst, OpCode::LoadVar, OpCode::Apply}, OpCode::ApplyConstVar},
+            {{OpCode::LoadVar, OpCode::LoadVar, OpCode::Apply}, OpCode::ApplyVarVar},
+            {{OpCode::LoadConst, OpCode::LoadConst, OpCode::Apply}, OpCode::ApplyConstConst},
+            {{OpCode::LoadConst, OpCode::Apply}, OpCode::ApplyRegConst},
+            {{OpCode::LoadVar, OpCode::Apply}, OpCode::ApplyRegVar},
+        };
+
+        return table;
     }
 
-    Token *exec_operation(const PackToken &left, const PackToken &right, EvaluationData *data, const QString &OP_MASK)
+    bool matches(const std::vector<MachineInstruction> &code, size_t pc, const std::vector<OpCode> &pattern)
     {
-        auto it = data->opMap.find(OP_MASK);
+        if (pc + pattern.size() > code.size()) {
+            return false;
+        }
 
-        if (it == data->opMap.end()) {
-            if (!OP_MASK.isEmpty()) {
-                return exec_operation(left, right, data, {});
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            if (code[pc + i].code != pattern[i]) {
+                return false;
             }
-            return nullptr;
         }
 
-        for (const Operation &operation : it->second) {
-            if (match_op_id(data->opID, operation.getMask())) {
-                auto *execToken = operation.exec(left, right, data).release();
+        return true;
+    }
 
-                if (execToken->m_type == TokenType::REJECT) {
-                    continue;
+    std::vector<MachineInstruction> fuseSuperinstructions(const std::vector<MachineInstruction> &code)
+    {
+        std::vector<MachineInstruction> fused;
+        fused.reserve(code.size());
+
+        for (size_t pc = 0; pc < code.size();) {
+            const Superinstruction *match = nullptr;
+
+            for (const Superinstruction &superinstruction : superinstructions()) {
+                if (matches(code, pc, superinstruction.pattern)) {
+                    match = &superinstruction;
+                    break;
                 }
+            }
 
-                return execToken;
+            if (!match) {
+                fused.push_back(code[pc++]);
+                continue;
             }
+
+            // The operator, with the loaded values as its operands:
+            const size_t loads = match->pattern.size() - 1;
+            MachineInstruction instruction = code[pc + loads];
+            instruction.code = match->fused;
+            instruction.a = loads == 2 ? code[pc].a : nullptr;
+            instruction.b = code[pc + loads - 1].a;
+
+            fused.push_back(instruction);
+            pc += match->pattern.size();
         }
 
-        if (!OP_MASK.isEmpty()) {
-            return exec_operation(left, right, data, {});
+        return fused;
+    }
+
+    // A call is pure if it calls a pure function known at compile time (`callee`
+    // is the token of the function, or nullptr if it is computed), other
+    // operators if all the operations they could resolve to are pure:
+    bool isPureOperator(const QString &op, const Token *callee, const FrozenConfig &config)
+    {
+        if (op == MethodCallToken::op()) {
+            return false;
         }
 
-        return nullptr;
+        if (op == "()") {
+            if (!callee || !(callee->m_type == FUNC || callee->m_type == TokenType(FUNC | REF))) {
+                return false;
+            }
+
+            std::unique_ptr<Token> function(resolveReferenceToken(callee->clone()));
+            return static_cast<const Function *>(function.get())->isPure();
+        }
+
+        const FrozenConfig::OpEntry *entry = config.findOp(op);
+
+        for (const auto *operations : {entry ? entry->operations : nullptr, config.anyOperations()}) {
+            if (!operations) {
+                continue;
+            }
+
+            for (const Operation &operation : *operations) {
+                if (!operation.isPure()) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
     }
+
+    // Finds the subexpressions of an RPN expression that are computed
+    // more than once, so a compiled program can compute them once into
+    // a temporary register and copy it where they are repeated.
+    //
+    // Only pure subexpressions are shared (see isPureOperator()), and
+    // none are as soon as the expression has an impure part, since it
+    // could change what the others read, e.g. `a = a + 1` or a function
+    // modifying a map. The evaluation scope may bind the functions called
+    // to others, so their names are kept to be checked again (see
+    // callees()).
+    class CommonSubexpressions
+    {
+    public:
+        CommonSubexpressions(const std::deque<Token *> &tokens, const FrozenConfig &config, bool enabled = true)
+            : m_nodes(tokens.size()), m_reuses(tokens.size())
+        {
+            if (!enabled) {
+                return;
+            }
+
+            std::map<QString, int> ids;
+            std::vector<size_t> stack;
+
+            auto idOf = [&](const QString &key) { return ids.emplace(key, int(ids.size())).first->second; };
+
+            for (size_t pc = 0; pc < tokens.size(); ++pc) {
+                const Token *token = tokens[pc];
+                Node &node = m_nodes[pc];
+                node.start = pc;
+
+                if (token->m_type != OP) {
+                    node.id = idOf(leafKey(tokens, pc));
+                    stack.push_back(pc);
+                    m_depth = std::max(m_depth, stack.size());
+                    continue;
+                }
+
+                if (stack.size() < 2) {
+                    return;
+                }
+
+                const Node &right = m_nodes[stack.back()];
+                stack.pop_back();
+                const Node &left = m_nodes[stack.back()];
+                const size_t leftEnd = stack.back();
+                stack.back() = pc;
+
+                const QString &op = static_cast<const TokenTyped<QString> *>(token)->m_val;
+                node.start = left.start;
+                node.id = idOf(QString("%1(%2,%3)").arg(op).arg(left.id).arg(right.id));
+                // Argument tuples are only meaningful to the call consuming them:
+                node.candidate = op != "," && op != ":";
+
+                const Token *callee = leftEnd == left.start ? tokens[leftEnd] : nullptr;
+
+                if (!isPureOperator(op, callee, config)) {
+                    return;
+                }
+
+                if (op == "()" && (callee->m_type & REF)) {
+                    m_callees.insert(static_cast<const RefToken *>(callee)->m_key.asString());
+                }
+            }
+
+            std::map<int, int> uses;
+
+            for (const Node &node : m_nodes) {
+                if (node.candidate) {
+                    ++uses[node.id];
+                }
+            }
+
+            // Replay the compilation, so subexpressions only repeated
+            // inside a repeated one are not kept, e.g. `a*b` in
+            // `(a*b+c) / (a*b+c+1)`:
+            std::vector<std::vector<size_t>> repeatedFrom(tokens.size());
+            std::set<int> computed;
+            std::set<int> reused;
+
+            for (size_t pc = 0; pc < tokens.size(); ++pc) {
+                if (m_nodes[pc].candidate && uses[m_nodes[pc].id] > 1) {
+                    // Largest first:
+                    auto &ends = repeatedFrom[m_nodes[pc].start];
+                    ends.insert(ends.begin(), pc);
+                }
+            }
+
+            for (size_t pc = 0; pc < tokens.size(); ++pc) {
+                auto end = std::find_if(repeatedFrom[pc].begin(), repeatedFrom[pc].end(),
+                                        [&](size_t end) { return computed.count(m_nodes[end].id); });
+
+                if (end != repeatedFrom[pc].end()) {
+                    reused.insert(m_nodes[*end].id);
+                    m_reuses[pc] = *end;
+                    pc = *end;
+                } else if (m_nodes[pc].candidate && uses[m_nodes[pc].id] > 1) {
+                    computed.insert(m_nodes[pc].id);
+                }
+            }
+
+            for (Node &node : m_nodes) {
+                node.shared = node.candidate && reused.count(node.id);
+            }
+
+            if (reused.empty()) {
+                m_callees.clear();
+            }
+        }
+
+        // The RPN stack depth of the expression, the temporary
+        // registers are numbered after it:
+        size_t depth() const { return m_depth; }
+
+        // Whether the value of the subexpression ending at `pc` is reused:
+        bool shared(size_t pc) const { return m_nodes[pc].shared; }
+        int id(size_t pc) const { return m_nodes[pc].id; }
+
+        // The end of the repeated subexpression starting at `pc`, whose value
+        // was computed before, or 0:
+        size_t reuse(size_t pc) const { return m_reuses[pc]; }
+
+        // The names of the pure functions called, if any subexpression is
+        // shared. They were bound at compile time:
+        const std::set<QString> &callees() const { return m_callees; }
+
+    private:
+        struct Node
+        {
+            size_t start = 0;
+            // Equal for equal subexpressions:
+            int id = -1;
+            bool candidate = false;
+            bool shared = false;
+        };
+
+        static QString leafKey(const std::deque<Token *> &tokens, size_t pc)
+        {
+            const Token *token = tokens[pc];
+
+            if (token->m_type == VAR) {
+                const QString &name = static_cast<const TokenTyped<QString> *>(token)->m_val;
+                return (isMemberName(tokens, pc) ? "member:" : "var:") + name;
+            }
+
+            if (token->m_type & REF) {
+                return "ref:" + static_cast<const RefToken *>(token)->m_key.str();
+            }
+
+            return QString::number(token->m_type) + ":" + PackToken(token->clone()).str();
+        }
+
+        std::vector<Node> m_nodes;
+        std::vector<size_t> m_reuses;
+        std::set<QString> m_callees;
+        size_t m_depth = 0;
+    };
+    // Folds the parts of an RPN expression that only depend on constants
+    // and known variables, see RpnBuilder::specialize():
+    class PartialEvaluation
+    {
+    public:
+        // Names of the config scope are taken as constants if `folded` is
+        // given, and those folded are added to it:
+        PartialEvaluation(const TokenMap &knownVars, const Config &config, std::vector<QString> *folded)
+            : m_knownVars(knownVars), m_config(config), m_frozen(config.freeze()), m_folded(folded)
+        {
+        }
+
+        // Returns false if `tokens` is not a single expression:
+        bool build(const std::deque<Token *> &tokens)
+        {
+            std::vector<std::unique_ptr<Node>> stack;
+
+            for (size_t pc = 0; pc < tokens.size(); ++pc) {
+                const Token *token = tokens[pc];
+                auto node = std::make_unique<Node>();
+
+                if (token->m_type != OP) {
+                    QString name;
+
+                    if (token->m_type == VAR && !isMemberName(tokens, pc)) {
+                        name = static_cast<const TokenTyped<QString> *>(token)->m_val;
+                    } else if (token->m_type & REF) {
+                        name = static_cast<const RefToken *>(token)->m_key.asString();
+                    }
+
+                    // Known variables are replaced by their values, names from
+                    // the config scope are taken as constants:
+                    if (const PackToken *value = name.isNull() ? nullptr : m_knownVars.find(name)) {
+                        node->token.reset(resolveReferenceToken((*value)->clone()));
+                        node->name = name;
+                        node->known = true;
+                    } else {
+                        node->token.reset(token->clone());
+                        node->known = name.isNull();
+
+                        if (m_folded && (token->m_type & REF) && m_config.scope.find(name)) {
+                            node->configName = name;
+                            node->known = true;
+                        }
+                    }
+
+                    stack.push_back(std::move(node));
+                    continue;
+                }
+
+                if (stack.size() < 2) {
+                    return false;
+                }
+
+                node->token.reset(token->clone());
+                node->right = std::move(stack.back());
+                stack.pop_back();
+                node->left = std::move(stack.back());
+                stack.pop_back();
+
+                const QString &op = static_cast<const TokenTyped<QString> *>(token)->m_val;
+
+                // Assigning needs the name of the variable, so it keeps a reference:
+                if (op == "=" && !node->left->name.isNull()) {
+                    node->left->token = std::make_unique<RefToken>(node->left->name, *m_knownVars.find(node->left->name));
+                }
+
+                const bool pure = isPureOperator(op, node->left->left ? nullptr : node->left->token.get(), *m_frozen);
+                node->known = pure && node->left->known && node->right->known;
+                m_pure = m_pure && pure;
+
+                stack.push_back(std::move(node));
+            }
+
+            if (stack.size() != 1) {
+                return false;
+            }
+
+            m_root = std::move(stack.back());
+            return true;
+        }
+
+        TokenQueue rpn() const
+        {
+            TokenQueue rpn;
+            emit(*m_root, &rpn);
+            return rpn;
+        }
+
+    private:
+        struct Node
+        {
+            std::unique_ptr<Token> token;
+            std::unique_ptr<Node> left;
+            std::unique_ptr<Node> right;
+            // The known variable it was, if any:
+            QString name;
+            // The name of the config scope it was, if any:
+            QString configName;
+            // Whether its value only depends on constants and known variables:
+            bool known = false;
+        };
+
+        static void append(const Node &node, TokenQueue *rpn)
+        {
+            if (node.left) {
+                append(*node.left, rpn);
+                append(*node.right, rpn);
+            }
+
+            rpn->push(node.token->clone());
+        }
+
+        // Like for common subexpressions, nothing is folded in expressions
+        // with impure parts, which could change the known values:
+        void emit(const Node &node, TokenQueue *rpn) const
+        {
+            if (m_pure && node.known && node.left && !isTuple(node)) {
+                if (Token *value = fold(node)) {
+                    addConfigNames(node);
+                    rpn->push(value);
+                    return;
+                }
+            }
+
+            if (node.left) {
+                emit(*node.left, rpn);
+                emit(*node.right, rpn);
+            }
+
+            rpn->push(node.token->clone());
+        }
+
+        // Evaluates `node`, or returns nullptr to leave its errors to run time:
+        Token *fold(const Node &node) const
+        {
+            TokenQueue rpn;
+            append(node, &rpn);
+            Token *value = RpnBuilder::calculate(rpn, m_knownVars, m_config);
+            RpnBuilder::clearRPN(&rpn);
+
+            if (!value) {
+                return nullptr;
+            }
+
+            value = resolveReferenceToken(value);
+
+            if (value->m_type == ERROR || value->m_type == REJECT) {
+                delete value;
+                return nullptr;
+            }
+
+            return value;
+        }
+
+        void addConfigNames(const Node &node) const
+        {
+            if (node.left) {
+                addConfigNames(*node.left);
+                addConfigNames(*node.right);
+            } else if (!node.configName.isNull() && std::find(m_folded->begin(), m_folded->end(), node.configName) == m_folded->end()) {
+                m_folded->push_back(node.configName);
+            }
+        }
+
+        // Argument lists are only meaningful to the call consuming them:
+        static bool isTuple(const Node &node)
+        {
+            const QString &op = static_cast<const TokenTyped<QString> *>(node.token.get())->m_val;
+            return op == "," || op == ":";
+        }
+
+        const TokenMap &m_knownVars;
+        const Config &m_config;
+        FrozenConfigPtr m_frozen;
+        std::vector<QString> *m_folded;
+        std::unique_ptr<Node> m_root;
+        bool m_pure = true;
+    };
 }
 
+// The instructions of a compiled expression, the values they load,
+// the frozen config their operators come from and the variables it reads:
+class cparse::RegisterProgram
+{
+public:
+    std::vector<MachineInstruction> code;
+    std::vector<std::unique_ptr<Token>> constants;
+    std::vector<std::unique_ptr<MethodCallToken>> sites;
+    size_t registers = 0;
+    FrozenConfigPtr config;
+    std::vector<QString> variables;
+
+    // The pure functions the shared subexpressions call, and the program
+    // without them, run when the evaluation binds one of those names to
+    // something else than a pure function:
+    std::vector<QString> callees;
+    RegisterProgramPtr unshared;
+};
+
 void cparse::initialize()
 {
     Config::defaultConfig().registerBuiltInDefinitions(Config::BuiltInDefinition::AllDefinitions);
@@ -95,8 +1724,54 @@ void cparse::cleanStack(std::stack<Token *> st)
     }
 }
 
-/* * * * * Operation class: * * * * */
-
+/* * * * * Operation class: * * * * */
+
+namespace {
+    QString typeName(TokenType type)
+    {
+        switch (type) {
+        case NONE:
+            return "NONE";
+        case OP:
+            return "OP";
+        case UNARY:
+            return "UNARY";
+        case VAR:
+            return "VAR";
+        case ERROR:
+            return "ERROR";
+        case REJECT:
+            return "REJECT";
+        case STR:
+            return "STR";
+        case FUNC:
+            return "FUNC";
+        case NUM:
+            return "NUM";
+        case REAL:
+            return "REAL";
+        case INT:
+            return "INT";
+        case BOOL:
+            return "BOOL";
+        case IT:
+            return "IT";
+        case LIST:
+            return "LIST";
+        case TUPLE:
+            return "TUPLE";
+        case STUPLE:
+            return "STUPLE";
+        case MAP:
+            return "MAP";
+        case ANY_TYPE:
+            return "ANY";
+        default:
+            return "0x" + QString::number(int(type), 16);
+        }
+    }
+}
+
 // Convert a type into an unique mask for bit wise operations:
 uint32_t Operation::mask(TokenType type)
 {
@@ -114,8 +1789,9 @@ OpId Operation::buildMask(TokenType left, TokenType right)
     return (result << 32) | mask(right);
 }
 
-Operation::Operation(const OpSignature &sig, OpFunc func)
-    : m_mask(buildMask(sig.left, sig.right)), m_exec(func)
+Operation::Operation(const OpSignature &sig, OpFunc func, Specializer specializer, int flags)
+    : m_mask(buildMask(sig.left, sig.right)), m_exec(func), m_specializer(specializer), m_flags(flags),
+      m_name((sig.op.isEmpty() ? QString("op") : sig.op) + "(" + typeName(sig.left) + ", " + typeName(sig.right) + ")")
 {
 }
 
@@ -126,9 +1802,34 @@ cparse::OpId Operation::getMask() const
 
 PackToken Operation::exec(const PackToken &left, const PackToken &right, EvaluationData *data) const
 {
+    if (data && data->profiler) {
+        Profiler::Timer timer(data->profiler, Profiler::Operation, m_name);
+        return m_exec(left, right, data);
+    }
+
     return m_exec(left, right, data);
 }
 
+OpKernel Operation::specialize(const QString &op, TokenType left, TokenType right) const
+{
+    return m_specializer ? m_specializer(op, left, right) : OpKernel();
+}
+
+bool Operation::isPure() const
+{
+    return m_flags & Pure;
+}
+
+bool Operation::isTypeMember() const
+{
+    return m_flags & TypeMember;
+}
+
+const QString &Operation::name() const
+{
+    return m_name;
+}
+
 /* * * * * rpnBuilder Class: * * * * */
 
 void RpnBuilder::clearRPN(TokenQueue *rpn)
@@ -142,6 +1843,48 @@ void RpnBuilder::clearRPN(TokenQueue *rpn)
 void RpnBuilder::clear()
 {
     clearRPN(&m_rpn);
+    m_spans.clear();
+    m_brackets.clear();
+}
+
+void RpnBuilder::push(Token *token)
+{
+    m_rpn.push(token);
+
+    if (token->m_type == OP) {
+        m_spans.push_back({-1, -1});
+    } else {
+        m_spans.push_back({m_position, -1});
+    }
+}
+
+SourceSpans RpnBuilder::spans() const
+{
+    SourceSpans spans = m_spans;
+    const std::deque<Token *> &tokens = tokensOf(m_rpn);
+    auto bracket = m_brackets.begin();
+    // The spans of the operands on the stack while evaluating:
+    std::vector<SourceSpan> stack;
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i]->m_type == OP && stack.size() >= 2) {
+            const SourceSpan right = stack.back();
+            stack.pop_back();
+            const SourceSpan left = stack.back();
+            stack.pop_back();
+            spans[i] = {std::min(left.begin, right.begin), std::max(left.end, right.end)};
+        }
+
+        // Brackets closed right after it are part of it, e.g. "(a + b)":
+        for (; bracket != m_brackets.end() && bracket->first == i; ++bracket) {
+            spans[i].begin = std::min(spans[i].begin, bracket->second.begin);
+            spans[i].end = std::max(spans[i].end, bracket->second.end);
+        }
+
+        stack.push_back(spans[i]);
+    }
+
+    return spans;
 }
 
 /**
@@ -163,18 +1906,19 @@ void RpnBuilder::clear()
 void RpnBuilder::handleOpStack(const QString &op)
 {
     QString cur_op;
+    const int precedence = m_config.prec(op);
 
     // If it associates from left to right:
-    if (m_opp.assoc(op) == 0) {
-        while (!m_opStack.empty() && m_opp.prec(op) >= m_opp.prec(m_opStack.top())) {
+    if (m_config.assoc(op) == 0) {
+        while (!m_opStack.empty() && precedence >= m_config.prec(m_opStack.top())) {
             cur_op = normalizeOp(m_opStack.top());
-            m_rpn.push(new TokenTyped<QString>(cur_op, OP));
+            push(new TokenTyped<QString>(cur_op, OP));
             m_opStack.pop();
         }
     } else {
-        while (!m_opStack.empty() && m_opp.prec(op) > m_opp.prec(m_opStack.top())) {
+        while (!m_opStack.empty() && precedence > m_config.prec(m_opStack.top())) {
             cur_op = normalizeOp(m_opStack.top());
-            m_rpn.push(new TokenTyped<QString>(cur_op, OP));
+            push(new TokenTyped<QString>(cur_op, OP));
             m_opStack.pop();
         }
     }
@@ -191,7 +1935,7 @@ void RpnBuilder::handleBinary(const QString &op)
 // Convert left unary operators to binary and handle them:
 void RpnBuilder::handleLeftUnary(const QString &unary_op)
 {
-    this->m_rpn.push(new TokenUnary());
+    push(new TokenUnary());
     // Only put it on the stack and wait to check op precedence:
     m_opStack.push(unary_op);
 }
@@ -202,9 +1946,9 @@ void RpnBuilder::handleRightUnary(const QString &unary_op)
     // Handle OP precedence:
     handleOpStack(unary_op);
     // Add the unary token:
-    this->m_rpn.push(new TokenUnary());
+    push(new TokenUnary());
     // Then add the current op directly into the rpn:
-    m_rpn.push(new TokenTyped<QString>(normalizeOp(unary_op), OP));
+    push(new TokenTyped<QString>(normalizeOp(unary_op), OP));
 }
 
 namespace {
@@ -237,6 +1981,19 @@ namespace {
 
         return list;
     }
+
+    // The bracket constructors are shared by every compiled expression:
+    const CppFunction &listConstructor()
+    {
+        static const CppFunction func = CppFunction(&defaultListConstructor, "list").setBindings(Function::BindArgs);
+        return func;
+    }
+
+    const CppFunction &mapConstructor()
+    {
+        static const CppFunction func = CppFunction(&defaultMapConstructor, "map").setBindings(Function::BindKwargs);
+        return func;
+    }
 }
 
 namespace {
@@ -374,10 +2131,23 @@ namespace {
 // Work as a sub-parser:
 // - Stops at delim or '\0'
 // - Returns the rest of the string as char* rest
-TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const QString &deliminators, int *rest, const Config &config)
+TokenQueue RpnBuilder::toRPN(const QString &exprStr,
+                             const TokenMap &vars,
+                             const QString &deliminators,
+                             int *rest,
+                             const Config &config,
+                             SourceSpans *spans,
+                             CompileStatistics *statistics)
 {
-    RpnBuilder data(config.opPrecedence);
+    const auto started = std::chrono::steady_clock::now();
+    const FrozenConfigPtr frozen = config.freeze();
+    RpnBuilder data(*frozen);
     const QChar *nextChar = nullptr;
+    CompileStatistics measured;
+
+    if (statistics) {
+        data.m_parsing = &measured.parsing;
+    }
 
     const auto *expr = exprStr.constData();
     const auto *exprEnd = expr + exprStr.size();
@@ -394,6 +2164,9 @@ TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const
     // In one pass, ignore whitespace and parse the expression into RPN
     // using Dijkstra's Shunting-yard algorithm.
     while (expr != exprEnd && (data.bracketLevel() || !isDeliminator(*expr, deliminators))) {
+        const size_t pushed = data.m_spans.size();
+        data.m_position = int(expr - exprStr.constData());
+
         if (expr->isDigit()) {
             int base = 10;
 
@@ -442,7 +2215,7 @@ TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const
             const QChar *expr2 = expr;
             QString key = RpnBuilder::parseVariableName(expr, exprEnd, &expr, true, false);
 
-            if ((parser = config.parserMap.find(key))) {
+            if ((parser = frozen->findParser(key))) {
                 // Parse reserved words:
                 if (!parser(expr, exprEnd, &expr, &data)) {
                     data.clear();
@@ -468,7 +2241,7 @@ TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const
                         expr = expr2;
                         key = RpnBuilder::parseVariableName(expr, exprEnd, &expr, false, false);
                         // Check if the word parser applies:
-                        auto *parser = config.parserMap.find(key);
+                        auto *parser = frozen->findParser(key);
 
                         // Evaluate the meaning of this operator in the following order:
                         // 1. Is there a word parser for it?
@@ -569,7 +2342,7 @@ TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const
                 } else {
                     // If it is the list constructor:
                     // Add the list constructor to the rpn:
-                    if (!data.handleToken(new CppFunction(&defaultListConstructor, "list"))) {
+                    if (!data.handleToken(listConstructor().clone())) {
                         return {};
                     }
 
@@ -587,7 +2360,7 @@ TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const
             case '{':
 
                 // Add a map constructor call to the rpn:
-                if (!data.handleToken(new CppFunction(&defaultMapConstructor, "map"))) {
+                if (!data.handleToken(mapConstructor().clone())) {
                     return {};
                 }
 
@@ -624,282 +2397,956 @@ TokenQueue RpnBuilder::toRPN(const QString &exprStr, const TokenMap &vars, const
                     return {};
                 }
 
-                ++expr;
-                break;
+                ++expr;
+                break;
+
+            default: {
+                // Then the token is an operator
+
+                const QChar *start = expr;
+                QString ss;
+                ss += *expr;
+                ++expr;
+
+                while (expr != exprEnd && isPunctuation(*expr) && !isDeliminator(*expr, "+-'\"()[]{}_")) {
+                    ss += *expr;
+                    ++expr;
+                }
+
+                QString op = ss;
+
+                // Check if the word parser applies:
+                auto *parser = frozen->findParser(op);
+
+                // Evaluate the meaning of this operator in the following order:
+                // 1. Is there a word parser for it?
+                // 2. Is it a valid operator?
+                // 3. Is there a character parser for its first character?
+                if (parser) {
+                    // Parse reserved operators:
+
+                    if (!parser(expr, exprEnd, &expr, &data)) {
+                        data.clear();
+                        return {};
+                    }
+                } else if (data.opExists(op)) {
+                    if (!data.handleOp(op)) {
+                        return {};
+                    }
+                } else if ((parser = frozen->findParser(QString(op[0])))) {
+                    expr = start + 1;
+
+                    if (!parser(expr, exprEnd, &expr, &data)) {
+                        data.clear();
+                        return {};
+                    }
+                } else {
+                    qWarning(cparseLog) << "Invalid operator: " + op;
+                    data.clear();
+                    return {};
+                }
+            }
+            }
+        }
+
+        // The operands pushed come from what was just parsed:
+        for (size_t i = pushed; i < data.m_spans.size(); ++i) {
+            if (data.m_spans[i].end == -1) {
+                data.m_spans[i].end = int(expr - exprStr.constData());
+            }
+        }
+
+        // Ignore spaces but stop on delimiter if not inside brackets.
+        while (expr != exprEnd && expr->isSpace() && (data.bracketLevel() || !isDeliminator(*expr, deliminators))) {
+            ++expr;
+        }
+    }
+
+    // Check for syntax errors (excess of operators i.e. 10 + + -1):
+    if (data.lastTokenWasUnary()) {
+        data.clear();
+        qWarning(cparseLog) << "Expected operand after unary operator `" << data.topOp() << "`";
+        return {};
+    }
+
+    // An empty expression left by a custom parser spans all of it:
+    data.m_position = 0;
+    data.processOpStack();
+
+    if (data.m_spans.back().end == -1) {
+        data.m_spans.back().end = int(expr - exprStr.constData());
+    }
+
+    if (spans) {
+        *spans = data.spans();
+    }
+
+    const auto parsed = std::chrono::steady_clock::now();
+    fuseMethodCalls(&data.m_rpn, spans);
+    const auto optimized = std::chrono::steady_clock::now();
+
+    if (rest) {
+        *rest = expr - exprStr.constData();
+    }
+
+    // Counting the tokens and names is not part of the compilation timed:
+    if (statistics) {
+        *statistics = RpnBuilder::statistics(data.m_rpn, config);
+        statistics->lexing = parsed - started - measured.parsing;
+        statistics->parsing = measured.parsing;
+        statistics->optimizing = optimized - parsed;
+    }
+
+    return data.rpn();
+}
+
+size_t RpnBuilder::stackDepth(TokenQueue rpn)
+{
+    size_t depth = 0;
+    size_t maxDepth = 0;
+
+    // Operators (including fused method calls) replace their two
+    // operands by their result, everything else is pushed:
+    while (!rpn.empty()) {
+        if (rpn.front()->m_type == OP) {
+            depth = depth > 0 ? depth - 1 : 0;
+        } else {
+            maxDepth = std::max(maxDepth, ++depth);
+        }
+
+        rpn.pop();
+    }
+
+    return maxDepth;
+}
+
+Token *RpnBuilder::calculate(const TokenQueue &rpn,
+                             const TokenMap &scope,
+                             const Config &config,
+                             EvaluationContext *context,
+                             const std::vector<QString> *subexpressions)
+{
+    if (rpn.empty()) {
+        return nullptr;
+    }
+
+    EvaluationContext localContext;
+
+    if (!context || context->inUse()) {
+        localContext.stack().reserve(stackDepth(rpn));
+        context = &localContext;
+    }
+
+    const FrozenConfigPtr frozen = config.freeze();
+    const std::deque<Token *> &program = tokensOf(rpn);
+    // Only needed by the batch variable resolver:
+    const std::vector<QString> variables = config.batchVariableResolver ? variablesOf(program) : std::vector<QString>();
+    ConfigBudget budget(config);
+    Evaluation evaluation(scope, config, *frozen, &variables);
+
+    // Evaluate the expression in RPN form.
+    EvaluationStack &stack = context->stack();
+
+    // Leave the context empty for the next evaluation, whatever way this one ends:
+    struct ContextGuard
+    {
+        EvaluationContext *context;
+
+        ContextGuard(EvaluationContext *context) : context(context) { context->m_inUse = true; }
+        ~ContextGuard()
+        {
+            context->m_stack.clear();
+            context->m_inUse = false;
+        }
+    } guard(context);
+
+    Profiler *profiler = subexpressions ? config.profiler.get() : nullptr;
+    static const QString unnamed;
+
+    for (size_t pc = 0; pc < program.size(); ++pc) {
+        const Token *token = program[pc];
+        const QString &name = profiler ? (*subexpressions)[pc] : unnamed;
+        Profiler::Timer timer(name.isEmpty() ? nullptr : profiler, Profiler::Subexpression, name);
+
+        // Operator:
+        if (token->m_type == OP) {
+            Token *result = applyOperator(evaluation, stack, token);
+
+            if (!result) {
+                return evaluation.exitValue;
+            }
+
+            stack.push(result);
+            continue;
+        }
+
+        if (token->m_type == VAR && !isMemberName(program, pc)) {
+            Token *value = evaluation.variable(static_cast<const TokenTyped<QString> *>(token));
+
+            if (!value) {
+                return evaluation.exitValue;
+            }
+
+            stack.push(value);
+        } else {
+            stack.push(token->clone());
+        }
+    }
+
+    if (stack.empty()) {
+        return nullptr;
+    }
+
+    Token *result = stack.top();
+    stack.pop();
+    return result;
+}
+
+/* * * * * class PendingValue * * * * */
+
+bool PendingValue::ready() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_ready;
+}
+
+PackToken PendingValue::value() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_value;
+}
+
+void PendingValue::set(const PackToken &value)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_ready) {
+        m_value = value;
+        m_ready = true;
+    }
+}
+
+/* * * * * class AsyncEvaluation * * * * */
+
+// The RPN interpreter of RpnBuilder::calculate(), with its program counter
+// and stack kept between the calls to resume(). It owns a copy of the
+// program and a layer over the config, so the calculator may change or go
+// away meanwhile:
+struct AsyncEvaluation::State
+{
+    State(const TokenQueue &rpn, const TokenMap &scope, const Config &config, AsyncVariableResolver resolver)
+        : program(copyOf(tokensOf(rpn))), layer(config.overlay()), frozen(config.freeze()),
+          variables(config.batchVariableResolver ? variablesOf(program) : std::vector<QString>()),
+          evaluation(scope, layer, *frozen, &variables), resolver(std::move(resolver))
+    {
+        stack.reserve(RpnBuilder::stackDepth(rpn));
+
+        // Its own budget, as it runs outside of the evaluation starting it:
+        if (!config.limits.unlimited()) {
+            budget.emplace(config.limits);
+        }
+
+        evaluation.budget = budget ? &*budget : nullptr;
+    }
+
+    ~State()
+    {
+        stack.clear();
+
+        for (Token *token : program) {
+            delete token;
+        }
+    }
+
+    State(const State &) = delete;
+    State &operator=(const State &) = delete;
+
+    static std::deque<Token *> copyOf(const std::deque<Token *> &tokens)
+    {
+        std::deque<Token *> copy;
+
+        for (const Token *token : tokens) {
+            copy.push_back(token->clone());
+        }
+
+        return copy;
+    }
+
+    // Evaluate from pc on. Returns false if a value is not ready:
+    bool run()
+    {
+        for (; pc < program.size(); ++pc) {
+            const Token *token = program[pc];
+            Token *value = nullptr;
+
+            if (token->m_type == OP) {
+                value = applyOperator(evaluation, stack, token);
+            } else if (token->m_type == VAR && !isMemberName(program, pc)) {
+                const auto *var = static_cast<const TokenTyped<QString> *>(token);
+                PackToken known;
+
+                if (evaluation.inScopes(var->m_val) || !resolver) {
+                    value = evaluation.variable(var);
+                } else if (evaluation.resolveBatched(var->m_val, &known) || evaluation.findCached(var->m_val, &known)) {
+                    value = evaluation.bindResolved(var->clone(), var->m_val, known);
+                } else if (!(pending = lookUp(var->m_val))) {
+                    value = evaluation.variable(var);
+                } else if (!pending->ready()) {
+                    return false;
+                } else {
+                    value = bindPending();
+                }
+            } else {
+                value = token->clone();
+            }
+
+            if (!value) {
+                return finish(evaluation.exitValue);
+            }
+
+            stack.push(value);
+        }
+
+        Token *value = nullptr;
+
+        if (!stack.empty()) {
+            value = stack.top();
+            stack.pop();
+        }
+
+        return finish(value);
+    }
+
+    // Ask the resolver about `name`, once per evaluation:
+    PendingValuePtr lookUp(const QString &name)
+    {
+        if (auto it = lookups.find(name); it != lookups.end()) {
+            return it->second.value;
+        }
+
+        const VariableResolverCache *cache = layer.resolverCache.get();
+        const quint64 generation = cache ? cache->generation() : 0;
+        PendingValuePtr value = resolver(name);
+
+        lookups.emplace(name, Lookup{value, generation});
+        return value;
+    }
+
+    Token *bindPending()
+    {
+        const auto *var = static_cast<const TokenTyped<QString> *>(program[pc]);
+        const PackToken value = pending->value();
+
+        evaluation.remember(var->m_val, value, lookups.at(var->m_val).generation);
+        pending.reset();
+
+        return evaluation.bindResolved(var->clone(), var->m_val, value);
+    }
+
+    bool finish(Token *value)
+    {
+        result = value ? PackToken(resolveReferenceToken(value)) : PackToken::Error("no value in result");
+        finished = true;
+        stack.clear();
+        return true;
+    }
+
+    struct Lookup
+    {
+        PendingValuePtr value;
+        // Of the resolver cache, when the resolver was asked:
+        quint64 generation;
+    };
+
+    const std::deque<Token *> program;
+    const Config layer;
+    const FrozenConfigPtr frozen;
+    const std::vector<QString> variables;
+    Evaluation evaluation;
+    AsyncVariableResolver resolver;
+    std::map<QString, Lookup> lookups;
+    EvaluationStack stack;
+    std::optional<EvaluationBudget> budget;
+
+    size_t pc = 0;
+    // The value of the variable at pc, while suspended:
+    PendingValuePtr pending;
+    bool finished = false;
+    PackToken result;
+};
+
+AsyncEvaluation::AsyncEvaluation(const TokenQueue &rpn, const TokenMap &scope, const Config &config, AsyncVariableResolver resolver)
+    : m_state(std::make_unique<State>(rpn, scope, config, std::move(resolver)))
+{
+}
+
+AsyncEvaluation::AsyncEvaluation(AsyncEvaluation &&) noexcept = default;
+AsyncEvaluation &AsyncEvaluation::operator=(AsyncEvaluation &&) noexcept = default;
+AsyncEvaluation::~AsyncEvaluation() = default;
+
+bool AsyncEvaluation::resume()
+{
+    State &state = *m_state;
+
+    if (state.finished) {
+        return true;
+    }
+
+    EvaluationBudgetGuard guard(state.evaluation.budget);
+
+    if (state.pending) {
+        if (!state.pending->ready()) {
+            return false;
+        }
+
+        Token *value = state.bindPending();
+
+        if (!value) {
+            return state.finish(state.evaluation.exitValue);
+        }
+
+        state.stack.push(value);
+        ++state.pc;
+    }
+
+    return state.run();
+}
+
+bool AsyncEvaluation::finished() const
+{
+    return m_state->finished;
+}
+
+PendingValuePtr AsyncEvaluation::pending() const
+{
+    return m_state->pending;
+}
 
-            default: {
-                // Then the token is an operator
+PackToken AsyncEvaluation::result() const
+{
+    return m_state->result;
+}
 
-                const QChar *start = expr;
-                QString ss;
-                ss += *expr;
-                ++expr;
+Dependencies RpnBuilder::dependencies(const TokenQueue &rpn, const Config &config)
+{
+    // What a value on the RPN stack refers to. Variables are only recorded
+    // once their use is known, since assigning them does not read them:
+    struct Reference
+    {
+        QString variable;
+        QString path;
+    };
 
-                while (expr != exprEnd && isPunctuation(*expr) && !isDeliminator(*expr, "+-'\"()[]{}_")) {
-                    ss += *expr;
-                    ++expr;
-                }
+    const std::deque<Token *> &tokens = tokensOf(rpn);
+    Dependencies dependencies;
+    std::vector<Reference> stack;
 
-                QString op = ss;
+    // Member paths are recorded where their '.' chain ends, i.e. where
+    // something else than a '.' uses them:
+    auto read = [&](const Reference &reference) {
+        if (!reference.variable.isNull()) {
+            dependencies.variables.insert(reference.variable);
 
-                // Check if the word parser applies:
-                auto *parser = config.parserMap.find(op);
+            if (reference.path != reference.variable) {
+                dependencies.members.insert(reference.path);
+            }
+        }
+    };
 
-                // Evaluate the meaning of this operator in the following order:
-                // 1. Is there a word parser for it?
-                // 2. Is it a valid operator?
-                // 3. Is there a character parser for its first character?
-                if (parser) {
-                    // Parse reserved operators:
+    for (size_t pc = 0; pc < tokens.size(); ++pc) {
+        const Token *token = tokens[pc];
 
-                    if (!parser(expr, exprEnd, &expr, &data)) {
-                        data.clear();
-                        return {};
-                    }
-                } else if (data.opExists(op)) {
-                    if (!data.handleOp(op)) {
-                        return {};
-                    }
-                } else if ((parser = config.parserMap.find(QString(op[0])))) {
-                    expr = start + 1;
+        if (token->m_type != OP) {
+            Reference reference;
 
-                    if (!parser(expr, exprEnd, &expr, &data)) {
-                        data.clear();
-                        return {};
-                    }
-                } else {
-                    qWarning(cparseLog) << "Invalid operator: " + op;
-                    data.clear();
-                    return {};
+            if (token->m_type == VAR && !isMemberName(tokens, pc)) {
+                reference.variable = static_cast<const TokenTyped<QString> *>(token)->m_val;
+            } else if (token->m_type & REF) {
+                const QString key = static_cast<const RefToken *>(token)->m_key.asString();
+                const PackToken *value = config.scope.find(key);
+
+                if (!value) {
+                    reference.variable = key;
+                } else if ((*value)->m_type == FUNC) {
+                    dependencies.functions.insert(key);
                 }
+            } else if (token->m_type == VAR || token->m_type == STR) {
+                // A member name, if it is the right operand of a '.':
+                reference.path = static_cast<const TokenTyped<QString> *>(token)->m_val;
             }
+
+            if (reference.path.isNull()) {
+                reference.path = reference.variable;
             }
+
+            stack.push_back(reference);
+            continue;
         }
 
-        // Ignore spaces but stop on delimiter if not inside brackets.
-        while (expr != exprEnd && expr->isSpace() && (data.bracketLevel() || !isDeliminator(*expr, deliminators))) {
-            ++expr;
+        // Malformed expressions refer to what was seen so far:
+        if (stack.size() < 2) {
+            break;
+        }
+
+        const Reference right = stack.back();
+        stack.pop_back();
+        const Reference left = stack.back();
+        Reference &result = stack.back();
+        result = {};
+
+        const QString &op = static_cast<const TokenTyped<QString> *>(token)->m_val;
+        read(right);
+
+        if (op == "." && !left.variable.isNull() && !right.path.isNull() && right.variable.isNull()) {
+            // The variable is read or assigned along with the member:
+            result = {left.variable, left.path + "." + right.path};
+        } else if (op == "=" && !left.variable.isNull()) {
+            dependencies.assigned.insert(left.path);
+
+            if (left.path != left.variable) {
+                read(left);
+            }
+        } else {
+            read(left);
         }
     }
 
-    // Check for syntax errors (excess of operators i.e. 10 + + -1):
-    if (data.lastTokenWasUnary()) {
-        data.clear();
-        qWarning(cparseLog) << "Expected operand after unary operator `" << data.topOp() << "`";
-        return {};
+    for (const Reference &reference : stack) {
+        read(reference);
     }
 
-    data.processOpStack();
+    return dependencies;
+}
 
-    if (rest) {
-        *rest = expr - exprStr.constData();
+CompileStatistics RpnBuilder::statistics(const TokenQueue &rpn, const Config &config)
+{
+    CompileStatistics statistics;
+    const Dependencies names = dependencies(rpn, config);
+    statistics.rpnLength = rpn.size();
+    statistics.stackDepth = stackDepth(rpn);
+    statistics.variables = names.variables.size();
+    statistics.functions = names.functions.size();
+
+    for (const Token *token : tokensOf(rpn)) {
+        const TokenType type = token->m_type;
+        statistics.bytes += cparse::retainedBytes(token);
+
+        // Values written in the source, as opposed to the operators,
+        // names, and the placeholders of unary operators:
+        if (type != OP && type != VAR && type != UNARY && !(type & REF)) {
+            ++statistics.literals;
+        }
     }
 
-    return data.rpn();
+    return statistics;
 }
 
-Token *RpnBuilder::calculate(const TokenQueue &rpn, const TokenMap &scope, const Config &config)
+TokenQueue RpnBuilder::specialize(const TokenQueue &rpn, const TokenMap &knownVars, const Config &config, std::vector<QString> *folded)
 {
-    if (rpn.empty()) {
-        return nullptr;
+    PartialEvaluation evaluation(knownVars, config, folded);
+
+    if (!evaluation.build(tokensOf(rpn))) {
+        TokenQueue copy;
+
+        for (const Token *token : tokensOf(rpn)) {
+            copy.push(token->clone());
+        }
+
+        return copy;
     }
 
-    EvaluationData data(rpn, scope, config.opMap, config.variableResolver);
+    return evaluation.rpn();
+}
+
+ExecutionTreePtr RpnBuilder::buildTree(const TokenQueue &rpn, const Config &config)
+{
+    FrozenConfigPtr frozen = config.freeze();
+    const std::deque<Token *> &program = tokensOf(rpn);
+    std::vector<std::unique_ptr<TreeNode>> stack;
 
-    // Evaluate the expression in RPN form.
-    std::stack<Token *> evaluation;
+    for (size_t pc = 0; pc < program.size(); ++pc) {
+        const Token *token = program[pc];
 
-    auto tryResolveVariable = [&](Token *base, const QString &key) -> bool {
-        if (scope.find(key)) {
-            evaluation.push(base);
-            return true;
-        }
+        if (token->m_type != OP) {
+            if (token->m_type == VAR && !isMemberName(program, pc)) {
+                stack.push_back(std::make_unique<VariableNode>(token));
+            } else {
+                stack.push_back(std::make_unique<ValueNode>(token));
+            }
 
-        if (config.scope.find(key)) {
-            evaluation.push(base);
-            return true;
+            continue;
         }
 
-        if (!config.variableResolver) {
-            evaluation.push(base);
-            return true;
+        // Leave malformed expressions to the interpreter:
+        if (stack.size() < 2) {
+            return nullptr;
         }
 
-        auto resolverValue = config.variableResolver(key);
+        std::unique_ptr<TreeNode> right = std::move(stack.back());
+        stack.pop_back();
+        std::unique_ptr<TreeNode> left = std::move(stack.back());
+        stack.pop_back();
 
-        if (resolverValue->m_type == TokenType::ERROR) {
-            cleanStack(evaluation);
-            return false;
-        }
+        const QString &op = static_cast<const TokenTyped<QString> *>(token)->m_val;
 
-        if (resolverValue->m_type == TokenType::REJECT) {
-            evaluation.push(base);
+        if (op == MethodCallToken::op()) {
+            stack.push_back(std::make_unique<MethodCallNode>(std::move(left), std::move(right), *static_cast<const MethodCallToken *>(token)));
         } else {
-            evaluation.push(new RefToken(PackToken(key), resolverValue->clone()));
-            delete base;
+            Instruction instruction{op, frozen->findOp(op), op == "()"};
+            stack.push_back(std::make_unique<OperatorNode>(std::move(left), std::move(right), std::move(instruction)));
         }
-        return true;
-    };
+    }
 
-    while (!data.rpn.empty()) {
-        Token *base = data.rpn.front()->clone();
-        data.rpn.pop();
+    if (stack.size() != 1) {
+        return nullptr;
+    }
 
-        // Operator:
-        if (base->m_type == OP) {
-            data.op = static_cast<TokenTyped<QString> *>(base)->m_val;
-            delete base;
+    return std::make_shared<const ExecutionTree>(std::move(stack.back()), std::move(frozen), variablesOf(program));
+}
 
-            /* * * * * Resolve operands Values and References: * * * * */
+Token *RpnBuilder::calculate(const ExecutionTree &tree, const TokenMap &scope, const Config &config)
+{
+    ConfigBudget budget(config);
+    Evaluation evaluation(scope, config, *tree.config, &tree.variables);
+    Token *result = tree.root->eval(evaluation);
+    return result ? result : evaluation.exitValue;
+}
 
-            if (evaluation.size() < 2) {
-                cleanStack(evaluation);
-                qWarning(cparseLog) << "Invalid equation.";
-                return nullptr;
+namespace {
+    RegisterProgramPtr buildRegisterProgram(const TokenQueue &rpn, const Config &config, const VariableTypes &variableTypes, bool share)
+    {
+        auto program = std::make_shared<RegisterProgram>();
+        program->config = config.freeze();
+        program->variables = variablesOf(tokensOf(rpn));
+
+        const std::deque<Token *> &tokens = tokensOf(rpn);
+        std::vector<MachineInstruction> code;
+        uint32_t depth = 0;
+
+        // The type of the value in each register, or ANY_TYPE if it is only known at run time:
+        std::vector<TokenType> types;
+
+        auto declaredType = [&](const QString &name) {
+            auto it = variableTypes.find(name);
+            return it != variableTypes.end() ? it->second : ANY_TYPE;
+        };
+
+        // The temporary register holding each shared subexpression and its type:
+        const CommonSubexpressions subexpressions(tokens, *program->config, share);
+        std::map<int, std::pair<uint32_t, TokenType>> temporaries;
+
+        for (size_t pc = 0; pc < tokens.size(); ++pc) {
+            const Token *token = tokens[pc];
+
+            if (const size_t end = subexpressions.reuse(pc)) {
+                const auto &[temporary, type] = temporaries.at(subexpressions.id(end));
+                MachineInstruction copy{OpCode::Copy, depth++};
+                copy.src = temporary;
+                code.push_back(std::move(copy));
+                program->registers = std::max<size_t>(program->registers, depth);
+                types.push_back(type);
+                pc = end;
+                continue;
             }
 
-            Token *r_token = evaluation.top();
-            evaluation.pop();
-            Token *l_token = evaluation.top();
-            evaluation.pop();
+            if (token->m_type != OP) {
+                program->constants.emplace_back(token->clone());
 
-            if (r_token->m_type & REF) {
-                data.right.reset(static_cast<RefToken *>(r_token));
-                r_token = data.right->resolve(&data.scope, &config.scope);
-            } else if (r_token->m_type == VAR) {
-                auto key = PackToken(static_cast<TokenTyped<QString> *>(r_token)->m_val);
-                data.right = std::make_unique<RefToken>(key);
-            } else {
-                data.right = std::make_unique<RefToken>();
+                const bool variable = token->m_type == VAR && !isMemberName(tokens, pc);
+                code.push_back({variable ? OpCode::LoadVar : OpCode::LoadConst, depth++, program->constants.back().get()});
+                program->registers = std::max<size_t>(program->registers, depth);
+
+                if (variable) {
+                    types.push_back(declaredType(static_cast<const TokenTyped<QString> *>(token)->m_val));
+                } else if (token->m_type & REF) {
+                    // Compile time variables are looked up again when evaluating:
+                    types.push_back(declaredType(static_cast<const RefToken *>(token)->m_key.asString()));
+                } else {
+                    types.push_back(token->m_type);
+                }
+
+                continue;
             }
 
-            if (l_token->m_type & REF) {
-                data.left.reset(static_cast<RefToken *>(l_token));
-                l_token = data.left->resolve(&data.scope, &config.scope);
-            } else if (l_token->m_type == VAR) {
-                auto key = PackToken(static_cast<TokenTyped<QString> *>(l_token)->m_val);
-                data.left = std::make_unique<RefToken>(key);
-            } else {
-                data.left = std::make_unique<RefToken>();
+            // Leave malformed expressions to the interpreter:
+            if (depth < 2) {
+                return nullptr;
             }
 
-            if (l_token->m_type == FUNC && data.op == "()") {
-                // * * * * * Resolve Function Calls: * * * * * //
+            --depth;
 
-                auto *l_func = static_cast<Function *>(l_token);
+            const QString &op = static_cast<const TokenTyped<QString> *>(token)->m_val;
+            MachineInstruction instruction{OpCode::Apply, depth - 1};
 
-                // Collect the parameter tuple:
-                Tuple right;
+            const TokenType right = types.back();
+            types.pop_back();
+            const TokenType left = types.back();
+            types.back() = ANY_TYPE;
 
-                if (r_token->m_type == TUPLE) {
-                    right = *static_cast<Tuple *>(r_token);
-                } else {
-                    right = Tuple(r_token);
+            if (op == MethodCallToken::op()) {
+                program->sites.emplace_back(static_cast<MethodCallToken *>(token->clone()));
+                instruction.code = OpCode::CallMethod;
+                instruction.site = program->sites.back().get();
+            } else {
+                instruction.instruction = {op, program->config->findOp(op), op == "()"};
+
+                if (left != ANY_TYPE && right != ANY_TYPE && !(left == FUNC && instruction.instruction.call)) {
+                    types.back() = specializeInstruction(&instruction.instruction, *program->config, left, right);
                 }
 
-                delete r_token;
+                // Operators left to run time dispatch adapt to the types they see:
+                if (!instruction.instruction.operation && !instruction.instruction.call) {
+                    instruction.instruction.quickening = std::make_shared<QuickeningSite>();
+                }
+            }
 
-                PackToken _this;
+            code.push_back(std::move(instruction));
 
-                if (data.left->m_origin->m_type != NONE) {
-                    _this = data.left->m_origin;
-                } else {
-                    _this = data.scope;
-                }
+            if (subexpressions.shared(pc)) {
+                const uint32_t temporary = uint32_t(subexpressions.depth() + temporaries.size());
+                temporaries.emplace(subexpressions.id(pc), std::make_pair(temporary, types.back()));
 
-                // Execute the function:
-                PackToken ret = Function::call(_this, l_func, &right, data.scope);
+                MachineInstruction save{OpCode::Copy, temporary};
+                save.src = depth - 1;
+                code.push_back(std::move(save));
+                program->registers = std::max<size_t>(program->registers, temporary + 1);
+            }
+        }
 
-                if (ret->m_type == TokenType::ERROR) {
-                    cleanStack(evaluation);
-                    delete l_func;
-                    return ret->clone();
-                }
+        if (depth != 1) {
+            return nullptr;
+        }
 
-                delete l_func;
-                evaluation.push(ret->clone());
-            } else {
-                // * * * * * Resolve All Other Operations: * * * * * //
+        program->code = fuseSuperinstructions(code);
 
-                data.opID = Operation::buildMask(l_token->m_type, r_token->m_type);
-                PackToken l_pack(l_token);
-                PackToken r_pack(r_token);
+        if (!subexpressions.callees().empty()) {
+            program->callees.assign(subexpressions.callees().begin(), subexpressions.callees().end());
+            program->unshared = buildRegisterProgram(rpn, config, variableTypes, false);
+        }
 
-                // Resolve the operation:
-                Token *result = exec_operation(l_pack, r_pack, &data, data.op);
+        return program;
+    }
+}
 
-                if (result) {
-                    if (result->m_type == TokenType::ERROR) {
-                        cleanStack(evaluation);
-                        return result;
-                    }
+RegisterProgramPtr RpnBuilder::buildProgram(const TokenQueue &rpn, const Config &config, const VariableTypes &variableTypes)
+{
+    return buildRegisterProgram(rpn, config, variableTypes, true);
+}
 
-                    if (result->m_type == TokenType::VAR) {
-                        // op returned variable which we can now try to resolve;
-                        const auto varName = static_cast<TokenTyped<QString> *>(result)->m_val;
+Token *RpnBuilder::calculate(const RegisterProgram &program, const TokenMap &scope, const Config &config, EvaluationContext *context)
+{
+    EvaluationContext localContext;
 
-                        if (!tryResolveVariable(result, varName)) {
-                            return new TokenError("failed to resolve variable: " + varName);
-                        }
-                        continue;
-                    }
+    if (!context || context->inUse()) {
+        context = &localContext;
+    }
 
-                    evaluation.push(result);
-                } else {
-                    cleanStack(evaluation);
-                    log_undefined_operation(data.op, l_pack, r_pack);
-                    return new TokenError("failed to execute op: " + data.op);
-                }
+    ConfigBudget budget(config);
+    Evaluation evaluation(scope, config, *program.config, &program.variables);
+
+    if (program.unshared && !evaluation.callsPure(program.callees)) {
+        return calculate(*program.unshared, scope, config, context);
+    }
+
+    // Registers only grow, so a reused context does not allocate them again:
+    std::vector<Token *> &r = context->m_registers;
+
+    if (r.size() < program.registers) {
+        r.resize(program.registers, nullptr);
+    }
+
+    // Free the values left in the registers, whatever way the evaluation ends:
+    struct RegisterGuard
+    {
+        EvaluationContext *context;
+
+        RegisterGuard(EvaluationContext *context) : context(context) { context->m_inUse = true; }
+        ~RegisterGuard()
+        {
+            for (Token *&token : context->m_registers) {
+                delete token;
+                token = nullptr;
             }
-        } else if (base->m_type == VAR) {
-            PackToken *value = nullptr;
-            QString key = static_cast<TokenTyped<QString> *>(base)->m_val;
 
-            // if the next thing in evaluation is a '.' op do not resolve this yet
-            // . is either a map name, in which case we do not need to resolve the variable
-            // probably because it is already a map token type, or it a external variable name
-            // like env.ENV_VAR, in which case we do not want to resolve the right hand side of this in the
-            // wrong context
+            context->m_inUse = false;
+        }
+    } guard(context);
+
+    auto take = [&](uint32_t index) {
+        Token *token = r[index];
+        r[index] = nullptr;
+        return token;
+    };
 
-            if (!data.rpn.empty() && data.rpn.front()->m_type == TokenType::OP) {
-                auto op = static_cast<TokenTyped<QString> *>(data.rpn.front())->m_val;
+    auto variable = [&](const Token *var) { return evaluation.variable(static_cast<const TokenTyped<QString> *>(var)); };
 
-                if (op == ".") {
-                    evaluation.push(base);
-                    continue;
-                }
+    // Apply an operator to operands that are not in registers:
+    auto applyTo = [&](const MachineInstruction &instruction, Token *left, Token *right) -> Token * {
+        if (!left || !right) {
+            delete left;
+            delete right;
+            return nullptr;
+        }
+
+        return evaluation.apply(instruction.instruction, left, right);
+    };
+
+    for (const MachineInstruction &instruction : program.code) {
+        Token *result = nullptr;
+
+        switch (instruction.code) {
+        case OpCode::LoadConst:
+            result = instruction.a->clone();
+            break;
+        case OpCode::LoadVar:
+            result = variable(instruction.a);
+            break;
+        case OpCode::Apply: {
+            Token *left = take(instruction.dst);
+            result = evaluation.apply(instruction.instruction, left, take(instruction.dst + 1));
+            break;
+        }
+        case OpCode::CallMethod: {
+            Token *receiver = take(instruction.dst);
+            result = evaluation.callMethod(*instruction.site, receiver, take(instruction.dst + 1));
+            break;
+        }
+        case OpCode::ApplyVarConst: {
+            Token *left = variable(instruction.a);
+            result = applyTo(instruction, left, left ? instruction.b->clone() : nullptr);
+            break;
+        }
+        case OpCode::ApplyConstVar: {
+            Token *right = variable(instruction.b);
+            result = applyTo(instruction, instruction.a->clone(), right);
+            break;
+        }
+        case OpCode::ApplyVarVar: {
+            Token *left = variable(instruction.a);
+            result = applyTo(instruction, left, left ? variable(instruction.b) : nullptr);
+            break;
+        }
+        case OpCode::ApplyConstConst:
+            result = evaluation.apply(instruction.instruction, instruction.a->clone(), instruction.b->clone());
+            break;
+        case OpCode::ApplyRegConst: {
+            Token *left = take(instruction.dst);
+            result = evaluation.apply(instruction.instruction, left, instruction.b->clone());
+            break;
+        }
+        case OpCode::ApplyRegVar: {
+            Token *right = variable(instruction.b);
+            result = applyTo(instruction, take(instruction.dst), right);
+            break;
+        }
+        case OpCode::Copy:
+            result = r[instruction.src]->clone();
+            break;
+        }
+
+        if (!result) {
+            return evaluation.exitValue;
+        }
+
+        r[instruction.dst] = result;
+    }
+
+    return take(0);
+}
+
+quint64 RpnBuilder::retainedBytes(const ExecutionTree &tree)
+{
+    return sizeof(ExecutionTree) + tree.root->retainedBytes() + namesBytes(tree.variables);
+}
+
+quint64 RpnBuilder::retainedBytes(const RegisterProgram &program)
+{
+    quint64 bytes = sizeof(RegisterProgram) + program.code.capacity() * sizeof(MachineInstruction);
+
+    for (const MachineInstruction &instruction : program.code) {
+        bytes += instructionBytes(instruction.instruction);
+    }
+
+    bytes += program.constants.capacity() * sizeof(std::unique_ptr<Token>);
+
+    for (const std::unique_ptr<Token> &constant : program.constants) {
+        bytes += cparse::retainedBytes(constant.get());
+    }
+
+    bytes += program.sites.capacity() * sizeof(std::unique_ptr<MethodCallToken>);
+
+    for (const std::unique_ptr<MethodCallToken> &site : program.sites) {
+        bytes += sizeof(MethodCallToken) + site->retainedBytes();
+    }
+
+    // The registers each context evaluating the program grows to:
+    bytes += program.registers * sizeof(Token *);
+    bytes += namesBytes(program.variables) + namesBytes(program.callees);
+
+    if (program.unshared) {
+        bytes += retainedBytes(*program.unshared);
+    }
+
+    return bytes;
+}
+
+QString RpnBuilder::str(const RegisterProgram &program)
+{
+    auto operand = [](const Token *token) {
+        return token->m_type == VAR ? static_cast<const TokenTyped<QString> *>(token)->m_val
+                                    : PackToken(resolveReferenceToken(token->clone())).str();
+    };
+
+    QStringList lines;
+
+    for (const MachineInstruction &instruction : program.code) {
+        QString line = QString("r%1 = %2").arg(instruction.dst).arg(opCodeName(instruction.code));
+
+        if (instruction.code == OpCode::Copy) {
+            line += QString(" r%1").arg(instruction.src);
+        } else if (instruction.site) {
+            line += " " + instruction.site->name();
+        } else if (!instruction.instruction.op.isEmpty()) {
+            line += " " + instruction.instruction.op;
+        }
+
+        for (const Token *token : {instruction.a, instruction.b}) {
+            if (token) {
+                line += " " + operand(token);
             }
+        }
 
-            value = data.scope.find(key);
+        if (!instruction.instruction.kernel.name.isEmpty()) {
+            line += " [" + instruction.instruction.kernel.name + "]";
+        }
 
-            if (value) {
-                Token *copy = (*value)->clone();
-                evaluation.push(new RefToken(PackToken(key), copy));
-                delete base;
-            } else {
-                if (!tryResolveVariable(base, key)) {
-                    return new TokenError("failed to resolve variable: " + key);
-                }
+        if (const QuickeningSite *site = instruction.instruction.quickening.get()) {
+            if (const Instruction *specialized = site->specialized()) {
+                line += " (quickened" + (specialized->kernel.name.isEmpty() ? QString() : ": " + specialized->kernel.name) + ")";
+            } else if (site->megamorphic()) {
+                line += " (megamorphic)";
             }
-        } else {
-            evaluation.push(base);
         }
+
+        lines.append(line);
     }
 
-    return evaluation.empty() ? nullptr : evaluation.top();
+    return lines.join("; ");
 }
 
 void RpnBuilder::processOpStack()
 {
+    StageTimer timer(m_parsing);
+
     while (!m_opStack.empty()) {
         QString cur_op = normalizeOp(m_opStack.top());
-        m_rpn.push(new TokenTyped<QString>(cur_op, OP));
+        push(new TokenTyped<QString>(cur_op, OP));
         m_opStack.pop();
     }
 
     // In case one of the custom parsers left an empty expression:
     if (m_rpn.empty()) {
-        m_rpn.push(new TokenNone());
+        push(new TokenNone());
     }
 }
 
@@ -940,14 +3387,16 @@ const cparse::TokenQueue &RpnBuilder::rpn() const
 
 bool RpnBuilder::opExists(const QString &op) const
 {
-    return m_opp.exists(op);
+    return m_config.opExists(op);
 }
 
 bool RpnBuilder::handleOp(const QString &op)
 {
+    StageTimer timer(m_parsing);
+
     // If it's a left unary operator:
     if (this->m_lastTokenWasOp) {
-        if (m_opp.exists("L" + op)) {
+        if (m_config.opExists("L" + op)) {
             handleLeftUnary("L" + op);
             this->m_lastTokenWasUnary = true;
             this->m_lastTokenWasOp = op[0].unicode();
@@ -958,7 +3407,7 @@ bool RpnBuilder::handleOp(const QString &op)
         }
 
         // If its a right unary operator:
-    } else if (m_opp.exists("R" + op)) {
+    } else if (m_config.opExists("R" + op)) {
         handleRightUnary("R" + op);
 
         // Set it to false, since we have already added
@@ -968,7 +3417,7 @@ bool RpnBuilder::handleOp(const QString &op)
 
         // If it is a binary operator:
     } else {
-        if (m_opp.exists(op)) {
+        if (m_config.opExists(op)) {
             handleBinary(op);
         } else {
             clearRPN(&(m_rpn));
@@ -985,13 +3434,15 @@ bool RpnBuilder::handleOp(const QString &op)
 
 bool RpnBuilder::handleToken(Token *token)
 {
+    StageTimer timer(m_parsing);
+
     if (!m_lastTokenWasOp) {
         qWarning(cparseLog) << "Expected an operator or bracket but got " << PackToken::str(token);
         delete token;
         return false;
     }
 
-    m_rpn.push(token);
+    push(token);
     m_lastTokenWasOp = false;
     m_lastTokenWasUnary = false;
     return true;
@@ -999,7 +3450,10 @@ bool RpnBuilder::handleToken(Token *token)
 
 bool RpnBuilder::openBracket(const QString &bracket)
 {
+    StageTimer timer(m_parsing);
+
     m_opStack.push(bracket);
+    m_bracketStarts.push(m_position);
     m_lastTokenWasOp = bracket[0].unicode();
     m_lastTokenWasUnary = false;
     ++m_bracketLevel;
@@ -1008,15 +3462,17 @@ bool RpnBuilder::openBracket(const QString &bracket)
 
 bool RpnBuilder::closeBracket(const QString &bracket)
 {
+    StageTimer timer(m_parsing);
+
     if (char(m_lastTokenWasOp) == bracket[0]) {
-        m_rpn.push(new Tuple());
+        push(new Tuple());
     }
 
     QString cur_op;
 
     while (!m_opStack.empty() && m_opStack.top() != bracket) {
         cur_op = normalizeOp(m_opStack.top());
-        m_rpn.push(new TokenTyped<QString>(cur_op, OP));
+        push(new TokenTyped<QString>(cur_op, OP));
         m_opStack.pop();
     }
 
@@ -1027,6 +3483,8 @@ bool RpnBuilder::closeBracket(const QString &bracket)
     }
 
     m_opStack.pop();
+    m_brackets.emplace_back(m_rpn.size() - 1, SourceSpan{m_bracketStarts.top(), m_position + 1});
+    m_bracketStarts.pop();
     m_lastTokenWasOp = false;
     m_lastTokenWasUnary = false;
     --m_bracketLevel;
@@ -1085,6 +3543,7 @@ void cparse::OpPrecedenceMap::add(const QString &op, int precedence)
     }
 
     m_prMap[op] = precedence;
+    m_revision = nextConfigRevision();
 }
 
 void cparse::OpPrecedenceMap::addUnary(const QString &op, int precedence)
@@ -1133,11 +3592,15 @@ bool cparse::OpPrecedenceMap::exists(const QString &op) const
     return m_prMap.count(op);
 }
 
-EvaluationData::EvaluationData(TokenQueue rpn,
-                               const TokenMap &scope,
-                               const OpMap &opMap,
+quint64 cparse::OpPrecedenceMap::revision() const
+{
+    return m_revision;
+}
+
+EvaluationData::EvaluationData(const TokenMap &scope,
+                               const FrozenConfig &config,
                                const std::function<PackToken(const QString &)> &func)
-    : rpn(std::move(rpn)), scope(scope), opMap(opMap), variableResolver(func)
+    : scope(scope), config(config), opMap(config.opMap()), variableResolver(func)
 {
 }
 
@@ -1146,9 +3609,36 @@ cparse::OpSignature::OpSignature(const TokenType L, const QString &op, const Tok
 {
 }
 
-void cparse::OpMap::add(const OpSignature &sig, Operation::OpFunc func)
+void cparse::OpMap::add(const OpSignature &sig, Operation::OpFunc func, Operation::Specializer specializer, int flags)
+{
+    (*this)[sig.op].push_back(Operation(sig, func, specializer, flags));
+    m_revision = nextConfigRevision();
+}
+
+bool cparse::OpMap::remove(const QString &op)
+{
+    if (!this->erase(op)) {
+        return false;
+    }
+
+    m_revision = nextConfigRevision();
+    return true;
+}
+
+const std::vector<Operation> *cparse::OpMap::find(const QString &op) const
+{
+    auto it = Map::find(op);
+    return it != this->end() ? &it->second : nullptr;
+}
+
+const OpMap::Map &cparse::OpMap::map() const
+{
+    return *this;
+}
+
+quint64 cparse::OpMap::revision() const
 {
-    (*this)[sig.op].push_back(Operation(sig, func));
+    return m_revision;
 }
 
 QString cparse::OpMap::str() const
@@ -0,0 +1,229 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#include <QObject>
+#include <QtTest>
+
+#include "cparse/cparse.h"
+#include "cparse/calculator.h"
+#include "cparse/evaluationcontext.h"
+#include "cparse/evaluationscheduler.h"
+
+// Count every heap allocation made by this process:
+namespace {
+    std::atomic<quint64> allocationCount{0};
+}
+
+void *operator new(std::size_t size)
+{
+    ++allocationCount;
+
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+using namespace cparse;
+
+class CParseBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    CParseBenchmark();
+
+private slots:
+
+    void numeric_expression();
+    void function_calls();
+    void method_calls();
+
+    // The same expressions on the execution tree backend:
+    void numeric_expression_tree();
+    void function_calls_tree();
+    void method_calls_tree();
+
+    // And on the register machine:
+    void numeric_expression_registers();
+    void function_calls_registers();
+    void method_calls_registers();
+
+    // With the variable types declared:
+    void numeric_expression_typed();
+
+    // Tasks evaluated per second by the scheduler, across thread counts:
+    void scheduler_throughput();
+
+private:
+    void numericExpression(Calculator::Backend backend);
+    void functionCalls(Calculator::Backend backend);
+    void methodCalls(Calculator::Backend backend);
+
+    void run(const QString &expr, const TokenMap &vars, Calculator::Backend backend, const VariableTypes &types = {});
+};
+
+CParseBenchmark::CParseBenchmark()
+{
+    cparse::initialize();
+}
+
+void CParseBenchmark::run(const QString &expr, const TokenMap &vars, Calculator::Backend backend, const VariableTypes &types)
+{
+    const int evaluations = 1000;
+
+    Calculator calc;
+    calc.setBackend(backend);
+    calc.setVariableTypes(types);
+    QVERIFY(calc.compile(expr, vars));
+
+    EvaluationContext context;
+    QVERIFY(!calc.evaluate(vars, context).isError());
+
+    const quint64 before = allocationCount;
+
+    for (int i = 0; i < evaluations; ++i) {
+        calc.evaluate(vars, context);
+    }
+
+    qInfo().noquote() << expr << ":" << double(allocationCount - before) / evaluations
+                      << "allocations per evaluation, stack depth" << calc.stackDepth();
+
+    TokenMemoryMeter meter;
+    calc.evaluate(vars, context);
+    qInfo().noquote() << expr << ":" << meter.peakBytes() << "token bytes at peak per evaluation,"
+                      << calc.retainedBytes() << "bytes retained," << calc.backendBytes() << "by the backend";
+
+    QBENCHMARK {
+        calc.evaluate(vars, context);
+    }
+}
+
+void CParseBenchmark::numericExpression(Calculator::Backend backend)
+{
+    TokenMap vars;
+    vars["a"] = 2;
+    vars["b"] = 3.5;
+    run("(a + 1) * b - a / 4 + (b * b - a)", vars, backend);
+}
+
+void CParseBenchmark::functionCalls(Calculator::Backend backend)
+{
+    TokenMap vars;
+    vars["x"] = 0.5;
+    run("sin(x) + cos(x) * max(x, 1) + abs(-x)", vars, backend);
+}
+
+void CParseBenchmark::methodCalls(Calculator::Backend backend)
+{
+    TokenMap vars;
+    vars["s"] = "Hello, World";
+    run("s.lower().split(',').len() + s.len()", vars, backend);
+}
+
+void CParseBenchmark::numeric_expression()
+{
+    numericExpression(Calculator::RpnBackend);
+}
+
+void CParseBenchmark::function_calls()
+{
+    functionCalls(Calculator::RpnBackend);
+}
+
+void CParseBenchmark::method_calls()
+{
+    methodCalls(Calculator::RpnBackend);
+}
+
+void CParseBenchmark::numeric_expression_tree()
+{
+    numericExpression(Calculator::ExecutionTreeBackend);
+}
+
+void CParseBenchmark::function_calls_tree()
+{
+    functionCalls(Calculator::ExecutionTreeBackend);
+}
+
+void CParseBenchmark::method_calls_tree()
+{
+    methodCalls(Calculator::ExecutionTreeBackend);
+}
+
+void CParseBenchmark::numeric_expression_registers()
+{
+    numericExpression(Calculator::RegisterBackend);
+}
+
+void CParseBenchmark::function_calls_registers()
+{
+    functionCalls(Calculator::RegisterBackend);
+}
+
+void CParseBenchmark::method_calls_registers()
+{
+    methodCalls(Calculator::RegisterBackend);
+}
+
+void CParseBenchmark::numeric_expression_typed()
+{
+    TokenMap vars;
+    vars["a"] = 2;
+    vars["b"] = 3.5;
+    run("(a + 1) * b - a / 4 + (b * b - a)", vars, Calculator::RegisterBackend, {{"a", INT}, {"b", REAL}});
+}
+
+void CParseBenchmark::scheduler_throughput()
+{
+    TokenMap inputs;
+    inputs["x"] = 1;
+
+    // Chains of cheap expressions, each task making the next one ready:
+    const size_t chains = 64;
+    const size_t length = 32;
+    Calculator first("x + 1");
+    Calculator next("v + 1");
+    std::vector<EvaluationScheduler::Task> tasks;
+
+    for (size_t step = 0; step < length; ++step) {
+        for (size_t chain = 0; chain < chains; ++chain) {
+            if (step == 0) {
+                tasks.push_back({"v", &first, {}});
+            } else {
+                tasks.push_back({"v", &next, {tasks.size() - chains}});
+            }
+        }
+    }
+
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        EvaluationScheduler scheduler(threads);
+        const int batches = 50;
+        QCOMPARE(scheduler.run(tasks, inputs).back().asInt(), int(length + 1));
+
+        const auto started = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < batches; ++i) {
+            scheduler.run(tasks, inputs);
+        }
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        qInfo().noquote() << threads << "threads:" << qint64(batches * tasks.size() / elapsed.count()) << "tasks per second";
+    }
+}
+
+QTEST_MAIN(CParseBenchmark)
+#include "cparse-benchmark.moc"
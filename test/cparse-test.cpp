@@ -1,15 +1,24 @@
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <new>
 #include <string>
+#include <thread>
 
 #include <QObject>
 #include <QtTest>
 #include <utility>
 
 #include "cparse/cparse.h"
+#include "cparse/asyncevaluation.h"
 #include "cparse/rpnbuilder.h"
 #include "cparse/calculator.h"
 #include "cparse/reftoken.h"
+#include "cparse/frozenconfig.h"
+#include "cparse/evaluationcontext.h"
+#include "cparse/evaluationscheduler.h"
+#include "cparse/tokenhelpers.h"
 
 class CParseTest : public QObject
 {
@@ -59,12 +68,61 @@ private slots:
     void resource_management();
     void adhoc_operator_parser();
     void exception_management();
+    void frozen_config();
+    void config_overlays();
+    void shared_function_definitions();
+    void function_binding_plans();
+    void method_call_fusion();
+    void evaluation_stack_depth();
+    void allocation_free_evaluation();
+    void execution_tree_backend();
+    void register_backend();
+    void static_type_inference();
+    void quickening();
+    void integer_arithmetic();
+    void common_subexpressions();
+    void partial_evaluation();
+    void dependency_analysis();
+    void expression_graph();
+    void parallel_evaluation();
+    void batch_variable_resolver();
+    void async_evaluation();
+    void resolver_cache();
+    void evaluation_limits();
+    void profiling();
+    void source_spans();
+    void compile_statistics();
+    void allocation_accounting();
 };
 
 using namespace cparse;
 
 TokenMap vars, emap, tmap, key3;
 
+// Count the heap allocations made by the tests:
+std::atomic<quint64> allocationCount{0};
+
+void *operator new(std::size_t size)
+{
+    ++allocationCount;
+
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
 #define REQUIRE(statement) \
     do { \
         if (!QTest::qVerify(static_cast<bool>(statement), #statement, "", __FILE__, __LINE__)) \
@@ -931,12 +989,12 @@ struct myCalc : public Calculator
 
 PackToken op1(const PackToken &left, const PackToken &right, EvaluationData *data)
 {
-    return Config::defaultConfig().opMap["%"][0].exec(left, right, data);
+    return Config::defaultConfig().opMap.find("%")->at(0).exec(left, right, data);
 }
 
 PackToken op2(const PackToken &left, const PackToken &right, EvaluationData *data)
 {
-    return Config::defaultConfig().opMap[","][0].exec(left, right, data);
+    return Config::defaultConfig().opMap.find(",")->at(0).exec(left, right, data);
 }
 
 PackToken op3(const PackToken &left, const PackToken &right, EvaluationData *)
@@ -1331,6 +1389,1664 @@ void CParseTest::exception_management()
     REQUIRE(!ecalc2.compile("map(['hello']]"));
 }
 
+//TEST_CASE("Frozen config")
+void CParseTest::frozen_config()
+{
+    Config config = basicConfig();
+    FrozenConfigPtr frozen = config.freeze();
+    const Config original = config;
+
+    // The snapshot is shared until a table changes:
+    REQUIRE(config.freeze() == frozen);
+    REQUIRE(Config(config).freeze() == frozen);
+
+    REQUIRE(frozen->opExists("+"));
+    REQUIRE(frozen->opExists("L-"));
+    REQUIRE_FALSE(frozen->opExists("=="));
+    REQUIRE(frozen->prec("*") < frozen->prec("+"));
+    REQUIRE(frozen->assoc("="));
+    REQUIRE(frozen->findOp("+")->operations == nullptr);
+    REQUIRE(frozen->anyOperations() != nullptr);
+
+    config.opPrecedence.add("==", 9);
+    config.opMap.add({ANY_TYPE, "==", ANY_TYPE}, [](const PackToken &l, const PackToken &r, EvaluationData *) {
+        return PackToken(l == r);
+    });
+
+    FrozenConfigPtr refrozen = config.freeze();
+    REQUIRE(refrozen != frozen);
+    REQUIRE(refrozen->opExists("=="));
+    REQUIRE(refrozen->findOp("==")->operations->size() == 1);
+
+    // The old snapshot is immutable:
+    REQUIRE_FALSE(frozen->opExists("=="));
+
+    // Removing operations is a change too:
+    Config removed = config;
+    REQUIRE(removed.opMap.remove("=="));
+    REQUIRE_FALSE(removed.opMap.remove("=="));
+    REQUIRE(removed.opMap.find("==") == nullptr);
+    REQUIRE(config.opMap.find("==")->size() == 1);
+    REQUIRE(removed.freeze() != refrozen);
+    REQUIRE(removed.freeze()->findOp("==")->operations == nullptr);
+
+    // Replacing a table with an older one is a change too:
+    Config restored = config;
+    restored.opPrecedence = original.opPrecedence;
+    REQUIRE(restored.freeze() != refrozen);
+    REQUIRE_FALSE(restored.freeze()->findOp("==")->hasPrecedence);
+    REQUIRE(restored.freeze()->findOp("==")->operations->size() == 1);
+
+    Calculator c1(config);
+    REQUIRE(c1.evaluate("2 * 3 == 6").asBool());
+    REQUIRE(c1.evaluate("1 + 2 * 3").asInt() == 7);
+
+    const FrozenConfigPtr defaults = Config::defaultConfig().freeze();
+    REQUIRE(defaults->findParser("true") != nullptr);
+    REQUIRE(defaults->findParser(QChar(':')) != nullptr);
+    REQUIRE(defaults->findParser("no_such_word") == nullptr);
+}
+
+//TEST_CASE("Layered config overlays")
+void CParseTest::config_overlays()
+{
+    Config base;
+    base.registerBuiltInDefinitions(Config::AllDefinitions);
+    base.scope["base_rate"] = 10;
+
+    Config tenant = base.overlay();
+    REQUIRE(tenant.base() == base.freeze());
+
+    // Tenant deltas:
+    tenant.scope["tenant_rate"] = 2;
+    tenant.opPrecedence.add("<>", 9);
+    tenant.opMap.add({NUM, "<>", NUM}, [](const PackToken &l, const PackToken &r, EvaluationData *) {
+        return PackToken(l.asReal() != r.asReal());
+    });
+    tenant.opMap.add({STR, "+", STR}, [](const PackToken &l, const PackToken &r, EvaluationData *) {
+        return PackToken(l.asString() + " " + r.asString());
+    });
+
+    FrozenConfigPtr frozen = tenant.freeze();
+    REQUIRE(frozen->base() == base.freeze());
+    REQUIRE(frozen->opExists("<>"));
+    REQUIRE(frozen->opExists("=="));
+    REQUIRE(frozen->prec("+") == base.freeze()->prec("+"));
+    REQUIRE(frozen->prec("()") == base.freeze()->prec("()"));
+    REQUIRE(frozen->findOp("+")->operations->size() == 1);
+    REQUIRE(frozen->anyOperations() == base.freeze()->anyOperations());
+    REQUIRE(frozen->findParser("true") != nullptr);
+    REQUIRE(frozen->findParser(QChar(':')) != nullptr);
+
+    Calculator c1(tenant);
+    REQUIRE(c1.evaluate("base_rate * tenant_rate").asInt() == 20);
+    REQUIRE(c1.evaluate("3 <> 4 && true").asBool());
+    REQUIRE(c1.evaluate("'a' + 'b'").asString() == "a b");
+    REQUIRE(c1.evaluate("'a' + 1").asString() == "a1");
+    REQUIRE(c1.evaluate("max(1, 5)").asInt() == 5);
+    REQUIRE(c1.evaluate("{'a': 1}.a").asInt() == 1);
+
+    // Later changes to the base scope are visible to its overlays:
+    base.scope["base_rate"] = 100;
+    REQUIRE(c1.evaluate("base_rate").asInt() == 100);
+
+    // The base does not see any of the tenant's changes:
+    Calculator c2(base);
+    REQUIRE(c2.evaluate("tenant_rate")->m_type == VAR);
+    REQUIRE(c2.evaluate("3 <> 4").isError());
+    REQUIRE(c2.evaluate("'a' + 'b'").asString() == "ab");
+
+    // Overlays can be stacked:
+    Config user = tenant.overlay();
+    user.scope["tenant_rate"] = 3;
+    Calculator c3(user);
+    REQUIRE(c3.evaluate("base_rate * tenant_rate").asInt() == 300);
+    REQUIRE(c3.evaluate("'a' + 'b'").asString() == "a b");
+    REQUIRE(c1.evaluate("tenant_rate").asInt() == 2);
+}
+
+//TEST_CASE("Functions share their definition")
+void CParseTest::shared_function_definitions()
+{
+    struct CopyCounter
+    {
+        int *copies;
+
+        CopyCounter(int *copies) : copies(copies) { }
+        CopyCounter(const CopyCounter &other) : copies(other.copies) { ++*copies; }
+
+        PackToken operator()(const TokenMap &scope) const { return scope["x"].asInt() * 2; }
+    };
+
+    int copies = 0;
+    CppFunction twice(std::function<PackToken(const TokenMap &)>(CopyCounter(&copies)), {"x"}, "twice");
+    const int copiesAfterSetup = copies;
+
+    std::unique_ptr<Token> clone(twice.clone());
+    auto *cloned = static_cast<CppFunction *>(clone.get());
+    REQUIRE(&cloned->args() == &twice.args());
+    REQUIRE(cloned->name() == "twice");
+
+    Config config = basicConfig();
+    config.scope["twice"] = twice;
+    Calculator c1(config);
+
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(c1.evaluate("twice(3) + twice(4)").asInt() == 14);
+    }
+
+    REQUIRE(Calculator::calculate("twice(5)", config.scope).asInt() == 10);
+    REQUIRE(copies == copiesAfterSetup);
+}
+
+// A function subclass leaving its binding plan to Function:
+class WeightedSum : public Function
+{
+public:
+    const QString name() const override { return "weighted_sum"; }
+    const FunctionArgs &args() const override
+    {
+        static const FunctionArgs params = {"a", "b"};
+        return params;
+    }
+    PackToken exec(const TokenMap &scope) const override
+    {
+        return scope["a"].asInt() * 10 + scope["b"].asInt() + int(scope["args"].asList().list().size());
+    }
+    Token *clone() const override { return new WeightedSum(*this); }
+};
+
+PackToken describe_bindings(const TokenMap &scope)
+{
+    QString str = scope["a"].str() + " " + scope["b"].str();
+
+    for (const char *name : {"this", "args", "kwargs"}) {
+        str += scope.map().count(name) ? " +" : " -";
+        str += name;
+    }
+
+    return str;
+}
+
+//TEST_CASE("Function binding plans")
+void CParseTest::function_binding_plans()
+{
+    CppFunction describe(&describe_bindings, {"a", "b"}, "describe");
+
+    REQUIRE(describe.bindingPlan().params == std::vector<QString>({"a", "b"}));
+    REQUIRE(describe.bindingPlan().slotOf("b") == 1);
+    REQUIRE(describe.bindingPlan().slotOf("c") == -1);
+    REQUIRE(describe.bindingPlan().bindings == Function::BindAll);
+
+    CppFunction plain = describe;
+    plain.setBindings(Function::BindNone);
+    REQUIRE(describe.bindingPlan().bindings == Function::BindAll);
+
+    Config config;
+    config.registerBuiltInDefinitions(Config::AllDefinitions);
+    config.scope["describe"] = describe;
+    config.scope["plain"] = plain;
+    Calculator c1(config);
+
+    // Built-in variables are only set for functions that declare them:
+    REQUIRE(c1.evaluate("describe(1, 2, 3)").asString() == "1 2 +this +args +kwargs");
+    REQUIRE(c1.evaluate("plain(1, 2, 3)").asString() == "1 2 -this -args -kwargs");
+    REQUIRE(c1.evaluate("plain(1)").asString() == "1 none -this -args -kwargs");
+    REQUIRE(c1.evaluate("plain(1, b: 5, c: 6)").asString() == "1 5 -this -args -kwargs");
+    REQUIRE(c1.evaluate("plain(b: 5, a: 3)").asString() == "3 5 -this -args -kwargs");
+    REQUIRE(c1.evaluate("plain(a: 5, 3)").isError());
+
+    TokenMap vars;
+    REQUIRE(c1.evaluate("describe(1, a: 7, c: 8)", vars).asString() == "1 none +this +args +kwargs");
+    REQUIRE(vars["kwargs"]["a"].asInt() == 7);
+    REQUIRE(vars["kwargs"]["c"].asInt() == 8);
+    REQUIRE(vars["args"].asList().list().empty());
+
+    // Subclasses get a plan built from their arguments:
+    WeightedSum sum;
+    REQUIRE(sum.bindingPlan().params == std::vector<QString>({"a", "b"}));
+    REQUIRE(sum.bindingPlan().bindings == Function::BindAll);
+    REQUIRE(&sum.bindingPlan() == &sum.bindingPlan());
+
+    vars["sum"] = sum;
+    REQUIRE(c1.evaluate("sum(1, 2, 3, 4)", vars).asInt() == 14);
+}
+
+PackToken default_answer(const TokenMap &)
+{
+    return 42;
+}
+
+int dots = 0;
+
+// Counts the uses of '.' on strings, and leaves them to the built-in one:
+PackToken counting_dot(const PackToken &, const PackToken &, EvaluationData *)
+{
+    ++dots;
+    return PackToken::Reject();
+}
+
+//TEST_CASE("Method call fusion")
+void CParseTest::method_call_fusion()
+{
+    TokenMap scope;
+    scope["x"] = "abcd";
+
+    Calculator c1;
+    REQUIRE(c1.compile("'abc'.len() + x.len()", scope));
+    REQUIRE(c1.str().count(".()") == 2);
+    REQUIRE_FALSE(c1.str().contains("len"));
+
+    // Variables are fused too, and bound when evaluated:
+    Calculator c2;
+    REQUIRE(c2.compile("unknown.len()"));
+    REQUIRE(c2.str().count(".()") == 1);
+    REQUIRE(c2.compile("x.len()"));
+    TokenMap late;
+    late["x"] = "abcd";
+    REQUIRE(c2.evaluate(late).asInt() == 4);
+    TokenList items;
+    items.push(1);
+    items.push(2);
+    late["x"] = items;
+    REQUIRE(c2.evaluate(late).asInt() == 2);
+    REQUIRE(c1.evaluate(scope).asInt() == 7);
+
+    // The same call site with another receiver type:
+    TokenList list;
+    list.push(1);
+    list.push(2);
+    scope["x"] = list;
+    REQUIRE(c1.evaluate(scope).asInt() == 5);
+
+    TokenMap map;
+    map["a"] = 1;
+    scope["x"] = map;
+    REQUIRE(c1.evaluate(scope).asInt() == 4);
+
+    // Functions stored in maps are still resolved per map:
+    map["answer"] = CppFunction(&default_answer, "answer");
+    REQUIRE(Calculator::calculate("x.answer() + x.len()", scope).asInt() == 44);
+
+    scope["x"] = 10;
+    REQUIRE(c1.evaluate(scope).isError());
+
+    REQUIRE(Calculator::calculate("'A,B'.lower().split(',').join('-')").asString() == "a-b");
+    REQUIRE(Calculator::calculate("[1, 2].push(3).len()").asInt() == 3);
+    REQUIRE(Calculator::calculate("'abc'.len", vars).str() == "[function: len]");
+
+    // Methods added to the type registry later are found:
+    Calculator c3;
+    REQUIRE(c3.compile("'abc'.answer()"));
+    REQUIRE(c3.str().count(".()") == 1);
+    REQUIRE(c3.evaluate().isError());
+
+    ObjectTypeRegistry::typeMap(STR)["answer"] = CppFunction(&default_answer, "answer");
+    REQUIRE(c3.evaluate().asInt() == 42);
+    ObjectTypeRegistry::typeMap(STR).erase("answer");
+    REQUIRE(c3.evaluate().isError());
+
+    // And methods replaced there too:
+    REQUIRE(c3.compile("'abc'.len()"));
+    REQUIRE(c3.evaluate().asInt() == 3);
+
+    const PackToken len = ObjectTypeRegistry::constTypeMap(STR)["len"];
+    ObjectTypeRegistry::typeMap(STR)["len"] = CppFunction(&default_answer, "len");
+    REQUIRE(c3.evaluate().asInt() == 42);
+    ObjectTypeRegistry::typeMap(STR)["len"] = len;
+    REQUIRE(c3.evaluate().asInt() == 3);
+
+    // A custom '.' operation runs once per call:
+    Config config;
+    config.opMap.add({STR, ".", STR}, &counting_dot);
+    config.registerBuiltInDefinitions(Config::AllDefinitions);
+    dots = 0;
+
+    Calculator c4(config);
+    REQUIRE(c4.compile("'abc'.len()"));
+    REQUIRE(c4.str().count(".()") == 1);
+
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(c4.evaluate().asInt() == 3);
+    }
+
+    REQUIRE(dots == 3);
+
+    // Copies share the call sites, which concurrent evaluations update
+    // while the registry changes. Each has its own scope, which calls
+    // bind their arguments in:
+    Calculator shared;
+    REQUIRE(shared.compile("'abc'.len() + [1, 2].len() + 'de'.upper().len()"));
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&wrong, copy = shared] {
+            for (int i = 0; i < 200; ++i) {
+                wrong += copy.evaluate(TokenMap()).asInt() != 7;
+            }
+        });
+    }
+
+    for (int i = 0; i < 200; ++i) {
+        ObjectTypeRegistry::typeMap(STR);
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(wrong == 0);
+}
+
+//TEST_CASE("Evaluation stack depth")
+void CParseTest::evaluation_stack_depth()
+{
+    REQUIRE(Calculator("1 + 2 * 3").stackDepth() == 3);
+    REQUIRE(Calculator("(1 + 2) * 3").stackDepth() == 2);
+    REQUIRE(Calculator("1 + 2 + 3 + 4").stackDepth() == 2);
+    REQUIRE(Calculator("max(1, 2 * 3)").stackDepth() == 4);
+
+    TokenMap scope;
+    scope["s"] = "abc";
+    Calculator c1("s.len() + s.upper().len()", scope);
+    REQUIRE(c1.stackDepth() == 3);
+
+    EvaluationContext context;
+    REQUIRE(c1.evaluate(scope, context).asInt() == 6);
+    REQUIRE(context.stack().empty());
+    REQUIRE_FALSE(context.inUse());
+
+    const size_t capacity = context.stack().capacity();
+    REQUIRE(capacity >= c1.stackDepth());
+
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(c1.evaluate(scope, context).asInt() == 6);
+    }
+
+    REQUIRE(context.stack().capacity() == capacity);
+
+    // Failed evaluations leave the context ready for the next one:
+    Calculator c2("1 + unknown_function(2)");
+    REQUIRE(c2.evaluate(scope, context).isError());
+    REQUIRE(context.stack().empty());
+    REQUIRE(c1.evaluate(scope, context).asInt() == 6);
+
+    // Nested evaluations do not share the context:
+    Calculator c3("eval('1 + 2') * 2 + s.len()", scope);
+    REQUIRE(c3.evaluate(scope, context).asInt() == 9);
+    REQUIRE(c3.evaluate(scope).asInt() == 9);
+}
+
+//TEST_CASE("Allocation free evaluation")
+void CParseTest::allocation_free_evaluation()
+{
+    TokenMap scope;
+    scope["a"] = 2;
+    scope["b"] = 3.5;
+    scope["flag"] = true;
+
+    Calculator c1("(a + 1) * b - a / 4 + (b * b - a) * -1", scope);
+    Calculator c2("a > 1 && b <= 4 || flag == false", scope);
+    EvaluationContext context;
+
+    // The first evaluations fill the free lists and the context:
+    for (int i = 0; i < 2; ++i) {
+        REQUIRE(c1.evaluate(scope, context).asReal() == Approx(-0.25));
+        REQUIRE(c2.evaluate(scope, context).asBool());
+    }
+
+    const quint64 before = allocationCount;
+
+    for (int i = 0; i < 100; ++i) {
+        c1.evaluate(scope, context);
+        c2.evaluate(scope, context);
+    }
+
+    REQUIRE(allocationCount == before);
+}
+
+//TEST_CASE("Execution tree backend")
+void CParseTest::execution_tree_backend()
+{
+    TokenMap scope;
+    scope["a"] = 2;
+    scope["b"] = 3.5;
+    scope["s"] = "Hello";
+
+    TokenMap map;
+    map["key"] = 10;
+    scope["m"] = map;
+
+    const QStringList expressions = {
+        "(a + 1) * b - a / 4",
+        "a > 1 && b <= 4",
+        "max(a, b * 2, 1)",
+        "s.upper().len() + s.len()",
+        "m.key * 2 + m['key']",
+        "[a, b, s].len()",
+        "{'x': a}.x",
+        "unknown_var",
+        "1 + unknown_function(2)",
+        "s.no_such_method()",
+    };
+
+    Calculator interpreted;
+    Calculator tree;
+    tree.setBackend(Calculator::ExecutionTreeBackend);
+    REQUIRE(tree.backend() == Calculator::ExecutionTreeBackend);
+
+    for (const QString &expr : expressions) {
+        REQUIRE(interpreted.compile(expr, scope));
+        REQUIRE(tree.compile(expr, scope));
+        REQUIRE(tree.evaluate(scope).str() == interpreted.evaluate(scope).str());
+    }
+
+    // Assignments write through to the scope on both backends:
+    TokenMap local = scope.getChild();
+    REQUIRE(tree.compile("c = a * 10"));
+    REQUIRE(tree.evaluate(local).asInt() == 20);
+    REQUIRE(local["c"].asInt() == 20);
+
+    // Copies share the tree and keep the backend:
+    Calculator copy(tree);
+    REQUIRE(copy.backend() == Calculator::ExecutionTreeBackend);
+    REQUIRE(copy.evaluate(local).asInt() == 20);
+
+    // Switching back interprets the same compiled expression:
+    tree.setBackend(Calculator::RpnBackend);
+    REQUIRE(tree.evaluate(local).asInt() == 20);
+}
+
+//TEST_CASE("Register backend")
+void CParseTest::register_backend()
+{
+    TokenMap scope;
+    scope["a"] = 2;
+    scope["b"] = 3.5;
+    scope["s"] = "Hello";
+
+    TokenMap map;
+    map["key"] = 10;
+    scope["m"] = map;
+
+    auto disassemble = [](const QString &expr) {
+        TokenQueue rpn = RpnBuilder::toRPN(expr, {}, "", nullptr, Config::defaultConfig());
+        RegisterProgramPtr program = RpnBuilder::buildProgram(rpn, Config::defaultConfig());
+        RpnBuilder::clearRPN(&rpn);
+        return program ? RpnBuilder::str(*program) : QString();
+    };
+
+    // Loads feeding an operator are fused into superinstructions:
+    REQUIRE(disassemble("a * 2 + b") == "r0 = ApplyVarConst * a 2; r0 = ApplyRegVar + b");
+    REQUIRE(disassemble("(a + 1) * (b - 1)") == "r0 = ApplyVarConst + a 1; r1 = ApplyVarConst - b 1; r0 = Apply *");
+    REQUIRE(disassemble("m.key") == "r0 = ApplyVarConst . m \"key\"");
+    REQUIRE(disassemble("1 + 2") == "r0 = ApplyConstConst + 1 2 [add_int_int]");
+
+    const QStringList expressions = {
+        "(a + 1) * b - a / 4",
+        "a > 1 && b <= 4",
+        "max(a, b * 2, 1)",
+        "s.upper().len() + s.len()",
+        "m.key * 2 + m['key']",
+        "[a, b, s].len()",
+        "unknown_var + 1",
+        "1 + unknown_function(2)",
+        "s.no_such_method()",
+    };
+
+    Calculator interpreted;
+    Calculator registers;
+    registers.setBackend(Calculator::RegisterBackend);
+    EvaluationContext context;
+
+    for (const QString &expr : expressions) {
+        REQUIRE(interpreted.compile(expr, scope));
+        REQUIRE(registers.compile(expr, scope));
+        REQUIRE(registers.evaluate(scope, context).str() == interpreted.evaluate(scope).str());
+        REQUIRE_FALSE(context.inUse());
+    }
+
+    TokenMap local = scope.getChild();
+    REQUIRE(registers.compile("c = a * 10"));
+    REQUIRE(registers.evaluate(local).asInt() == 20);
+    REQUIRE(local["c"].asInt() == 20);
+}
+
+//TEST_CASE("Static type inference")
+void CParseTest::static_type_inference()
+{
+    const VariableTypes types = {{"price", REAL}, {"qty", INT}};
+
+    auto disassemble = [&](const QString &expr) {
+        TokenQueue rpn = RpnBuilder::toRPN(expr, {}, "", nullptr, Config::defaultConfig());
+        RegisterProgramPtr program = RpnBuilder::buildProgram(rpn, Config::defaultConfig(), types);
+        RpnBuilder::clearRPN(&rpn);
+        return program ? RpnBuilder::str(*program) : QString();
+    };
+
+    // Types propagate through the kernel results:
+    REQUIRE(disassemble("price * qty + 1") == "r0 = ApplyVarVar * price qty [mul_real_int]; r0 = ApplyRegConst + 1 [add_real_int]");
+    REQUIRE(disassemble("qty + 1 < price") == "r0 = ApplyVarConst + qty 1 [add_int_int]; r0 = ApplyRegVar < price [lt_int_real]");
+
+    // Unknown types are left to run time dispatch:
+    REQUIRE(disassemble("price * other") == "r0 = ApplyVarVar * price other");
+    REQUIRE(disassemble("price * qty + other") == "r0 = ApplyVarVar * price qty [mul_real_int]; r0 = ApplyRegVar + other");
+
+    Calculator interpreted;
+    Calculator typed;
+    typed.setBackend(Calculator::RegisterBackend);
+    typed.setVariableTypes(types);
+    REQUIRE(typed.variableTypes().size() == 2);
+
+    const QStringList expressions = {
+        "price * qty + 1",
+        "qty + 1 < price",
+        "qty / 4 - price",
+        "price >= qty && qty <= 3",
+        "price == qty",
+    };
+
+    TokenMap scope;
+    scope["price"] = 2.5;
+    scope["qty"] = 3;
+
+    // Values of other types than declared fall back to run time dispatch:
+    TokenMap mistyped;
+    mistyped["price"] = 4;
+    mistyped["qty"] = "three";
+
+    for (const QString &expr : expressions) {
+        REQUIRE(interpreted.compile(expr));
+        REQUIRE(typed.compile(expr));
+        REQUIRE(typed.evaluate(scope).str() == interpreted.evaluate(scope).str());
+        REQUIRE(typed.evaluate(mistyped).str() == interpreted.evaluate(mistyped).str());
+    }
+
+    REQUIRE(typed.compile("price * qty"));
+    REQUIRE(typed.evaluate(scope).asReal() == Approx(7.5));
+}
+
+//TEST_CASE("Quickening")
+void CParseTest::quickening()
+{
+    TokenQueue rpn = RpnBuilder::toRPN("a + b * 2", {}, "", nullptr, Config::defaultConfig());
+    RegisterProgramPtr program = RpnBuilder::buildProgram(rpn, Config::defaultConfig());
+    RpnBuilder::clearRPN(&rpn);
+    REQUIRE(program);
+
+    auto evaluate = [&](const TokenMap &scope) { return PackToken(resolveReferenceToken(RpnBuilder::calculate(*program, scope))); };
+
+    TokenMap ints;
+    ints["a"] = 1;
+    ints["b"] = 2;
+
+    REQUIRE(RpnBuilder::str(*program) == "r0 = LoadVar a; r1 = ApplyVarConst * b 2; r0 = Apply +");
+
+    for (int i = 0; i < 20; ++i) {
+        REQUIRE(evaluate(ints).asReal() == Approx(5));
+    }
+
+    REQUIRE(RpnBuilder::str(*program) == "r0 = LoadVar a; r1 = ApplyVarConst * b 2 (quickened: mul_int_int); r0 = Apply + (quickened: add_int_int)");
+
+    // Other operand types deoptimize the operator:
+    TokenMap reals;
+    reals["a"] = 0.5;
+    reals["b"] = 2;
+    REQUIRE(evaluate(reals).asReal() == Approx(4.5));
+    REQUIRE(RpnBuilder::str(*program) == "r0 = LoadVar a; r1 = ApplyVarConst * b 2 (quickened: mul_int_int); r0 = Apply +");
+
+    for (int i = 0; i < 20; ++i) {
+        REQUIRE(evaluate(reals).asReal() == Approx(4.5));
+    }
+
+    REQUIRE(RpnBuilder::str(*program).endsWith("r0 = Apply + (quickened: add_real_int)"));
+
+    // Until it gives up on specializing:
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < 20; ++i) {
+            REQUIRE(evaluate(round % 2 ? reals : ints).asReal() == Approx(round % 2 ? 4.5 : 5));
+        }
+    }
+
+    REQUIRE(RpnBuilder::str(*program).endsWith("r0 = Apply + (megamorphic)"));
+    REQUIRE(evaluate(ints).asReal() == Approx(5));
+    REQUIRE(evaluate(reals).asReal() == Approx(4.5));
+}
+
+//TEST_CASE("Integer arithmetic")
+void CParseTest::integer_arithmetic()
+{
+    // Integers keep their type and precision:
+    PackToken sum = Calculator::calculate("9007199254740993 + 2");
+    REQUIRE(sum->m_type == INT);
+    REQUIRE(sum.asInt() == Q_INT64_C(9007199254740995));
+
+    REQUIRE(Calculator::calculate("3 * 4 - 5")->m_type == INT);
+    REQUIRE(Calculator::calculate("9007199254740993 > 9007199254740992").asBool());
+    REQUIRE_FALSE(Calculator::calculate("9007199254740993 == 9007199254740992").asBool());
+
+    // Division and mixed operands stay real:
+    REQUIRE(Calculator::calculate("7 / 2").asReal() == Approx(3.5));
+    REQUIRE(Calculator::calculate("1.5 + 1")->m_type == REAL);
+
+    // Overflowing results fall back to real numbers:
+    PackToken overflow = Calculator::calculate("9223372036854775807 + 1");
+    REQUIRE(overflow->m_type == REAL);
+    REQUIRE(overflow.asReal() == Approx(9223372036854775808.0));
+
+    // The kernels selected at compile time give the same results:
+    TokenMap scope;
+    scope["id"] = Q_INT64_C(9007199254740993);
+    scope["max"] = Q_INT64_C(9223372036854775807);
+
+    Calculator typed;
+    typed.setBackend(Calculator::RegisterBackend);
+    typed.setVariableTypes({{"id", INT}, {"max", INT}});
+
+    for (const QString &expr : {"id + 2", "id * 3 - id", "id > id - 1", "max * 2", "max + 1 > max"}) {
+        REQUIRE(typed.compile(expr));
+        REQUIRE(typed.evaluate(scope).str() == Calculator::calculate(expr, scope).str());
+        REQUIRE(typed.evaluate(scope)->m_type == Calculator::calculate(expr, scope)->m_type);
+    }
+}
+
+//TEST_CASE("Common subexpressions")
+void CParseTest::common_subexpressions()
+{
+    auto disassemble = [](const QString &expr, const TokenMap &vars = {}) {
+        TokenQueue rpn = RpnBuilder::toRPN(expr, vars, "", nullptr, Config::defaultConfig());
+        RegisterProgramPtr program = RpnBuilder::buildProgram(rpn, Config::defaultConfig());
+        RpnBuilder::clearRPN(&rpn);
+        return program ? RpnBuilder::str(*program) : QString();
+    };
+
+    // The largest repeated subexpression is computed once:
+    REQUIRE(disassemble("(a*b+c) / (a*b+c+1)")
+            == "r0 = ApplyVarVar * a b; r0 = ApplyRegVar + c; r3 = Copy r0; r1 = Copy r3; r1 = ApplyRegConst + 1; r0 = Apply /");
+    REQUIRE(disassemble("sqrt(x*x+y*y) * 2 + sqrt(x*x+y*y)").count("Copy") == 2);
+
+    // Not around assignments:
+    REQUIRE_FALSE(disassemble("a = a*b + a*b").contains("Copy"));
+
+    // Nor impure functions:
+    int calls = 0;
+    TokenMap vars;
+    vars["twice"] = CppFunction([&](const TokenMap &scope) -> PackToken { ++calls; return scope["value"].asReal() * 2; }, {"value"}, "twice");
+    vars["x"] = 3;
+    vars["y"] = 4;
+
+    REQUIRE_FALSE(disassemble("twice(x) + twice(x)", vars).contains("Copy"));
+
+    Calculator calculator;
+    calculator.setBackend(Calculator::RegisterBackend);
+    REQUIRE(calculator.compile("twice(x*y) + twice(x*y)", vars));
+    REQUIRE(calculator.evaluate(vars).asReal() == Approx(48));
+    REQUIRE(calls == 2);
+
+    vars["twice"] = CppFunction([&](const TokenMap &scope) -> PackToken { ++calls; return scope["value"].asReal() * 2; }, {"value"}, "twice").setPure();
+    calls = 0;
+    REQUIRE(calculator.compile("twice(x*y) + twice(x*y)", vars));
+    REQUIRE(calculator.evaluate(vars).asReal() == Approx(48));
+    REQUIRE(calls == 1);
+
+    // Unless the evaluation scope binds the function to an impure one:
+    TokenMap record;
+    record["twice"] = CppFunction([&](const TokenMap &scope) -> PackToken { ++calls; return scope["value"].asReal() * 2; }, {"value"}, "twice");
+    record["x"] = 3;
+    record["y"] = 4;
+    calls = 0;
+    REQUIRE(calculator.evaluate(record).asReal() == Approx(48));
+    REQUIRE(calls == 2);
+
+    calls = 0;
+    REQUIRE(calculator.evaluate(vars).asReal() == Approx(48));
+    REQUIRE(calls == 1);
+
+    // The results do not change:
+    for (const QString &expr : {"(x*y+1) / (x*y+1+1)", "sqrt(x*x+y*y) + sqrt(x*x+y*y) * 2", "-x + -x", "'a' + str(x) + str(x)", "max(x, y) - max(x, y)"}) {
+        REQUIRE(calculator.compile(expr));
+        REQUIRE(calculator.evaluate(vars).str() == Calculator::calculate(expr, vars).str());
+    }
+}
+
+//TEST_CASE("Partial evaluation")
+void CParseTest::partial_evaluation()
+{
+    TokenMap tenant;
+    tenant["rate"] = 0.25;
+    tenant["threshold"] = 100;
+
+    Calculator c1;
+    REQUIRE(c1.compile("price * (1 + rate) > threshold * 2 && sqrt(threshold) < price"));
+
+    // Only the per-record part is left:
+    Calculator c2 = c1.specialize(tenant);
+    REQUIRE(c2.str() == "Calculator { RPN: [ price, 1.25, *, 200, >, 10, price, <, && ] }");
+
+    TokenMap record(&tenant);
+
+    for (qreal price : {20.0, 150.0, 180.0}) {
+        record["price"] = price;
+        REQUIRE(c2.evaluate(record).asBool() == c1.evaluate(record).asBool());
+    }
+
+    record["price"] = 180;
+    REQUIRE(c2.evaluate(record).asBool());
+
+    // The other backends run the specialized expression too:
+    c1.setBackend(Calculator::RegisterBackend);
+    Calculator c3 = c1.specialize(tenant);
+    REQUIRE(c3.backend() == Calculator::RegisterBackend);
+    REQUIRE(c3.evaluate(record).asBool());
+
+    // Functions and constants of the config scope are folded too, unless
+    // the evaluation scope rebinds them:
+    const qreal pi = std::atan(1) * 4;
+    Calculator c6;
+    REQUIRE(c6.compile("sqrt(threshold) + pi * rate * 4"));
+
+    for (Calculator::Backend backend : {Calculator::RpnBackend, Calculator::RegisterBackend}) {
+        c6.setBackend(backend);
+        Calculator c7 = c6.specialize(tenant);
+        REQUIRE(c7.str() == "Calculator { RPN: [ " + PackToken(10 + pi).str() + " ] }");
+        REQUIRE(c7.evaluate(record).asReal() == Approx(10 + pi));
+
+        TokenMap rebound(&record);
+        rebound["sqrt"] = CppFunction(&default_answer, {"num"}, "sqrt");
+        REQUIRE(c7.evaluate(rebound).asReal() == Approx(42 + pi));
+        rebound["pi"] = 3;
+        REQUIRE(c7.evaluate(rebound).asReal() == Approx(45));
+        REQUIRE(c7.evaluate(record).asReal() == Approx(10 + pi));
+
+        // Specializing again keeps them:
+        TokenMap empty;
+        REQUIRE(c7.specialize(empty).evaluate(rebound).asReal() == Approx(45));
+    }
+
+    // Without a value the variable is left unbound:
+    TokenMap partial;
+    partial["rate"] = 0.5;
+    REQUIRE(c1.specialize(partial).str() == "Calculator { RPN: [ price, 1.5, *, threshold, 2, *, >, [function: sqrt], threshold, (), price, <, && ] }");
+
+    // Known variables are substituted, but nothing is folded next to
+    // assignments, whose target keeps its name:
+    Calculator c4;
+    REQUIRE(c4.compile("rate = rate * 2 + 1"));
+    Calculator c5 = c4.specialize(tenant);
+    REQUIRE(c5.str() == "Calculator { RPN: [ 0.25, 0.25, 2, *, 1, +, = ] }");
+
+    // The known value is used whatever the scope holds, as when folded:
+    TokenMap scope;
+    scope["rate"] = 2;
+    REQUIRE(c5.evaluate(scope).asReal() == Approx(1.5));
+    REQUIRE(scope["rate"].asReal() == Approx(1.5));
+}
+
+//TEST_CASE("Dependency analysis")
+void CParseTest::dependency_analysis()
+{
+    using Names = std::set<QString>;
+
+    TokenMap vars;
+    vars["discount"] = 0.1;
+
+    Calculator c1;
+    REQUIRE(c1.compile("total = sqrt(price * qty) + order.customer.rate * discount - str(order.id).len()", vars));
+
+    Dependencies dependencies = c1.dependencies();
+    REQUIRE(dependencies.variables == Names({"price", "qty", "order", "discount"}));
+    REQUIRE(dependencies.functions == Names({"sqrt", "str"}));
+    REQUIRE(dependencies.members == Names({"order.customer.rate", "order.id"}));
+    REQUIRE(dependencies.assigned == Names({"total"}));
+
+    // Assigning a member reads its variable, assigning a variable does not:
+    REQUIRE(c1.compile("m.key = count = count + 1"));
+    dependencies = c1.dependencies();
+    REQUIRE(dependencies.variables == Names({"m", "count"}));
+    REQUIRE(dependencies.members == Names({"m.key"}));
+    REQUIRE(dependencies.assigned == Names({"m.key", "count"}));
+
+    // Whatever the order the paths of a variable are used in:
+    REQUIRE(c1.compile("order.customer.rate + order.customer"));
+    REQUIRE(c1.dependencies().members == Names({"order.customer", "order.customer.rate"}));
+    REQUIRE(c1.compile("order.customer + order.customer.rate"));
+    REQUIRE(c1.dependencies().members == Names({"order.customer", "order.customer.rate"}));
+
+    REQUIRE(Calculator().dependencies().variables.empty());
+}
+
+//TEST_CASE("Expression graph")
+void CParseTest::expression_graph()
+{
+    using Names = std::vector<QString>;
+
+    ExpressionGraph graph;
+    graph.setInput("revenue", 200);
+    graph.setInput("cost", 150);
+    graph.setInput("weight", 2);
+    graph.setInput("tax", 0.2);
+
+    REQUIRE(graph.setFormula("score", "margin / revenue * weight"));
+    REQUIRE(graph.setFormula("margin", "revenue - cost"));
+    REQUIRE(graph.setFormula("net", "margin * (1 - tax)"));
+
+    // Formulas are evaluated after those they read:
+    REQUIRE(graph.recompute() == Names({"margin", "net", "score"}));
+    REQUIRE(graph.value("score").asReal() == Approx(0.5));
+    REQUIRE(graph.value("net").asReal() == Approx(40));
+    REQUIRE(graph.recompute().empty());
+
+    // Only what depends on a changed input is recomputed:
+    graph.setInput("weight", 4);
+    REQUIRE(graph.recompute() == Names({"score"}));
+    REQUIRE(graph.value("score").asReal() == Approx(1));
+
+    graph.setInput("cost", 100);
+    REQUIRE(graph.recompute() == Names({"margin", "net", "score"}));
+    REQUIRE(graph.value("net").asReal() == Approx(80));
+
+    // Reading a value only brings what it depends on up to date:
+    graph.setInput("tax", 0.5);
+    graph.setInput("weight", 1);
+    REQUIRE(graph.value("net").asReal() == Approx(50));
+    REQUIRE(graph.recompute() == Names({"score"}));
+
+    REQUIRE(graph.dependencies("net") == std::set<QString>({"margin", "tax"}));
+    REQUIRE(graph.dependents("margin") == std::set<QString>({"net", "score"}));
+
+    // Cycles are rejected:
+    REQUIRE_FALSE(graph.setFormula("revenue", "score * 2"));
+    REQUIRE_FALSE(graph.setFormula("margin", "margin + 1"));
+    REQUIRE_FALSE(graph.setFormula("bad", ""));
+    REQUIRE(graph.value("margin").asReal() == Approx(100));
+
+    // Replacing a formula rewires its dependencies:
+    REQUIRE(graph.setFormula("margin", "revenue - cost * 1.5"));
+    REQUIRE(graph.dependents("cost") == std::set<QString>({"margin"}));
+    REQUIRE(graph.recompute() == Names({"margin", "net", "score"}));
+    REQUIRE(graph.value("score").asReal() == Approx(0.25));
+
+    // Calls and assignments leave the values alone:
+    ExpressionGraph named;
+    named.setInput("num", 5);
+    REQUIRE(named.setFormula("r", "sqrt(16)"));
+    REQUIRE(named.setFormula("s", "num + 1"));
+    REQUIRE(named.setFormula("t", "r + (u = 2)"));
+    REQUIRE(named.recompute().size() == 3);
+    REQUIRE(named.value("s").asInt() == 6);
+    REQUIRE(named.value("t").asReal() == Approx(6));
+    REQUIRE(named.value("u")->m_type == NONE);
+}
+
+//TEST_CASE("Parallel evaluation")
+void CParseTest::parallel_evaluation()
+{
+    TokenMap inputs;
+    inputs["x"] = 3;
+
+    // A wide layer of independent expressions, and one reading them all:
+    std::vector<Calculator> calculators;
+    std::vector<EvaluationScheduler::Task> tasks;
+    QString sum = "0";
+
+    for (int i = 0; i < 64; ++i) {
+        calculators.emplace_back(QString("x * %1 + sqrt(%1)").arg(i));
+        sum += QString(" + v%1").arg(i);
+    }
+
+    calculators.emplace_back(sum);
+
+    for (size_t i = 0; i + 1 < calculators.size(); ++i) {
+        tasks.push_back({QString("v%1").arg(i), &calculators[i], {}});
+    }
+
+    tasks.push_back({"total", &calculators.back(), {}});
+
+    for (size_t i = 0; i + 1 < tasks.size(); ++i) {
+        tasks.back().dependencies.push_back(i);
+    }
+
+    qreal expected = 0;
+
+    for (int i = 0; i < 64; ++i) {
+        expected += 3 * i + std::sqrt(i);
+    }
+
+    EvaluationScheduler scheduler(4);
+    REQUIRE(scheduler.threadCount() == 4);
+
+    for (int round = 0; round < 20; ++round) {
+        std::vector<PackToken> results = scheduler.run(tasks, inputs);
+        REQUIRE(results.size() == tasks.size());
+        REQUIRE(results[10].asReal() == Approx(30 + std::sqrt(10)));
+        REQUIRE(results.back().asReal() == Approx(expected));
+    }
+
+    REQUIRE(scheduler.run({}, inputs).empty());
+
+    // Expression graphs recompute their dirty formulas on it too:
+    ExpressionGraph graph;
+    graph.setInput("revenue", 200);
+    graph.setInput("cost", 150);
+
+    for (int i = 0; i < 32; ++i) {
+        REQUIRE(graph.setFormula(QString("m%1").arg(i), QString("(revenue - cost) * %1").arg(i)));
+        REQUIRE(graph.setFormula(QString("s%1").arg(i), QString("m%1 / revenue").arg(i)));
+    }
+
+    REQUIRE(graph.recompute(scheduler).size() == 64);
+    REQUIRE(graph.value("s31").asReal() == Approx(7.75));
+
+    graph.setInput("cost", 100);
+    REQUIRE(graph.recompute(scheduler).size() == 64);
+    REQUIRE(graph.value("s31").asReal() == Approx(15.5));
+    REQUIRE(graph.recompute(scheduler).empty());
+}
+
+//TEST_CASE("Batched variable resolver")
+void CParseTest::batch_variable_resolver()
+{
+    std::vector<std::vector<QString>> batches;
+    int singleCalls = 0;
+
+    const Calculator::Backend backends[] = {Calculator::RpnBackend, Calculator::ExecutionTreeBackend, Calculator::RegisterBackend};
+
+    for (Calculator::Backend backend : backends) {
+        batches.clear();
+        singleCalls = 0;
+
+        Calculator c1;
+        c1.setBackend(backend);
+        c1.setBatchVariableResolver([&](const std::vector<QString> &names) {
+            batches.push_back(names);
+            TokenMap values;
+
+            for (const QString &name : names) {
+                if (name == "a") {
+                    values["a"] = 1;
+                } else if (name == "b") {
+                    values["b"] = 2;
+                } else if (name == "broken") {
+                    values["broken"] = PackToken::Error();
+                }
+            }
+
+            return values;
+        });
+        c1.setVariableResolver([&](const QString &) {
+            ++singleCalls;
+            return PackToken::Reject();
+        });
+
+        // One call for all the names missing from the scope, whatever the
+        // number of times they are read:
+        TokenMap scope;
+        scope["c"] = 10;
+        REQUIRE(c1.compile("a + b * c + a"));
+        REQUIRE(c1.evaluate(scope).asInt() == 22);
+        REQUIRE(batches.size() == 1);
+        REQUIRE(batches[0] == std::vector<QString>({"a", "b"}));
+        REQUIRE(singleCalls == 0);
+
+        // Once per evaluation, and not at all if the scope has every name:
+        scope["a"] = 5;
+        REQUIRE(c1.evaluate(scope).asInt() == 30);
+        REQUIRE(batches.size() == 2);
+        REQUIRE(batches[1] == std::vector<QString>({"b"}));
+
+        scope["b"] = 3;
+        REQUIRE(c1.evaluate(scope).asInt() == 40);
+        REQUIRE(batches.size() == 2);
+
+        // Names the resolver does not know stay unresolved:
+        REQUIRE(c1.compile("unknown"));
+        REQUIRE(c1.evaluate(TokenMap())->m_type == VAR);
+        REQUIRE(singleCalls == 0);
+
+        REQUIRE(c1.compile("a + broken"));
+        REQUIRE(c1.evaluate(TokenMap())->m_type == ERROR);
+    }
+}
+
+//TEST_CASE("Asynchronous variable resolution")
+void CParseTest::async_evaluation()
+{
+    // A stand-in for a slow service, answering the requests every few milliseconds:
+    struct Service
+    {
+        std::mutex mutex;
+        std::vector<std::pair<PendingValuePtr, PackToken>> requests;
+        std::atomic<bool> stopping{false};
+        std::thread thread{[this] {
+            while (!stopping) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                std::lock_guard<std::mutex> lock(mutex);
+
+                for (auto &request : requests) {
+                    request.first->set(request.second);
+                }
+
+                requests.clear();
+            }
+        }};
+
+        ~Service()
+        {
+            stopping = true;
+            thread.join();
+        }
+
+        PendingValuePtr request(const PackToken &value)
+        {
+            auto pending = std::make_shared<PendingValue>();
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.emplace_back(pending, value);
+            return pending;
+        }
+    } service;
+
+    auto resolver = [&](const QString &name) -> PendingValuePtr {
+        if (name == "price") {
+            return service.request(2.5);
+        }
+
+        if (name == "qty") {
+            return service.request(4);
+        }
+
+        if (name == "broken") {
+            return service.request(PackToken::Error());
+        }
+
+        if (name == "now") {
+            auto ready = std::make_shared<PendingValue>();
+            ready->set(100);
+            return ready;
+        }
+
+        return nullptr;
+    };
+
+    Calculator c1("price * qty + fee");
+    TokenMap scope;
+    scope["fee"] = 1;
+
+    // A single thread interleaves all the evaluations, each suspended on
+    // its first variable until the service answers:
+    std::vector<AsyncEvaluation> evaluations;
+
+    for (int i = 0; i < 1000; ++i) {
+        evaluations.push_back(c1.evaluateAsync(scope, resolver));
+        REQUIRE_FALSE(evaluations.back().resume());
+        REQUIRE(evaluations.back().pending());
+    }
+
+    size_t finished = 0;
+
+    while (finished < evaluations.size()) {
+        finished = 0;
+
+        for (AsyncEvaluation &evaluation : evaluations) {
+            finished += evaluation.resume();
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (const AsyncEvaluation &evaluation : evaluations) {
+        REQUIRE(evaluation.finished());
+        REQUIRE_FALSE(evaluation.pending());
+        REQUIRE(evaluation.result().asReal() == 11);
+    }
+
+    // Values that are ready or in the scope do not suspend it:
+    scope["price"] = 3;
+    REQUIRE(c1.compile("price * now + fee"));
+    AsyncEvaluation evaluation = c1.evaluateAsync(scope, resolver);
+    REQUIRE(evaluation.resume());
+    REQUIRE(evaluation.result().asReal() == 301);
+
+    // Names the resolver leaves to the synchronous lookup, and failures:
+    REQUIRE(c1.compile("unknown"));
+    evaluation = c1.evaluateAsync(scope, resolver);
+    REQUIRE(evaluation.resume());
+    REQUIRE(evaluation.result()->m_type == VAR);
+
+    REQUIRE(c1.compile("fee + broken"));
+    evaluation = c1.evaluateAsync(scope, resolver);
+
+    while (!evaluation.resume()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    REQUIRE(evaluation.result()->m_type == ERROR);
+
+    REQUIRE(c1.compile("price = qty"));
+    evaluation = c1.evaluateAsync(scope, resolver);
+
+    while (!evaluation.resume()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    REQUIRE(scope["price"].asInt() == 4);
+
+    // Each name is only asked about once:
+    std::map<QString, int> requests;
+    auto counting = [&](const QString &name) {
+        ++requests[name];
+        return resolver(name);
+    };
+
+    REQUIRE(c1.compile("qty + qty * qty"));
+    evaluation = c1.evaluateAsync(scope, counting);
+
+    while (!evaluation.resume()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    REQUIRE(evaluation.result().asInt() == 20);
+    REQUIRE(requests["qty"] == 1);
+
+    // The evaluation keeps its own copy of the expression:
+    auto c2 = std::make_unique<Calculator>("qty * 2");
+    evaluation = c2->evaluateAsync(scope, resolver);
+    REQUIRE_FALSE(evaluation.resume());
+    REQUIRE(c2->compile("1 + 1"));
+    c2.reset();
+
+    while (!evaluation.resume()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    REQUIRE(evaluation.result().asInt() == 8);
+
+    // The values are kept in the resolver cache of the config:
+    Calculator c3;
+    Config config = c3.config();
+    auto cache = std::make_shared<VariableResolverCache>(VariableResolverCache::AcrossEvaluations);
+    config.resolverCache = cache;
+    c3.setConfig(config);
+    REQUIRE(c3.compile("qty * 3"));
+    requests.clear();
+
+    evaluation = c3.evaluateAsync(scope, counting);
+
+    while (!evaluation.resume()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    REQUIRE(evaluation.result().asInt() == 12);
+
+    evaluation = c3.evaluateAsync(scope, counting);
+    REQUIRE(evaluation.resume());
+    REQUIRE(evaluation.result().asInt() == 12);
+    REQUIRE(requests["qty"] == 1);
+    REQUIRE(cache->hits() == 1);
+
+    // And the batch variable resolver answers first:
+    config.resolverCache = nullptr;
+    config.batchVariableResolver = [](const std::vector<QString> &) {
+        TokenMap values;
+        values["qty"] = 5;
+        return values;
+    };
+    c3.setConfig(config);
+    REQUIRE(c3.compile("qty * 3"));
+    requests.clear();
+
+    evaluation = c3.evaluateAsync(scope, counting);
+    REQUIRE(evaluation.resume());
+    REQUIRE(evaluation.result().asInt() == 15);
+    REQUIRE(requests["qty"] == 0);
+}
+
+//TEST_CASE("Resolver cache")
+void CParseTest::resolver_cache()
+{
+    std::map<QString, int> calls;
+
+    Calculator c1;
+    c1.setVariableResolver([&](const QString &name) {
+        ++calls[name];
+
+        if (name == "a") {
+            return PackToken(2);
+        }
+
+        if (name == "b") {
+            return PackToken(3);
+        }
+
+        if (name == "broken") {
+            return PackToken::Error();
+        }
+
+        return PackToken::Reject();
+    });
+
+    // Without a cache, each use of a name calls the resolver:
+    REQUIRE(c1.compile("a + a * b + b"));
+    REQUIRE(c1.evaluate().asInt() == 11);
+    REQUIRE(calls["a"] == 2);
+    REQUIRE(calls["b"] == 2);
+
+    // Once per name and evaluation:
+    Config config = c1.config();
+    auto perEvaluation = std::make_shared<VariableResolverCache>();
+    config.resolverCache = perEvaluation;
+    c1.setConfig(config);
+    calls.clear();
+
+    REQUIRE(c1.evaluate().asInt() == 11);
+    REQUIRE(c1.evaluate().asInt() == 11);
+    REQUIRE(calls["a"] == 2);
+    REQUIRE(calls["b"] == 2);
+    REQUIRE(perEvaluation->hits() == 4);
+    REQUIRE(perEvaluation->misses() == 4);
+
+    // Across evaluations, until invalidated:
+    auto shared = std::make_shared<VariableResolverCache>(VariableResolverCache::AcrossEvaluations);
+    config.resolverCache = shared;
+    c1.setConfig(config);
+    calls.clear();
+
+    for (int i = 0; i < 5; ++i) {
+        REQUIRE(c1.evaluate().asInt() == 11);
+    }
+
+    REQUIRE(calls["a"] == 1);
+    REQUIRE(calls["b"] == 1);
+    REQUIRE(shared->hits() == 18);
+    REQUIRE(shared->misses() == 2);
+
+    shared->invalidate();
+    REQUIRE(shared->generation() == 1);
+    REQUIRE(c1.evaluate().asInt() == 11);
+    REQUIRE(calls["a"] == 2);
+
+    shared->resetStatistics();
+    REQUIRE(shared->hits() == 0);
+
+    // Unknown names are remembered, errors are not:
+    REQUIRE(c1.compile("unknown"));
+    REQUIRE(c1.evaluate()->m_type == VAR);
+    REQUIRE(c1.evaluate()->m_type == VAR);
+    REQUIRE(calls["unknown"] == 1);
+
+    REQUIRE(c1.compile("a + broken"));
+    REQUIRE(c1.evaluate()->m_type == ERROR);
+    REQUIRE(c1.evaluate()->m_type == ERROR);
+    REQUIRE(calls["broken"] == 2);
+
+    // The answers expire after their time to live:
+    auto expiring = std::make_shared<VariableResolverCache>(VariableResolverCache::AcrossEvaluations, std::chrono::milliseconds(1));
+    config.resolverCache = expiring;
+    c1.setConfig(config);
+    REQUIRE(c1.compile("a"));
+    calls.clear();
+
+    REQUIRE(c1.evaluate().asInt() == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    REQUIRE(c1.evaluate().asInt() == 2);
+    REQUIRE(calls["a"] == 2);
+
+    // Each evaluation gets its own copy of the containers kept:
+    Calculator c2;
+    config.resolverCache = std::make_shared<VariableResolverCache>(VariableResolverCache::AcrossEvaluations);
+    c2.setConfig(config);
+    c2.setVariableResolver([&](const QString &name) {
+        ++calls[name];
+
+        if (name == "obj") {
+            TokenMap inner;
+            inner["key"] = 0;
+            TokenMap obj;
+            obj["key"] = 0;
+            obj["inner"] = inner;
+            return PackToken(obj);
+        }
+
+        if (name == "items") {
+            TokenList items;
+            items.push(0);
+            return PackToken(items);
+        }
+
+        return PackToken::Reject();
+    });
+    calls.clear();
+
+    REQUIRE(c2.compile("obj.key = 1"));
+    REQUIRE(c2.compile("obj.key = 1"));
+    REQUIRE(c2.evaluate().asInt() == 1);
+    REQUIRE(c2.compile("obj.inner.key = 2"));
+    REQUIRE(c2.evaluate().asInt() == 2);
+    REQUIRE(c2.compile("items[0] = 3"));
+    REQUIRE(c2.evaluate().asInt() == 3);
+
+    REQUIRE(c2.compile("obj.key + obj.inner.key + items[0]"));
+    REQUIRE(c2.evaluate().asInt() == 0);
+    REQUIRE(calls["obj"] == 1);
+    REQUIRE(calls["items"] == 1);
+}
+
+PackToken slow_one(const TokenMap &)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return 1;
+}
+
+//TEST_CASE("Evaluation limits")
+void CParseTest::evaluation_limits()
+{
+    auto cause = [](const PackToken &result) {
+        return result->m_type == ERROR ? static_cast<const TokenError *>(result.token())->cause() : QString();
+    };
+
+    TokenMap scope;
+    scope["text"] = QString("x").repeated(1000);
+    scope["code"] = "eval(code)";
+    scope["slow"] = CppFunction(&slow_one, "slow");
+
+    Calculator c1("1 + 2 + 3 + 4");
+
+    EvaluationLimits steps;
+    steps.maxSteps = 2;
+    REQUIRE(cause(c1.evaluate(scope, steps)) == "evaluation exceeded its step limit");
+    steps.maxSteps = 3;
+    REQUIRE(c1.evaluate(scope, steps).asInt() == 10);
+
+    // Limits set on the config apply to every evaluation, whatever the backend:
+    Config config = Config::defaultConfig().overlay();
+    config.limits.maxSteps = 2;
+    const Calculator::Backend backends[] = {Calculator::RpnBackend, Calculator::ExecutionTreeBackend, Calculator::RegisterBackend};
+
+    for (Calculator::Backend backend : backends) {
+        Calculator c2("1 + 2 + 3 + 4", {}, {}, nullptr, config);
+        c2.setBackend(backend);
+        REQUIRE(cause(c2.evaluate(scope)) == "evaluation exceeded its step limit");
+        REQUIRE(c2.evaluate(scope, EvaluationLimits()).asInt() == 10);
+    }
+
+    // The size of the values produced:
+    EvaluationLimits memory;
+    memory.maxBytes = 5000;
+    REQUIRE(c1.compile("text + text"));
+    REQUIRE(c1.evaluate(scope, memory).asString().size() == 2000);
+    REQUIRE(c1.compile("text + text + text"));
+    REQUIRE(cause(c1.evaluate(scope, memory)) == "evaluation exceeded its memory limit");
+
+    // Nested evaluations count against the outermost one:
+    EvaluationLimits depth;
+    depth.maxCallDepth = 20;
+    REQUIRE(c1.compile("eval(code)"));
+    REQUIRE(cause(c1.evaluate(scope, depth)) == "evaluation exceeded its call depth limit");
+
+    depth.maxCallDepth = 0;
+    depth.maxSteps = 50;
+    REQUIRE(cause(c1.evaluate(scope, depth)) == "evaluation exceeded its step limit");
+
+    EvaluationLimits deadline;
+    deadline.timeout = std::chrono::milliseconds(2);
+    REQUIRE(c1.compile("slow() + slow() + slow()"));
+    REQUIRE(cause(c1.evaluate(scope, deadline)) == "evaluation exceeded its deadline");
+    REQUIRE(c1.evaluate(scope).asInt() == 3);
+}
+
+//TEST_CASE("Profiling counters")
+void CParseTest::profiling()
+{
+    auto profiler = std::make_shared<Profiler>();
+    Config config = Config::defaultConfig().overlay();
+    config.profiler = profiler;
+    config.variableResolver = [](const QString &name) {
+        return name == "remote" ? PackToken(5) : PackToken::Reject();
+    };
+
+    TokenMap scope;
+    scope["a"] = 2;
+    scope["s"] = "text";
+
+    Calculator c1("a * 3 + sqrt(16) + remote", {}, {}, nullptr, config);
+    Calculator c2("s + s", {}, {}, nullptr, config);
+
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(c1.evaluate(scope).asReal() == 15);
+        REQUIRE(c2.evaluate(scope).asString() == "texttext");
+    }
+
+    Profiler::Counters operators = profiler->snapshot(Profiler::Operator);
+    REQUIRE(operators["+"].calls == 30);
+    REQUIRE(operators["*"].calls == 10);
+    REQUIRE(operators["()"].calls == 10);
+    REQUIRE(operators["+"].time.count() > 0);
+
+    Profiler::Counters operations = profiler->snapshot(Profiler::Operation);
+    REQUIRE(operations["op(NUM, NUM)"].calls == 30);
+    REQUIRE(operations["op(STR, STR)"].calls == 10);
+
+    Profiler::Counters functions = profiler->snapshot(Profiler::Function);
+    REQUIRE(functions.size() == 1);
+    REQUIRE(functions["sqrt"].calls == 10);
+
+    Profiler::Counters variables = profiler->snapshot(Profiler::Variable);
+    REQUIRE(variables["local"].calls == 30);
+    REQUIRE(variables["resolver"].calls == 10);
+
+    // The counters of each thread are merged:
+    std::thread thread([&] {
+        for (int i = 0; i < 10; ++i) {
+            c1.evaluate(scope);
+        }
+    });
+    thread.join();
+
+    REQUIRE(profiler->snapshot(Profiler::Function)["sqrt"].calls == 20);
+
+    profiler->reset();
+    REQUIRE(profiler->snapshot(Profiler::Operator).empty());
+
+    // Nothing is recorded without a profiler:
+    Calculator c3("a * 3", {}, {}, nullptr, Config::defaultConfig());
+    REQUIRE(c3.evaluate(scope).asInt() == 6);
+    REQUIRE(profiler->snapshot(Profiler::Operator).empty());
+}
+
+//TEST_CASE("Source spans of subexpressions")
+void CParseTest::source_spans()
+{
+    auto profiler = std::make_shared<Profiler>();
+    Config config = Config::defaultConfig().overlay();
+    config.profiler = profiler;
+
+    TokenMap scope;
+    scope["a"] = 2;
+    scope["b"] = 3;
+    scope["s"] = "abc";
+
+    Calculator c1("(a + b) * sqrt(16) - s.len()", {}, {}, nullptr, config);
+    REQUIRE(c1.compiled());
+    REQUIRE(c1.sourceSpans().size() == c1.subexpressions().size());
+
+    // The subexpressions named after their operators and variables:
+    const std::vector<QString> &names = c1.subexpressions();
+    std::set<QString> named(names.begin(), names.end());
+    // Prefixed with an id of the calculator, as calculators share profilers:
+    const QString id = names.back().left(names.back().indexOf(' ') + 1);
+    REQUIRE(id.startsWith("#"));
+    REQUIRE(named.count(id + "1:a"));
+    REQUIRE(named.count(id + "5:b"));
+    REQUIRE(named.count(id + "0:(a + b)"));
+    REQUIRE(named.count(id + "10:sqrt(16)"));
+    REQUIRE(named.count(id + "0:(a + b) * sqrt(16)"));
+    REQUIRE(named.count(id + "21:s.len()"));
+    REQUIRE(named.count(id + "0:(a + b) * sqrt(16) - s.len()"));
+    // Literals are not named:
+    REQUIRE(named.count(""));
+    REQUIRE_FALSE(named.count(id + "15:16"));
+
+    // Spans stop at the delimiter:
+    int rest = 0;
+    Calculator c2("[1, x] ; 2", {}, ";", &rest, config);
+    REQUIRE(c2.subexpressions().back().endsWith(" 0:[1, x]"));
+
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(c1.evaluate(scope).asInt() == 17);
+    }
+
+    Profiler::Counters subexpressions = profiler->snapshot(Profiler::Subexpression);
+    REQUIRE(subexpressions[id + "0:(a + b)"].calls == 3);
+    REQUIRE(subexpressions[id + "10:sqrt(16)"].calls == 3);
+    REQUIRE(subexpressions[id + "1:a"].calls == 3);
+
+    // Calculators with the same source are counted apart:
+    Calculator c3("a * 2", {}, {}, nullptr, config);
+    Calculator c4("a * 2", {}, {}, nullptr, config);
+    REQUIRE(c3.subexpressions().back() != c4.subexpressions().back());
+    REQUIRE(c3.evaluate(scope).asInt() == 4);
+    REQUIRE(c3.evaluate(scope).asInt() == 4);
+    REQUIRE(c4.evaluate(scope).asInt() == 4);
+    subexpressions = profiler->snapshot(Profiler::Subexpression);
+    REQUIRE(subexpressions[c3.subexpressions().back()].calls == 2);
+    REQUIRE(subexpressions[c4.subexpressions().back()].calls == 1);
+
+    const QStringList lines = c1.annotate(*profiler).split("\n");
+    REQUIRE(lines.size() == 9);
+    REQUIRE(lines[0] == "(a + b) * sqrt(16) - s.len()");
+    REQUIRE(lines[1].startsWith("~~~~~~~~~~~~~~~~~~~~~~~~~~~~ | 3 calls, "));
+    REQUIRE(lines[2].startsWith("~~~~~~~~~~~~~~~~~~           | 3 calls, "));
+    REQUIRE(lines[3].startsWith("~~~~~~~                      | 3 calls, "));
+    REQUIRE(lines[4].startsWith(" ~                           | 3 calls, "));
+    REQUIRE(lines[6].startsWith("          ~~~~~~~~           | 3 calls, "));
+    REQUIRE(lines[7].startsWith("                     ~~~~~~~ | 3 calls, "));
+    REQUIRE(lines[8].startsWith("                     ~       | 3 calls, "));
+
+    // Not counted without a profiler, nor by the other backends:
+    profiler->reset();
+    c1.setBackend(Calculator::RegisterBackend);
+    REQUIRE(c1.evaluate(scope).asInt() == 17);
+    REQUIRE(profiler->snapshot(Profiler::Subexpression).empty());
+    REQUIRE(c1.annotate(*profiler) == "(a + b) * sqrt(16) - s.len()");
+
+    // A specialized expression no longer matches its source:
+    REQUIRE(c1.specialize(scope).sourceSpans().empty());
+}
+
+//TEST_CASE("Compile statistics")
+void CParseTest::compile_statistics()
+{
+    Calculator c1;
+    CompileStatistics statistics;
+    REQUIRE(c1.compile("a * b + max(a, 2) - 1.5", {}, {}, nullptr, &statistics));
+
+    REQUIRE(statistics.lexing.count() > 0);
+    REQUIRE(statistics.parsing.count() > 0);
+    REQUIRE(statistics.rpnLength == 11);
+    REQUIRE(statistics.stackDepth == 4);
+    REQUIRE(statistics.literals == 2);
+    REQUIRE(statistics.variables == 2);
+    REQUIRE(statistics.functions == 1);
+    REQUIRE(statistics.bytes > 0);
+
+    // The same, without the times:
+    CompileStatistics unmeasured = c1.statistics();
+    REQUIRE(unmeasured.lexing.count() == 0);
+    REQUIRE(unmeasured.rpnLength == statistics.rpnLength);
+    REQUIRE(unmeasured.bytes == statistics.bytes);
+
+    // Building a backend is part of optimizing:
+    Calculator c2;
+    c2.setBackend(Calculator::RegisterBackend);
+    REQUIRE(c2.compile("a * b + max(a, 2) - 1.5", {}, {}, nullptr, &statistics));
+    REQUIRE(statistics.optimizing.count() > 0);
+
+    // Strings held by the program count:
+    Calculator c3;
+    REQUIRE(c3.compile("'" + QString("x").repeated(100) + "'"));
+    REQUIRE(c3.statistics().bytes >= 100 * sizeof(QChar));
+    REQUIRE(c3.statistics().literals == 1);
+}
+
+//TEST_CASE("Token allocation accounting")
+void CParseTest::allocation_accounting()
+{
+    TokenMap scope;
+    scope["a"] = 2;
+    scope["s"] = "abc";
+
+    Calculator c1("s + 'def' + s");
+    Calculator c2("(a, a * 2)");
+
+    // Every thread reports to the installed hook, by type:
+    TokenAllocationCounter counter;
+    REQUIRE(setTokenAllocationHook(&counter) == nullptr);
+    REQUIRE(c1.evaluate(scope).asString() == "abcdefabc");
+
+    std::thread thread([&] { c2.evaluate(scope); });
+    thread.join();
+
+    REQUIRE(setTokenAllocationHook(nullptr) == &counter);
+
+    TokenAllocationCounter::UsageByType usage = counter.allocations();
+    REQUIRE(usage[STR].allocations >= 2);
+    REQUIRE(usage[STR].bytes == usage[STR].allocations * sizeof(TokenTyped<QString>));
+    REQUIRE(usage[TUPLE].allocations >= 1);
+    REQUIRE(counter.peakBytes() > 0);
+
+    // Nothing is counted without a hook:
+    c1.evaluate(scope);
+    REQUIRE(counter.allocations()[STR].allocations == usage[STR].allocations);
+
+    // The tokens of one evaluation on this thread:
+    {
+        TokenMemoryMeter meter;
+        PackToken result = c1.evaluate(scope);
+        REQUIRE(meter.allocations() >= 2);
+        REQUIRE(meter.allocatedBytes() >= 2 * sizeof(TokenTyped<QString>));
+        REQUIRE(meter.peakBytes() >= meter.liveBytes());
+        // The result is still held:
+        REQUIRE(meter.liveBytes() > 0);
+
+        TokenMemoryMeter inner;
+        c2.evaluate(scope);
+        REQUIRE(inner.allocations() > 0);
+        REQUIRE(inner.liveBytes() == 0);
+        REQUIRE(meter.allocations() > inner.allocations());
+    }
+
+    {
+        TokenMemoryMeter meter;
+        c1.evaluate(scope);
+        REQUIRE(meter.liveBytes() == 0);
+        REQUIRE(meter.peakBytes() > 0);
+    }
+
+    // The memory held by compiled expressions and maps:
+    Calculator c3("'" + QString("x").repeated(1000) + "'");
+    REQUIRE(c3.retainedBytes() >= 1000 * sizeof(QChar));
+    REQUIRE(c3.retainedBytes() > Calculator("1").retainedBytes());
+
+    // The backends are counted apart, as copies share them:
+    REQUIRE(c3.backendBytes() == 0);
+    c3.setBackend(Calculator::RegisterBackend);
+    REQUIRE(c3.backendBytes() >= 1000 * sizeof(QChar));
+    c3.setBackend(Calculator::ExecutionTreeBackend);
+    REQUIRE(c3.backendBytes() >= 1000 * sizeof(QChar));
+
+    Calculator c4("s.len() + s.len() * 2");
+    c4.setBackend(Calculator::RegisterBackend);
+    const quint64 backend = c4.backendBytes();
+    REQUIRE(backend > sizeof(Token *));
+    REQUIRE(Calculator(c4).backendBytes() == backend);
+
+    const quint64 bytes = retainedBytes(&scope);
+    REQUIRE(bytes >= sizeof(TokenMap) + 3 * sizeof(QChar));
+    scope["self"] = scope;
+    REQUIRE(retainedBytes(&scope) > bytes);
+    scope.map().erase("self");
+}
+
 CParseTest::CParseTest()
 {
     cparse::initialize();
@@ -0,0 +1,302 @@
+#include "tokenallocation.h"
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+
+#include "containers.h"
+#include "reftoken.h"
+
+using namespace cparse;
+
+std::atomic<int> Token::accounting{0};
+
+namespace {
+    std::atomic<TokenAllocationHook *> installedHook{nullptr};
+    thread_local TokenMemoryMeter *innermostMeter = nullptr;
+
+    // Counts how many times accounting was turned on, so allocations of
+    // an earlier period are not mistaken for those of the current one:
+    std::atomic<quint64> accountingPeriod{0};
+    std::mutex accountingMutex;
+
+    // The tokens allocated on this thread and not constructed yet. They
+    // nest when the arguments of a token's constructor allocate tokens:
+    struct Allocation
+    {
+        const void *ptr;
+        std::size_t size;
+        quint64 period;
+    };
+
+    constexpr int maxAllocations = 8;
+    thread_local Allocation allocations[maxAllocations];
+    thread_local int allocationCount = 0;
+
+    // The token being destroyed on this thread, whose type is lost by the
+    // time its memory is released:
+    struct Release
+    {
+        const void *ptr;
+        TokenType type;
+    };
+
+    thread_local Release releasing{};
+
+    quint64 countRetained(const Token *token, std::set<const void *> *counted)
+    {
+        if (token->m_type & REF) {
+            return sizeof(RefToken) + countRetained(static_cast<const RefToken *>(token)->m_key.token(), counted);
+        }
+
+        switch (token->m_type) {
+        case INT:
+            return sizeof(TokenTyped<qint64>);
+        case REAL:
+            return sizeof(TokenTyped<qreal>);
+        case BOOL:
+            return sizeof(TokenTyped<uint8_t>);
+        case STR:
+        case VAR:
+        case OP:
+            return sizeof(TokenTyped<QString>) + quint64(static_cast<const TokenTyped<QString> *>(token)->m_val.size()) * sizeof(QChar);
+        case LIST:
+        case TUPLE:
+        case STUPLE: {
+            const TokenList::ListType &list = static_cast<const TokenList *>(token)->list();
+            quint64 bytes = sizeof(TokenList);
+
+            if (counted->insert(&list).second) {
+                for (const PackToken &element : list) {
+                    bytes += sizeof(PackToken) + countRetained(element.token(), counted);
+                }
+            }
+
+            return bytes;
+        }
+        case MAP: {
+            const TokenMap::MapType &map = static_cast<const TokenMap *>(token)->map();
+            quint64 bytes = sizeof(TokenMap);
+
+            if (counted->insert(&map).second) {
+                for (const auto &[key, value] : map) {
+                    bytes += sizeof(QString) + quint64(key.size()) * sizeof(QChar) + sizeof(PackToken) + countRetained(value.token(), counted);
+                }
+            }
+
+            return bytes;
+        }
+        default:
+            return sizeof(Token);
+        }
+    }
+}
+
+/* * * * * Accounting of class Token * * * * */
+
+void Token::startAccounting()
+{
+    std::lock_guard<std::mutex> lock(accountingMutex);
+
+    if (accounting.load() == 0) {
+        ++accountingPeriod;
+    }
+
+    ++accounting;
+}
+
+void Token::stopAccounting()
+{
+    std::lock_guard<std::mutex> lock(accountingMutex);
+    --accounting;
+}
+
+void Token::accountAllocation(void *ptr, std::size_t size)
+{
+    // Deeper nestings are not counted:
+    if (allocationCount == maxAllocations) {
+        std::move(allocations + 1, allocations + maxAllocations, allocations);
+        --allocationCount;
+    }
+
+    allocations[allocationCount++] = {ptr, size, accountingPeriod.load(std::memory_order_acquire)};
+}
+
+void Token::reportConstruction() const
+{
+    // Tokens constructed on the stack or within another object were not
+    // allocated:
+    for (int i = allocationCount - 1; i >= 0; --i) {
+        if (allocations[i].ptr != this) {
+            continue;
+        }
+
+        const Allocation allocation = allocations[i];
+        std::move(allocations + i + 1, allocations + allocationCount, allocations + i);
+        --allocationCount;
+
+        if (allocation.period == accountingPeriod.load(std::memory_order_acquire)) {
+            reportAllocation(m_type, allocation.size);
+        }
+
+        return;
+    }
+}
+
+void Token::accountRelease() const
+{
+    releasing = {this, m_type};
+}
+
+void Token::accountDeallocation(void *ptr, std::size_t size)
+{
+    if (releasing.ptr == ptr) {
+        reportRelease(releasing.type, size);
+        releasing = {};
+    }
+}
+
+void Token::reportAllocation(TokenType type, std::size_t size)
+{
+    if (TokenAllocationHook *hook = installedHook.load(std::memory_order_acquire)) {
+        hook->allocated(type, size);
+    }
+
+    for (TokenMemoryMeter *meter = innermostMeter; meter; meter = meter->m_outer) {
+        meter->allocated(size);
+    }
+}
+
+void Token::reportRelease(TokenType type, std::size_t size)
+{
+    if (TokenAllocationHook *hook = installedHook.load(std::memory_order_acquire)) {
+        hook->released(type, size);
+    }
+
+    for (TokenMemoryMeter *meter = innermostMeter; meter; meter = meter->m_outer) {
+        meter->released(size);
+    }
+}
+
+TokenAllocationHook *cparse::setTokenAllocationHook(TokenAllocationHook *hook)
+{
+    TokenAllocationHook *previous = installedHook.exchange(hook);
+
+    if (hook && !previous) {
+        Token::startAccounting();
+    } else if (!hook && previous) {
+        Token::stopAccounting();
+    }
+
+    return previous;
+}
+
+/* * * * * class TokenAllocationCounter * * * * */
+
+TokenAllocationCounter::TokenAllocationCounter()
+{
+    reset();
+}
+
+void TokenAllocationCounter::allocated(TokenType type, std::size_t bytes)
+{
+    m_allocations[type & ANY_TYPE].fetch_add(1, std::memory_order_relaxed);
+    m_bytes[type & ANY_TYPE].fetch_add(bytes, std::memory_order_relaxed);
+
+    const qint64 live = m_live.fetch_add(qint64(bytes), std::memory_order_relaxed) + qint64(bytes);
+    qint64 peak = m_peak.load(std::memory_order_relaxed);
+
+    while (live > peak && !m_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+}
+
+void TokenAllocationCounter::released(TokenType, std::size_t bytes)
+{
+    m_live.fetch_sub(qint64(bytes), std::memory_order_relaxed);
+}
+
+TokenAllocationCounter::UsageByType TokenAllocationCounter::allocations() const
+{
+    UsageByType usage;
+
+    for (int type = 0; type <= ANY_TYPE; ++type) {
+        if (const quint64 allocations = m_allocations[type].load(std::memory_order_relaxed)) {
+            usage[TokenType(type)] = {allocations, m_bytes[type].load(std::memory_order_relaxed)};
+        }
+    }
+
+    return usage;
+}
+
+qint64 TokenAllocationCounter::liveBytes() const
+{
+    return m_live.load(std::memory_order_relaxed);
+}
+
+qint64 TokenAllocationCounter::peakBytes() const
+{
+    return m_peak.load(std::memory_order_relaxed);
+}
+
+void TokenAllocationCounter::reset()
+{
+    for (int type = 0; type <= ANY_TYPE; ++type) {
+        m_allocations[type] = 0;
+        m_bytes[type] = 0;
+    }
+
+    m_live = 0;
+    m_peak = 0;
+}
+
+/* * * * * class TokenMemoryMeter * * * * */
+
+TokenMemoryMeter::TokenMemoryMeter() : m_outer(innermostMeter)
+{
+    Token::startAccounting();
+    innermostMeter = this;
+}
+
+TokenMemoryMeter::~TokenMemoryMeter()
+{
+    innermostMeter = m_outer;
+    Token::stopAccounting();
+}
+
+quint64 TokenMemoryMeter::allocations() const
+{
+    return m_allocations;
+}
+
+quint64 TokenMemoryMeter::allocatedBytes() const
+{
+    return m_bytes;
+}
+
+qint64 TokenMemoryMeter::liveBytes() const
+{
+    return m_live;
+}
+
+qint64 TokenMemoryMeter::peakBytes() const
+{
+    return m_peak;
+}
+
+void TokenMemoryMeter::allocated(std::size_t bytes)
+{
+    ++m_allocations;
+    m_bytes += bytes;
+    m_live += qint64(bytes);
+    m_peak = std::max(m_peak, m_live);
+}
+
+void TokenMemoryMeter::released(std::size_t bytes)
+{
+    m_live -= qint64(bytes);
+}
+
+quint64 cparse::retainedBytes(const Token *token)
+{
+    std::set<const void *> counted;
+    return countRetained(token, &counted);
+}